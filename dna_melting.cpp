@@ -8,6 +8,33 @@
 #include <fstream>
 #include <strstream>
 #include <cmath>
+#include <string>
+#include <string_view>
+#include <sstream>
+#include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cerrno>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dna_melting.h"
 using namespace std;
 
 #define SMALL 0.001
@@ -15,1005 +42,4421 @@ using namespace std;
 
 
 
-double wallace_rule(double sequence_length, double a_count , double c_count, double g_count, double t_count)
+/***************************************  
+        Melting curve files
+***************************************/
+
+
+double melting_curve(const char *filename, double deltah, double deltas, double dna_conc, const curve_grid &grid)
   {
-    //Marmur and Doty, 1962
+    //Two-state melting curve, deltah in cal/mol and deltas in cal/(K mol)
 
-    double wallace_melting_temperature;
+    vector<double> t, f;
+    sample_melting_curve(deltah, deltas, dna_conc, grid, t, f);
 
-    if (sequence_length <= 15)
-      {
-	wallace_melting_temperature=2*(a_count+t_count)+4*(c_count+g_count);
-      }
-    else
-      {
-	wallace_melting_temperature=69.3+(((41*(c_count+g_count))/sequence_length)-(650/sequence_length));
-      }
+    ofstream fileout(filename);
+
+    for (size_t k=0; k<t.size(); k++){
+      fileout << t[k] << " " << f[k] << "\n";
+    }
 
-    return wallace_melting_temperature;
+    return 0;
   }
 
 
 
-double salt(double salt_conc, double a_count , double c_count, double g_count, double t_count)
+double bre_melting_curve(const sequence_thermo &thermo, double dna_conc, const curve_grid &grid = default_curve_grid)
   {
-    //Howley et al., 1979
+    return melting_curve("bre_melting_curve.out", bre_enthalpy(thermo), bre_entropy(thermo), dna_conc, grid);
+  }
 
-    double salt_adjusted_melting_temperature;
 
-    salt_adjusted_melting_temperature=81.5+16.6*log10(salt_conc)+41.0*((c_count+g_count)/(a_count+c_count+g_count+t_count))-(675.0/(a_count+c_count+g_count+t_count));
 
-    return salt_adjusted_melting_temperature;
+double san_melting_curve(const sequence_thermo &thermo, double dna_conc, const curve_grid &grid = default_curve_grid)
+  {
+    return melting_curve("san_melting_curve.out", san_enthalpy(thermo), san_entropy(thermo), dna_conc, grid);
   }
 
 
-double khandelwal(int sequence_length, string specie, double salt_conc, double dna_conc)
+
+double sug_melting_curve(const sequence_thermo &thermo, double dna_conc, const curve_grid &grid = default_curve_grid)
   {
-    //Khandelwal and Bhyravabhotla, 2010
-
-    double khandelwal_melting_temperature;
-
-    double ee;
-    double strength;
-    int i;
-
-    double gc=13;
-    double ac=10;
-    double gt=10;
-    double at=7;
-    double cc=11;
-    double tc=8;
-    double ct=8;
-    double tt=5;
-    double gg=11;
-    double ag=8;
-    double ga=8;
-    double aa=5;
-    double cg=10;
-    double tg=7;
-    double ca=7;
-    double ta=4;
-
-    i=0;
-    ee=0;
-
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') strength=strength+aa;
-	if (specie[i]=='A' && specie[i+1]=='C') strength=strength+ac;
-	if (specie[i]=='A' && specie[i+1]=='G') strength=strength+ag;
-	if (specie[i]=='A' && specie[i+1]=='T') strength=strength+at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') strength=strength+ca;
-	if (specie[i]=='C' && specie[i+1]=='C') strength=strength+cc;
-	if (specie[i]=='C' && specie[i+1]=='G') strength=strength+cg;
-	if (specie[i]=='C' && specie[i+1]=='T') strength=strength+ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') strength=strength+ga;
-	if (specie[i]=='G' && specie[i+1]=='C') strength=strength+gc;
-	if (specie[i]=='G' && specie[i+1]=='G') strength=strength+gg;
-	if (specie[i]=='G' && specie[i+1]=='T') strength=strength+gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') strength=strength+ta;
-	if (specie[i]=='T' && specie[i+1]=='C') strength=strength+tc;
-	if (specie[i]=='T' && specie[i+1]=='G') strength=strength+tg;
-	if (specie[i]=='T' && specie[i+1]=='T') strength=strength+tt;
-      }
+    return melting_curve("sug_melting_curve.out", sug_enthalpy(thermo), sug_entropy(thermo), dna_conc, grid);
+  }
 
-    ee = strength/sequence_length;
 
-    khandelwal_melting_temperature=7.35*ee+17.34*log(sequence_length)+4.96*log(salt_conc)+0.89*log(dna_conc)-25.42;
 
-    return khandelwal_melting_temperature;
+/***************************************  
+      Binary melting curve files
+***************************************/
 
-  }
+//Indexed binary curve file (native byte order, every field 8-byte aligned):
+//  "DNAMCURV"  u32 version  u32 value size (4: float32, 8: float64)
+//  u64 entries  u64 index offset
+//  entries, one per (record, model):
+//    u64 id length, id (padded to 8 bytes)
+//    u32 model (0 bre, 1 san, 2 sug)  u32 points
+//    f64 salt conc  f64 dna conc  f64 deltah (cal/mol)  f64 deltas (cal/(K mol))
+//    t[points]  f[points]  (value size each, padded to 8 bytes)
+//  index: u64 offset of every entry
+#define CURVE_MAGIC      "DNAMCURV"
+#define CURVE_VERSION    1
+#define CURVE_TEXT       0
+#define CURVE_FLOAT32    4
+#define CURVE_FLOAT64    8
 
+static const char *curve_model_names[NN_MODELS] = {"bre", "san", "sug"};
 
 
-double bre_nearest_neighbor(int sequence_length, string specie, double salt_conc, double dna_conc, double a_count, double c_count, double g_count, double t_count)
-  {
-    //Breslauer, Frank, Blocker and Marky, 1986
-
-    double nearest_neighbor_melting_temperature;
-
-    int i;
-    double simm_corr;
-    double non_self_compl;
-    double only_at;
-    double any_cg;          
-
-    //deltaS
-    simm_corr=-1.34;	 //kcal/(K mol)
-    non_self_compl=0.0;  //kcal/(K mol)
-    only_at=-20.13;	 //kcal/(K mol)
-    any_cg=-16.77;          //kcal/(K mol)
-
-    double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
-    double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-    double deltah_d, deltas_d, deltas_self;
-
-    deltah_d=0;
-    deltas_d=0;
-
-    i=0;
-
-    //Enthaply
-    //kcal/mol
-    h_aa=h_tt=-9.1;
-    h_at=-8.6;
-    h_ta=-6.0;
-    h_ca=h_tg=-5.8;
-    h_gt=h_ac=-6.5;
-    h_ct=h_ag=-7.8;
-    h_ga=h_tc=-5.6;
-    h_cg=-11.9;
-    h_gc=-11.1;
-    h_gg=h_cc=-11.0;
-
-
-    //Entropy
-    //cal/(K mol)
-    s_aa=s_tt=-24.0;
-    s_at=-23.9;
-    s_ta=-16.9;
-    s_ca=s_tg=-12.9;
-    s_gt=s_ac=-17.3;
-    s_ct=s_ag=-20.8;
-    s_ga=s_tc=-13.5;
-    s_cg=-27.8;
-    s_gc=-26.7;
-    s_gg=s_cc=-26.6;
-
-
-//ENTHALPY
-//kcal/mol
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltah_d=deltah_d+h_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltah_d=deltah_d+h_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltah_d=deltah_d+h_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltah_d=deltah_d+h_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltah_d=deltah_d+h_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltah_d=deltah_d+h_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltah_d=deltah_d+h_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltah_d=deltah_d+h_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltah_d=deltah_d+h_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltah_d=deltah_d+h_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltah_d=deltah_d+h_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltah_d=deltah_d+h_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltah_d=deltah_d+h_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltah_d=deltah_d+h_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltah_d=deltah_d+h_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltah_d=deltah_d+h_tt;
-      }
+static void append_u64(string &blob, unsigned long long value)
+{
+  blob.append((const char *) &value, 8);
+}
 
 
-    //ENTROPY
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltas_d=deltas_d+s_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltas_d=deltas_d+s_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltas_d=deltas_d+s_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltas_d=deltas_d+s_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltas_d=deltas_d+s_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltas_d=deltas_d+s_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltas_d=deltas_d+s_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltas_d=deltas_d+s_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltas_d=deltas_d+s_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltas_d=deltas_d+s_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltas_d=deltas_d+s_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltas_d=deltas_d+s_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltas_d=deltas_d+s_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltas_d=deltas_d+s_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltas_d=deltas_d+s_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltas_d=deltas_d+s_tt;
 
-      }
+static void append_padding(string &blob)
+{
+  if (blob.size() % 8) blob.append(8 - blob.size() % 8, '\0');
+}
 
-    double R=1.987; //cal/(K mol)
 
-    double b;
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) b=1;
-    else b=4;
 
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) deltas_self=simm_corr;
+void encode_curve_entry(string &blob, string_view id, int model, double salt_conc, double dna_conc, double deltah, double deltas, const double *t, const double *f, int points, int value_size)
+{
+  //Append one curve entry to blob (which must start 8-byte aligned)
+
+  append_u64(blob, id.length());
+  blob.append(id.data(), id.length());
+  append_padding(blob);
 
+  unsigned int header[2] = {(unsigned int) model, (unsigned int) points};
+  blob.append((const char *) header, sizeof(header));
+  double conditions[4] = {salt_conc, dna_conc, deltah, deltas};
+  blob.append((const char *) conditions, sizeof(conditions));
 
-    else deltas_self=non_self_compl;
+  for (int column=0; column<2; column++)
+    {
+      const double *values = column == 0 ? t : f;
+      if (value_size == CURVE_FLOAT64) blob.append((const char *) values, 8*(size_t) points);
+      else
+	for (int k=0; k<points; k++)
+	  {
+	    float value = values[k];
+	    blob.append((const char *) &value, 4);
+	  }
+    }
+  append_padding(blob);
+}
 
-    double deltah_i=0;
-    double deltas_i;
 
-    if (c_count==0 && g_count==0) deltas_i=only_at;
-    else deltas_i=any_cg;
 
-    //enthalpy&R in cal 
-    double num=deltah_d*1000+deltah_i*1000;
-    double den=deltas_d+deltas_i+deltas_self+R*log(dna_conc/b);
-    double salt_adj=16.6*log10(salt_conc);
+class curve_file_writer
+{
+  //Appends encoded entries through a large stream buffer and keeps their
+  //offsets; close() writes the index and patches the header
 
-    nearest_neighbor_melting_temperature=num/den+salt_adj;
+public:
 
-    return nearest_neighbor_melting_temperature;
+  curve_file_writer() : buffer(1<<20), entries(0), position(0) {}
 
+  bool open(const char *filename, int value_size)
+  {
+    fileout.rdbuf()->pubsetbuf(&buffer[0], buffer.size());
+    fileout.open(filename, ios::binary);
+    if (!fileout.is_open()) return false;
+
+    fileout.write(CURVE_MAGIC, 8);
+    unsigned int header[2] = {CURVE_VERSION, (unsigned int) value_size};
+    fileout.write((const char *) header, sizeof(header));
+    write_u64(0);
+    write_u64(0);
+    position = 32;
+    return true;
   }
 
+  //Write a blob holding "count" consecutive entries of the given sizes
+  void append(const string &blob, const size_t *sizes, int count)
+  {
+    fileout.write(blob.data(), blob.size());
+    for (int k=0; k<count; k++)
+      {
+	offsets.push_back(position);
+	position += sizes[k];
+      }
+    entries += count;
+  }
 
-
-double san_nearest_neighbor(int sequence_length, string specie, double salt_conc, double dna_conc, double a_count, double c_count, double g_count, double t_count)
+  bool close()
   {
-    //SantaLucia, Allawi and Seneviratne, 1996
+    unsigned long long index = position;
+    if (!offsets.empty()) fileout.write((const char *) &offsets[0], 8*offsets.size());
+    fileout.seekp(16);
+    write_u64(entries);
+    write_u64(index);
+    fileout.close();
+    return !fileout.fail();
+  }
 
-    double nearest_neighbor_melting_temperature;
+private:
 
-    int i;
-    double simm_corr;
-    double non_self_compl;
-    double only_at;
-    double any_cg;          
+  void write_u64(unsigned long long value)
+  {
+    fileout.write((const char *) &value, 8);
+  }
 
+  vector<char> buffer;
+  ofstream fileout;
+  vector<unsigned long long> offsets;
+  unsigned long long entries;
+  unsigned long long position;
+};
 
 
-    //deltaS
-    simm_corr=-1.4;	 //kcal/(K mol)
-    non_self_compl=0.0;  //kcal/(K mol)
-    only_at=-9.0;	 //kcal/(K mol)
-    any_cg=-5.9;          //kcal/(K mol)
 
+/***************************************  
+        Instrumentation (--stats)
+***************************************/
 
-    double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
-    double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-    double deltah_d, deltas_d, deltas_self;
+//Stage timers and counters of the batch and scan pipelines, written as
+//JSON to stderr at exit with --stats. Without --stats they cost one
+//predictable branch per record; built with -DDNA_MELTING_NO_STATS they
+//are not compiled at all
+#define STAGE_READ    0  //input parsing
+#define STAGE_SUMMARY 1  //base counts, dinucleotides and NN sums
+#define STAGE_METHODS 2  //Tm of the requested methods
+#define STAGE_FORMAT  3  //output rows
+#define STAGE_CURVES  4  //melting curves, evaluated and formatted or encoded
+#define STAGE_WRITE   5  //output writes
+#define STAGE_SCAN    6  //window updates, Tm and rows of --scan
+#define STAGES        7
 
-    deltah_d=0;
-    deltas_d=0;
+//Every STATS_SAMPLE-th record of a worker has each requested method
+//timed alone, STATS_REPEAT times in a row
+#define STATS_METHODS 7
+#define STATS_SAMPLE  64
+#define STATS_REPEAT  8
 
-    i=0;
+#ifndef DNA_MELTING_NO_STATS
 
-    //Enthalpy
-    //kcal/(mol
-    h_aa=h_tt=-8.4;
-    h_at=-6.5;
-    h_ta=-6.3;
-    h_ca=h_tg=-7.4;
-    h_gt=h_ac=-8.6;
-    h_ct=h_ag=-6.1;
-    h_ga=h_tc=-7.7;
-    h_cg=-10.1;
-    h_gc=-11.1;
-    h_gg=h_cc=-6.7;
+typedef chrono::steady_clock stats_clock;
+typedef stats_clock::time_point stats_time;
 
+static const char *stage_names[STAGES] = {"read", "summary", "methods", "format", "curves", "write", "scan"};
+static const char *stats_method_names[STATS_METHODS] = {"wallace", "salt", "khandelwal", "bre", "san", "sug", "consensus"};
 
-    //Entropy
-    //cal/(K mol)
-    s_aa=s_tt=-23.6;
-    s_at=-18.8;
-    s_ta=-18.5;
-    s_ca=s_tg=-19.3;
-    s_gt=s_ac=-23.0;
-    s_ct=s_ag=-16.1;
-    s_ga=s_tc=-20.3;
-    s_cg=-25.5;
-    s_gc=-28.4;
-    s_gg=s_cc=-15.6;
 
+struct worker_stats
+{
+  long long stage_ns[STAGES];
+  long long method_ns[STATS_METHODS];
+  long method_samples;
+  long records;      //records seen, for sampling
+  long tasks;
+  char padding[64];  //workers do not share cache lines
+};
 
-//ENTHALPY
-//kcal/mol
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltah_d=deltah_d+h_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltah_d=deltah_d+h_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltah_d=deltah_d+h_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltah_d=deltah_d+h_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltah_d=deltah_d+h_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltah_d=deltah_d+h_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltah_d=deltah_d+h_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltah_d=deltah_d+h_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltah_d=deltah_d+h_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltah_d=deltah_d+h_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltah_d=deltah_d+h_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltah_d=deltah_d+h_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltah_d=deltah_d+h_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltah_d=deltah_d+h_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltah_d=deltah_d+h_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltah_d=deltah_d+h_tt;
-      }
 
+struct run_stats
+{
+  bool enabled;
+  const char *mode;
+  stats_time start;
+  long records_read;
+  long records_processed;
+  long records_skipped;
+  long long bases;
+  long long bytes_written;
+  long long curve_bytes;
+  long long parallel_ns;       //wall time spent in work_stealing_pool::run()
+  long long stage_ns[STAGES];  //main thread, outside the pool
+  vector<worker_stats> workers;
+};
 
-    //ENTROPY
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltas_d=deltas_d+s_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltas_d=deltas_d+s_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltas_d=deltas_d+s_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltas_d=deltas_d+s_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltas_d=deltas_d+s_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltas_d=deltas_d+s_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltas_d=deltas_d+s_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltas_d=deltas_d+s_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltas_d=deltas_d+s_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltas_d=deltas_d+s_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltas_d=deltas_d+s_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltas_d=deltas_d+s_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltas_d=deltas_d+s_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltas_d=deltas_d+s_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltas_d=deltas_d+s_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltas_d=deltas_d+s_tt;
+static run_stats stats;
 
-      }
 
-    double R=1.987; //cal/(K mol)
+#define STATS_START(t)            stats_time t = stats.enabled ? stats_clock::now() : stats_time()
+#define STATS_LAP(t, counter)     do { if (stats.enabled) stats_lap(t, counter); } while (0)
+#define STATS_ADD(counter, value) do { if (stats.enabled) (counter) += (value); } while (0)
 
-    double b;
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) b=1;
-    else b=4;
 
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) deltas_self=simm_corr;
+static inline void stats_lap(stats_time &t, long long &counter)
+{
+  //Add the time since t to counter and restart t
+  stats_time now = stats_clock::now();
+  counter += chrono::duration_cast<chrono::nanoseconds>(now - t).count();
+  t = now;
+}
 
 
-    else deltas_self=non_self_compl;
 
-    double deltah_i=0;
-    double deltas_i;
+void stats_begin(const char *mode)
+{
+  stats.enabled = true;
+  stats.mode = mode;
+  stats.start = stats_clock::now();
+}
 
-    if (c_count==0 && g_count==0) deltas_i=only_at;
-    else deltas_i=any_cg;
 
-    //enthalpy&R in cal 
-    double num=deltah_d*1000+deltah_i*1000;
-    double den=deltas_d+deltas_i+deltas_self+R*log(dna_conc/b);
-    double salt_adj=16.6*log10(salt_conc);
 
-    nearest_neighbor_melting_temperature=num/den+salt_adj;
+void stats_workers(int workers)
+{
+  //One slot per pool worker; kept when a later pool is smaller
+  if ((int) stats.workers.size() < workers) stats.workers.resize(workers, worker_stats());
+}
 
-    return nearest_neighbor_melting_temperature;
 
-  }
 
+void stats_sample_methods(const sequence_thermo &thermo, double salt_conc, double dna_conc, int methods, worker_stats &worker)
+{
+  //melting_from_thermo() shares work between the methods, so the batch
+  //only sees their sum: time each requested method alone on this record
+  volatile double sink;
+  int consensus_class;
 
+  for (int m=0; m<STATS_METHODS; m++)
+    {
+      if (!(methods & (1 << m))) continue;
+      stats_time start = stats_clock::now();
+      for (int r=0; r<STATS_REPEAT; r++)
+	{
+	  if (m == 0) sink = wallace_rule(thermo);
+	  else if (m == 1) sink = salt(thermo, salt_conc);
+	  else if (m == 2) sink = khandelwal(thermo, salt_conc, dna_conc);
+	  else if (m < 6) sink = nn_melting_temperature(thermo, m-3, salt_conc, dna_conc);
+	  else sink = consensus(thermo, salt_conc, dna_conc, consensus_class);
+	}
+      worker.method_ns[m] += chrono::duration_cast<chrono::nanoseconds>(stats_clock::now() - start).count();
+    }
+  worker.method_samples++;
+  (void) sink;  //the volatile stores keep the calls, this read keeps -Wextra quiet
+}
 
 
-double sug_nearest_neighbor(int sequence_length, string specie, double salt_conc, double dna_conc, double a_count, double c_count, double g_count, double t_count)
-  {
-    //Sugimoto, Nakano, Yoneyama and Honda, 1996
-
-    double nearest_neighbor_melting_temperature;
-
-    int i;
-    double simm_corr;
-    double non_self_compl;
-    double only_at;
-    double any_cg;          
-
-
-    //deltaS
-    simm_corr=-1.4;	 //kcal/(K mol)
-    non_self_compl=0.0;  //kcal/(K mol)
-    only_at=-9.0;	 //kcal/(K mol)
-    any_cg=-9.0;          //kcal/(K mol)
-
-
-    double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
-    double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-    double deltah_d, deltas_d, deltas_self;
-
-    deltah_d=0;
-    deltas_d=0;
-
-    i=0;
-
-    //Enthalpy
-    //kcal/(mol
-    h_aa=h_tt=-8.0;
-    h_at=-5.6;
-    h_ta=-6.6;
-    h_ca=h_tg=-8.2;
-    h_gt=h_ac=-9.4;
-    h_ct=h_ag=-6.6;
-    h_ga=h_tc=-8.8;
-    h_cg=-11.8;
-    h_gc=-10.5;
-    h_gg=h_cc=-10.9;
-
-
-    //Entropy
-    //cal/(K mol)
-    s_aa=s_tt=-21.9;
-    s_at=-15.2;
-    s_ta=-18.4;
-    s_ca=s_tg=-21.0;
-    s_gt=s_ac=-25.5;
-    s_ct=s_ag=-16.4;
-    s_ga=s_tc=-23.5;
-    s_cg=-29.0;
-    s_gc=-26.4;
-    s_gg=s_cc=-28.4;
-
-
-//ENTHALPY
-//kcal/mol
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltah_d=deltah_d+h_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltah_d=deltah_d+h_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltah_d=deltah_d+h_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltah_d=deltah_d+h_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltah_d=deltah_d+h_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltah_d=deltah_d+h_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltah_d=deltah_d+h_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltah_d=deltah_d+h_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltah_d=deltah_d+h_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltah_d=deltah_d+h_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltah_d=deltah_d+h_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltah_d=deltah_d+h_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltah_d=deltah_d+h_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltah_d=deltah_d+h_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltah_d=deltah_d+h_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltah_d=deltah_d+h_tt;
-      }
 
-    //ENTROPY
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltas_d=deltas_d+s_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltas_d=deltas_d+s_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltas_d=deltas_d+s_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltas_d=deltas_d+s_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltas_d=deltas_d+s_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltas_d=deltas_d+s_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltas_d=deltas_d+s_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltas_d=deltas_d+s_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltas_d=deltas_d+s_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltas_d=deltas_d+s_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltas_d=deltas_d+s_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltas_d=deltas_d+s_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltas_d=deltas_d+s_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltas_d=deltas_d+s_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltas_d=deltas_d+s_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltas_d=deltas_d+s_tt;
+void write_stats(ostream &out)
+{
+  //Counters, seconds per stage (summed over threads) and utilization of
+  //every pool worker (busy time over the wall time spent in the pool)
 
-      }
+  double wall = chrono::duration<double>(stats_clock::now() - stats.start).count();
+  long long stage_ns[STAGES];
+  long long method_ns[STATS_METHODS] = {0};
+  long method_samples = 0;
 
-    double R=1.987; //cal/(K mol)
+  for (int s=0; s<STAGES; s++)
+    {
+      stage_ns[s] = stats.stage_ns[s];
+      for (size_t w=0; w<stats.workers.size(); w++) stage_ns[s] += stats.workers[w].stage_ns[s];
+    }
+  for (size_t w=0; w<stats.workers.size(); w++)
+    {
+      for (int m=0; m<STATS_METHODS; m++) method_ns[m] += stats.workers[w].method_ns[m];
+      method_samples += stats.workers[w].method_samples;
+    }
 
-    double b;
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) b=1;
-    else b=4;
+  out << "{\n";
+  out << "  \"mode\": \"" << stats.mode << "\",\n";
+  out << "  \"wall_s\": " << wall << ",\n";
+  out << "  \"records_read\": " << stats.records_read << ",\n";
+  out << "  \"records_processed\": " << stats.records_processed << ",\n";
+  out << "  \"records_skipped\": " << stats.records_skipped << ",\n";
+  out << "  \"bases\": " << stats.bases << ",\n";
+  out << "  \"bytes_written\": " << stats.bytes_written << ",\n";
+  out << "  \"curve_bytes_written\": " << stats.curve_bytes << ",\n";
+  out << "  \"records_per_s\": " << (wall > 0 ? stats.records_read/wall : 0) << ",\n";
+  out << "  \"bases_per_s\": " << (wall > 0 ? stats.bases/wall : 0) << ",\n";
+
+  out << "  \"stage_s\": {";
+  for (int s=0; s<STAGES; s++) out << (s ? ", " : "") << "\"" << stage_names[s] << "\": " << stage_ns[s]*1e-9;
+  out << "},\n";
+
+  out << "  \"method_samples\": " << method_samples << ",\n";
+  out << "  \"method_ns_per_record\": {";
+  bool first = true;
+  for (int m=0; m<STATS_METHODS; m++)
+    {
+      if (method_ns[m] == 0) continue;
+      out << (first ? "" : ", ") << "\"" << stats_method_names[m] << "\": " << (double) method_ns[m]/(method_samples*STATS_REPEAT);
+      first = false;
+    }
+  out << "},\n";
 
-    if (specie[i]==specie[sequence_length] && specie[i+1]==specie[sequence_length-1] && specie[i+2]==specie[sequence_length-2]  && specie[i+3]==specie[sequence_length-3] && specie[i+4]==specie[sequence_length-4] && specie[i+5]==specie[sequence_length-5]) deltas_self=simm_corr;
+  out << "  \"parallel_s\": " << stats.parallel_ns*1e-9 << ",\n";
+  out << "  \"threads\": [";
+  for (size_t w=0; w<stats.workers.size(); w++)
+    {
+      const worker_stats &worker = stats.workers[w];
+      long long busy = 0;
+      for (int s=0; s<STAGES; s++) busy += worker.stage_ns[s];
+      out << (w ? ",\n" : "\n") << "    {\"thread\": " << w << ", \"tasks\": " << worker.tasks << ", \"busy_s\": " << busy*1e-9
+	  << ", \"utilization\": " << (stats.parallel_ns > 0 ? (double) busy/stats.parallel_ns : 0) << "}";
+    }
+  out << (stats.workers.empty() ? "" : "\n  ") << "]\n";
+  out << "}" << std::endl;
+}
 
+#else
 
-    else deltas_self=non_self_compl;
+#define STATS_START(t)
+#define STATS_LAP(t, counter)
+#define STATS_ADD(counter, value)
 
-    double deltah_i=0;
-    double deltas_i;
+#endif
 
-    if (c_count==0 && g_count==0) deltas_i=only_at;
-    else deltas_i=any_cg;
 
-    //enthalpy&R in cal 
-    double num=deltah_d*1000+deltah_i*1000;
-    double den=deltas_d+deltas_i+deltas_self+R*log(dna_conc/b);
-    double salt_adj=16.6*log10(salt_conc);
 
-    nearest_neighbor_melting_temperature=num/den+salt_adj;
+/***************************************  
+               Batch mode
+***************************************/
 
-    return nearest_neighbor_melting_temperature;
+//Methods that can be selected with --methods are the METHOD_* flags of
+//dna_melting.h. Not methods: batch_row() also keeps the sums for the
+//melting curves, batch_format_row() adds the curve Tm, width and peak of
+//the three models, the deltaG and Tm of the most stable hairpin and the
+//Tm range of degenerate (IUPAC) sequences. OUTPUT_FLOAT32 computes the
+//NN Tm and the curves with the single precision path
+#define OUTPUT_CURVES     256
+#define OUTPUT_TRANSITION 512
+#define OUTPUT_HAIRPIN    1024
+#define OUTPUT_DEGENERATE 2048
+#define OUTPUT_FLOAT32    4096
 
-  }
+//Tables loaded with --nn-table, one <name>_tm column each
+static vector<nn_params> loaded_tables;
+static vector<string> loaded_table_names;
 
+//Hairpin search (--hairpin): SantaLucia stacks at 37 C, one workspace per worker
+static hairpin_model batch_hairpin_model;
+static vector<hairpin_workspace> hairpin_workspaces;
 
 
+int parse_methods(string methods)
+{
+  //Comma separated list of methods, e.g. "wallace,bre,consensus"
+  //Returns 0 if an unknown method is found
 
-double consensus(int sequence_length, string specie, double salt_conc, double dna_conc, double a_count, double c_count, double g_count, double t_count)
-  {
-    //Panjkovich and Melo, 2005
+  int mask = 0;
+  size_t start = 0;
 
-    double consensus_melting_temperature;
+  while (start <= methods.length())
+    {
+      size_t end = methods.find(',', start);
+      if (end == string::npos) end = methods.length();
+      string name = methods.substr(start, end-start);
+
+      if (name == "wallace" || name == "wallace_rule") mask |= METHOD_WALLACE;
+      else if (name == "salt") mask |= METHOD_SALT;
+      else if (name == "khandelwal") mask |= METHOD_KHANDELWAL;
+      else if (name == "bre" || name == "bre_nearest_neighbor") mask |= METHOD_BRE;
+      else if (name == "san" || name == "san_nearest_neighbor") mask |= METHOD_SAN;
+      else if (name == "sug" || name == "sug_nearest_neighbor") mask |= METHOD_SUG;
+      else if (name == "consensus") mask |= METHOD_CONSENSUS;
+      else if (name == "all") mask |= METHOD_ALL;
+      else return 0;
+
+      start = end+1;
+    }
 
-    int i;
+  return mask;
+}
 
-    double bre_tm = bre_nearest_neighbor(sequence_length, specie, salt_conc, dna_conc, a_count, c_count, g_count, t_count);
-    double san_tm = san_nearest_neighbor(sequence_length, specie, salt_conc, dna_conc, a_count, c_count, g_count, t_count);
-    double sug_tm = sug_nearest_neighbor(sequence_length, specie, salt_conc, dna_conc, a_count, c_count, g_count, t_count);
 
 
-    double gc_content = (c_count + g_count)/(a_count + c_count + g_count + t_count)*100;
+bool parse_concentration(const char *text, const char *end, double &value)
+{
+  //Concentration (M) in text that is not NUL terminated (a field in the
+  //record arena), after leading blanks and up to the next one: as in
+  //parse_grid() it must be a whole number > 0. value is only set if it is
+
+  while (text < end && isspace((unsigned char) *text)) text++;
+  const char *stop = text;
+  while (stop < end && !isspace((unsigned char) *stop)) stop++;
+  if (stop == text || stop-text > 63) return false;
+
+  char number[64], *last;
+  memcpy(number, text, stop-text);
+  number[stop-text] = 0;
+  double parsed = strtod(number, &last);
+  if (*last || !(parsed > 0) || parsed == HUGE_VAL) return false;
+  value = parsed;
+  return true;
+}
 
 
-    if (sequence_length>=16 && sequence_length<=18 && gc_content>=30 && gc_content<=50){
-      consensus_melting_temperature=(bre_tm+san_tm+sug_tm)/3;
-      cout << "Full consensus sequence " << endl;
-    }
 
-    if (sequence_length>=21 && sequence_length<=22 && gc_content>=0 && gc_content<=10 || sequence_length>=16 && sequence_length<=29 && gc_content>=10 && gc_content<=20 || sequence_length>=16 && sequence_length<=26 && gc_content>=20 && gc_content<=30 || sequence_length>=19 && sequence_length<=21 && gc_content>=30 && gc_content<=40){
-      consensus_melting_temperature=(bre_tm+sug_tm)/2;
-      cout << "Bre&Sug consensus sequence " << endl;
-    }
+bool parse_conditions(string_view text, double &salt_conc, double &dna_conc)
+{
+  //Per-record conditions given as "salt=<M>" and "dna=<M>" tokens
+  //(used in FASTA headers). Return false if one is not a valid
+  //concentration
 
-    if (sequence_length>=19 && sequence_length<=30 && gc_content>=40 && gc_content<=50 || sequence_length>=16 && sequence_length<=30 && gc_content>=50 && gc_content<=80 || sequence_length==16 && gc_content>=80 && gc_content<=90 || sequence_length==17 && gc_content>=80 && gc_content<=90 || sequence_length==20 && gc_content>=80 && gc_content<=90){
-      consensus_melting_temperature=(san_tm+sug_tm)/2;
-      cout << "San&Sug consensus sequence " << endl;
-    }
-    
-    else 
-      {
-      consensus_melting_temperature=(bre_tm+san_tm+sug_tm)/3;
-      cout << "Non-consensus sequence " << endl;
-      }
+  const char *end = text.data() + text.length();
+  bool valid = true;
 
-    return consensus_melting_temperature;
+  size_t pos = text.find("salt=");
+  if (pos != string_view::npos) valid = parse_concentration(text.data()+pos+5, end, salt_conc);
 
-  }
+  pos = text.find("dna=");
+  if (pos != string_view::npos) valid = parse_concentration(text.data()+pos+4, end, dna_conc) && valid;
+  return valid;
+}
 
 
-double bre_enthalpy(int sequence_length, string specie)
-  {
-    double bre_enthalpy;
-    double deltah;
-    int i;
 
-    deltah=0;
-    i=0;
+bool read_fasta_record(istream &filein, string &line, string &id, string &sequence, double &salt_conc, double &dna_conc)
+{
+  //Read the next record of a (multi-line) FASTA stream. On entry "line"
+  //holds the pending header (if any), on exit it holds the next one.
+  //Only one record is kept in memory at a time. Records with an invalid
+  //salt= or dna= are skipped with a warning
 
-    double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
+  while (true)
+    {
+      while (line.empty() || line[0] != '>')
+	{
+	  if (!getline(filein, line)) return false;
+	}
+
+      size_t blank = line.find_first_of(" \t");
+      id = line.substr(1, blank == string::npos ? string::npos : blank-1);
+      bool valid = parse_conditions(line, salt_conc, dna_conc);
+
+      sequence.clear();
+      line.clear();
+      while (getline(filein, line))
+	{
+	  if (!line.empty() && line[0] == '>') break;
+	  for (size_t i=0; i<line.length(); i++)
+	    if (!isspace((unsigned char) line[i])) sequence += toupper((unsigned char) line[i]);
+	}
+      if (line.empty() || line[0] != '>') line.clear();
+
+      if (valid) return true;
+      std::cerr << "[WARNING]: record " << id << " skipped, invalid salt or DNA concentration" << std::endl;
+    }
+}
 
 
 
-    //Enthaply
-    //kcal/mol
-    h_aa=h_tt=-9.1;
-    h_at=-8.6;
-    h_ta=-6.0;
-    h_ca=h_tg=-5.8;
-    h_gt=h_ac=-6.5;
-    h_ct=h_ag=-7.8;
-    h_ga=h_tc=-5.6;
-    h_cg=-11.9;
-    h_gc=-11.1;
-    h_gg=h_cc=-11.0;
+//Input read by record_reader at a time; a record longer than a chunk
+//gets a chunk of its own
+#define ARENA_CHUNK (1 << 22)
 
 
+class record_reader
+{
+  //FASTA or TSV records (told by the first non blank character) read in
+  //large chunks into an arena and tokenized in place: ids are views
+  //into their header or line, sequences are uppercased and stripped of
+  //whitespace by compacting them over their own text (FASTA records as
+  //read_fasta_record() reads them).
+  //A record whose salt or DNA concentration is not a number > 0 is still
+  //returned, with invalid set, so that it is reported in input order.
+  //The records returned by next() stay valid until recycle(); their
+  //chunks are then reused for the following input, so a stream of any
+  //number of records costs a constant number of allocations. Without
+  //recycle() every record stays valid until the reader is destroyed
+
+public:
+
+  record_reader(istream &input) : invalid(false), filein(input), pos(0), end(0), scan(0), eof(false), pinned(false)
+  {
+    filein >> ws;
+    fasta = (filein.peek() == '>');
+    chunk.resize(ARENA_CHUNK);
+  }
 
-//ENTHALPY
-//kcal/mol
-    for(i=0; i<sequence_length-1; i++)
+  //salt_conc and dna_conc are only set if the record gives them
+  bool next(string_view &id, string_view &sequence, double &salt_conc, double &dna_conc)
+  {
+    while (true)
       {
-	if (specie[i]=='A' && specie[i+1]=='A') deltah=deltah+h_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltah=deltah+h_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltah=deltah+h_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltah=deltah+h_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltah=deltah+h_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltah=deltah+h_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltah=deltah+h_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltah=deltah+h_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltah=deltah+h_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltah=deltah+h_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltah=deltah+h_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltah=deltah+h_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltah=deltah+h_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltah=deltah+h_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltah=deltah+h_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltah=deltah+h_tt;
+	size_t record_end, next_pos;
+	if (find_record(record_end, next_pos))
+	  {
+	    char *text = &chunk[pos];
+	    size_t length = record_end-pos;
+	    pos = next_pos;
+	    scan = 0;
+	    invalid = false;
+	    bool parsed = fasta ? tokenize_fasta(text, length, id, sequence, salt_conc, dna_conc)
+	      : tokenize_tsv(text, length, id, sequence, salt_conc, dna_conc);
+	    if (parsed)
+	      {
+		pinned = true;
+		return true;
+	      }
+	    continue;
+	  }
+	if (eof) return false;
+	refill();
       }
+  }
 
+  //The records returned so far are no longer used
+  void recycle()
+  {
+    for (size_t k=0; k<used.size(); k++) spare.push_back(std::move(used[k]));
+    used.clear();
+    pinned = false;
+  }
 
-    deltah=deltah*1000;
-    bre_enthalpy=deltah;
+  bool fasta;
+  bool invalid;  //the last record has an invalid salt or DNA concentration
 
-    return bre_enthalpy;
+private:
 
-  }
+  bool find_record(size_t &record_end, size_t &next_pos)
+  {
+    //[pos, record_end) is a whole record if the chunk holds its end: the
+    //end of the line (TSV) or the newline before the next header
+    //(FASTA). scan is how far the search already went in the chunk
 
+    char *base = &chunk[0];
+    size_t from = pos+scan;
+    while (from < end)
+      {
+	const char *newline = (const char *) memchr(base+from, '\n', end-from);
+	if (!newline) break;
+	size_t q = newline-base;
+	if (!fasta || (q+1 < end && base[q+1] == '>'))
+	  {
+	    record_end = q;
+	    next_pos = q+1;
+	    return true;
+	  }
+	if (q+1 == end)
+	  {
+	    //The next line is not read yet
+	    scan = q-pos;
+	    return last_record(record_end, next_pos);
+	  }
+	from = q+1;
+      }
+    scan = end-pos;
+    return last_record(record_end, next_pos);
+  }
 
+  bool last_record(size_t &record_end, size_t &next_pos)
+  {
+    if (!eof || pos == end) return false;
+    record_end = next_pos = end;
+    return true;
+  }
 
-double bre_entropy(int sequence_length, string specie)
+  void refill()
   {
+    //Read more input after the pending (incomplete) record. When the
+    //chunk is nearly full the record moves to the front of it or, if
+    //records in use point into it, to a spare chunk; a record longer
+    //than half a chunk gets a larger one
 
-    double bre_entropy;
+    size_t pending = end-pos;
+    if (chunk.size()-end < chunk.size()/4)
+      {
+	size_t size = ARENA_CHUNK;
+	while (size < 2*pending) size *= 2;
+	if (pinned)
+	  {
+	    vector<char> next;
+	    for (size_t k=0; k<spare.size(); k++)
+	      if (spare[k].size() >= size)
+		{
+		  next.swap(spare[k]);
+		  spare.erase(spare.begin()+k);
+		  break;
+		}
+	    if (next.empty()) next.resize(size);
+	    memcpy(&next[0], &chunk[pos], pending);
+	    used.push_back(std::move(chunk));
+	    chunk = std::move(next);
+	    pinned = false;
+	  }
+	else
+	  {
+	    memmove(&chunk[0], &chunk[pos], pending);
+	    if (chunk.size() < size) chunk.resize(size);
+	  }
+	pos = 0;
+	end = pending;
+      }
 
-    int i;
-    double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-    double deltas;
+    filein.read(&chunk[end], chunk.size()-end);
+    end += filein.gcount();
+    if (!filein) eof = true;
+  }
 
-    deltas=0;
-    i=0;
+  bool tokenize_fasta(char *text, size_t length, string_view &id, string_view &sequence, double &salt_conc, double &dna_conc)
+  {
+    char *record_end = text+length;
+    char *header_end = (char *) memchr(text, '\n', length);
+    if (!header_end) header_end = record_end;
+
+    string_view header(text, header_end-text);
+    size_t blank = header.find_first_of(" \t");
+    id = header.substr(1, blank == string_view::npos ? string_view::npos : blank-1);
+    invalid = !parse_conditions(header, salt_conc, dna_conc);
+
+    char *out = header_end;
+    for (char *p=header_end; p<record_end; p++)
+      if (!isspace((unsigned char) *p)) *out++ = toupper((unsigned char) *p);
+    sequence = string_view(header_end, out-header_end);
+    return true;
+  }
 
-    //Entropy
-    //cal/(K mol)
-    s_aa=s_tt=-24.0;
-    s_at=-23.9;
-    s_ta=-16.9;
-    s_ca=s_tg=-12.9;
-    s_gt=s_ac=-17.3;
-    s_ct=s_ag=-20.8;
-    s_ga=s_tc=-13.5;
-    s_cg=-27.8;
-    s_gc=-26.7;
-    s_gg=s_cc=-26.6;
+  bool tokenize_tsv(char *text, size_t length, string_view &id, string_view &sequence, double &salt_conc, double &dna_conc)
+  {
+    //id <TAB> sequence [<TAB> salt [<TAB> dna]]; empty lines, comments
+    //and lines without a tab are skipped
+
+    if (length == 0 || text[0] == '#') return false;
+    char *line_end = text+length;
+    char *tab1 = (char *) memchr(text, '\t', length);
+    if (!tab1) return false;
+    char *tab2 = (char *) memchr(tab1+1, '\t', line_end-tab1-1);
+
+    id = string_view(text, tab1-text);
+    char *out = tab1+1;
+    for (char *p=tab1+1; p<(tab2 ? tab2 : line_end); p++)
+      if (!isspace((unsigned char) *p)) *out++ = toupper((unsigned char) *p);
+    sequence = string_view(tab1+1, out-tab1-1);
+
+    //An empty field keeps the default, anything else must be a valid
+    //concentration
+    if (tab2)
+      {
+	char *tab3 = (char *) memchr(tab2+1, '\t', line_end-tab2-1);
+	char *salt_end = tab3 ? tab3 : line_end;
+	if (!blank_field(tab2+1, salt_end) && !parse_concentration(tab2+1, salt_end, salt_conc)) invalid = true;
+	if (tab3 && !blank_field(tab3+1, line_end) && !parse_concentration(tab3+1, line_end, dna_conc)) invalid = true;
+      }
+    return true;
+  }
 
+  static bool blank_field(const char *text, const char *end)
+  {
+    for (const char *p=text; p<end; p++)
+      if (!isspace((unsigned char) *p)) return false;
+    return true;
+  }
 
-    //ENTROPY
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltas=deltas+s_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltas=deltas+s_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltas=deltas+s_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltas=deltas+s_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltas=deltas+s_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltas=deltas+s_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltas=deltas+s_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltas=deltas+s_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltas=deltas+s_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltas=deltas+s_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltas=deltas+s_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltas=deltas+s_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltas=deltas+s_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltas=deltas+s_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltas=deltas+s_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltas=deltas+s_tt;
+  istream &filein;
+  vector<char> chunk;               //current chunk, input in [pos, end)
+  vector< vector<char> > used;      //earlier chunks with records in use
+  vector< vector<char> > spare;     //recycled chunks
+  size_t pos, end, scan;
+  bool eof;
+  bool pinned;                      //records in use point into chunk
+};
 
-      }
 
-    bre_entropy=deltas;
 
-    return bre_entropy;
+class row_stream : public ostream
+{
+  //Formats straight into a string it does not own, so that rows go into
+  //their record and keep its capacity from block to block, where an
+  //ostringstream allocates a new string for every str()
 
-  }
+public:
 
+  row_stream() : ostream(0) { rdbuf(&buffer); }
 
+  //Append to text; done() before text is used
+  void start(string &text) { buffer.open(text); }
+  void done() { buffer.close(); }
 
+private:
 
-double bre_melting_curve(int sequence_length, string specie, double dna_conc)
+  class string_buffer : public streambuf
   {
-    double f, keq, ctkeq;
+  public:
 
-    double deltah = bre_enthalpy(sequence_length, specie);
-    double deltas = bre_entropy(sequence_length, specie);
+    string_buffer() : text(0) {}
 
-    double t;
-    double R=1.987; //cal/(K mol)
+    void open(string &target)
+    {
+      //The put area is the spare capacity of the string
+      text = &target;
+      size_t length = text->length();
+      text->resize(text->capacity() > length ? text->capacity() : length+64);
+      setp(&(*text)[0] + length, &(*text)[0] + text->size());
+    }
 
-    t=0.0;
-    ofstream fileout("bre_melting_curve.out");
+    void close()
+    {
+      if (!text) return;
+      text->resize(pptr() - &(*text)[0]);
+      text = 0;
+      setp(0, 0);
+    }
 
+  protected:
 
-    for (t=0.0; t<=700.0; t=t+0.5){
-      ctkeq=dna_conc*exp((deltas/R)-(deltah/(R*t)));
-      f=(1+ctkeq-sqrt(1+2*ctkeq))/ctkeq;
-      fileout << t << " " << f << endl;    
+    int_type overflow(int_type c)
+    {
+      if (!text) return traits_type::eof();
+      size_t length = pptr() - &(*text)[0];
+      text->resize(2*text->size() + 64);
+      setp(&(*text)[0] + length, &(*text)[0] + text->size());
+      if (!traits_type::eq_int_type(c, traits_type::eof()))
+	{
+	  *pptr() = traits_type::to_char_type(c);
+	  pbump(1);
+	}
+      return traits_type::not_eof(c);
     }
 
-    return 0;
-
-  }
+  private:
 
+    string *text;
+  };
 
+  string_buffer buffer;
+};
 
 
-double san_enthalpy(int sequence_length, string specie)
-  {
-    double san_enthalpy;
-    int i;
-
-    double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
-    double deltah;
-
-    deltah=0;
-    i=0;
-
-    //Enthalpy
-    //kcal/(mol
-    h_aa=h_tt=-8.4;
-    h_at=-6.5;
-    h_ta=-6.3;
-    h_ca=h_tg=-7.4;
-    h_gt=h_ac=-8.6;
-    h_ct=h_ag=-6.1;
-    h_ga=h_tc=-7.7;
-    h_cg=-10.1;
-    h_gc=-11.1;
-    h_gg=h_cc=-6.7;
-
-
-//ENTHALPY
-//kcal/mol
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltah=deltah+h_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltah=deltah+h_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltah=deltah+h_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltah=deltah+h_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltah=deltah+h_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltah=deltah+h_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltah=deltah+h_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltah=deltah+h_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltah=deltah+h_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltah=deltah+h_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltah=deltah+h_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltah=deltah+h_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltah=deltah+h_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltah=deltah+h_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltah=deltah+h_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltah=deltah+h_tt;
-      }
 
-    san_enthalpy=deltah*1000;
-    return san_enthalpy;
+struct batch_record
+{
+  string_view id;        //id and sequence are views into a record_reader
+  string_view sequence;  //arena (or other storage that outlives the record)
+  double salt_conc;
+  double dna_conc;
+  string row;       //formatted output row (empty if skipped)
+  string warning;   //reason the record was skipped
+  nn_sum sum;       //nearest-neighbor sums, set when NN methods or curves are requested
+  string curve;     //formatted (text) or encoded (binary) melting curves (--curves)
+  size_t curve_sizes[NN_MODELS];  //size of each encoded curve entry
+  bool hairpin_found;             //most stable hairpin (--hairpin)
+  hairpin_result hairpin;
+  degenerate_result degenerate;   //Tm range over the expansions (--degenerate)
+  bool fully_degenerate;          //no A, C, G or T, only the --degenerate columns
+  float nn_tm_float[NN_MODELS];   //Celsius, from melting_batch_float() (--float32)
+  bool invalid_conditions;        //salt or DNA concentration of the input not valid
+};
+
+
+
+bool load_nn_table(const char *filename)
+{
+  //Add a parameter table file to the batch columns
 
+  ifstream filein(filename);
+  if (!filein.is_open()){
+    std::cout << "ERROR: Could not open file " << filename << std::endl;
+    return false;
+  }
+  stringstream text;
+  text << filein.rdbuf();
+
+  nn_params params;
+  string name, error;
+  if (!parse_nn_params(text.str(), params, name, error)){
+    std::cout << "ERROR: " << filename << ": " << error << std::endl;
+    return false;
   }
 
-double san_entropy(int sequence_length, string specie)
-  {
-    double san_entropy;
-    int i;
-
-    double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-    double deltas;
+  loaded_tables.push_back(params);
+  loaded_table_names.push_back(name);
+  return true;
+}
 
-    deltas=0;
-    i=0;
 
 
-    //Entropy
-    //cal/(K mol)
-    s_aa=s_tt=-23.6;
-    s_at=-18.8;
-    s_ta=-18.5;
-    s_ca=s_tg=-19.3;
-    s_gt=s_ac=-23.0;
-    s_ct=s_ag=-16.1;
-    s_ga=s_tc=-20.3;
-    s_cg=-25.5;
-    s_gc=-28.4;
-    s_gg=s_cc=-15.6;
+void batch_header(ostream &fileout, int methods)
+{
+  fileout << "#id\tlength\tgc_content\tmolecular_weight\tsalt_conc\tdna_conc";
+  if (methods & METHOD_WALLACE) fileout << "\twallace_tm";
+  if (methods & METHOD_SALT) fileout << "\tsalt_tm";
+  if (methods & METHOD_KHANDELWAL) fileout << "\tkhandelwal_tm";
+  if (methods & METHOD_BRE) fileout << "\tbre_tm";
+  if (methods & METHOD_SAN) fileout << "\tsan_tm";
+  if (methods & METHOD_SUG) fileout << "\tsug_tm";
+  if (methods & METHOD_CONSENSUS) fileout << "\tconsensus_tm\tconsensus";
+  for (size_t k=0; k<loaded_tables.size(); k++) fileout << "\t" << loaded_table_names[k] << "_tm";
+  if (methods & OUTPUT_TRANSITION)
+    {
+      for (int m=0; m<NN_MODELS; m++)
+	{
+	  const char *name = curve_model_names[m];
+	  fileout << "\t" << name << "_curve_tm\t" << name << "_width\t" << name << "_peak_t\t" << name << "_peak_slope";
+	}
+    }
+  if (methods & OUTPUT_HAIRPIN) fileout << "\thairpin_dg\thairpin_tm";
+  if (methods & OUTPUT_DEGENERATE)
+    {
+      static const int nn_methods[NN_MODELS] = {METHOD_BRE, METHOD_SAN, METHOD_SUG};
+      fileout << "\texpansions";
+      for (int m=0; m<NN_MODELS; m++)
+	if (methods & nn_methods[m])
+	  fileout << "\t" << curve_model_names[m] << "_tm_min\t" << curve_model_names[m] << "_tm_max\t" << curve_model_names[m] << "_tm_mean";
+    }
+  fileout << "\n";
+}
 
 
-    //ENTROPY
-    for(i=0; i<sequence_length-1; i++)
-      {
-	if (specie[i]=='A' && specie[i+1]=='A') deltas=deltas+s_aa;
-	if (specie[i]=='A' && specie[i+1]=='C') deltas=deltas+s_ac;
-	if (specie[i]=='A' && specie[i+1]=='G') deltas=deltas+s_ag;
-	if (specie[i]=='A' && specie[i+1]=='T') deltas=deltas+s_at;
-
-	if (specie[i]=='C' && specie[i+1]=='A') deltas=deltas+s_ca;
-	if (specie[i]=='C' && specie[i+1]=='C') deltas=deltas+s_cc;
-	if (specie[i]=='C' && specie[i+1]=='G') deltas=deltas+s_cg;
-	if (specie[i]=='C' && specie[i+1]=='T') deltas=deltas+s_ct;
-
-	if (specie[i]=='G' && specie[i+1]=='A') deltas=deltas+s_ga;
-	if (specie[i]=='G' && specie[i+1]=='C') deltas=deltas+s_gc;
-	if (specie[i]=='G' && specie[i+1]=='G') deltas=deltas+s_gg;
-	if (specie[i]=='G' && specie[i+1]=='T') deltas=deltas+s_gt;
-
-	if (specie[i]=='T' && specie[i+1]=='A') deltas=deltas+s_ta;
-	if (specie[i]=='T' && specie[i+1]=='C') deltas=deltas+s_tc;
-	if (specie[i]=='T' && specie[i+1]=='G') deltas=deltas+s_tg;
-	if (specie[i]=='T' && specie[i+1]=='T') deltas=deltas+s_tt;
 
-      }
+void batch_format_row(batch_record &record, int methods, const melting_result &result, row_stream &fileout)
+{
+  //Format the row of a record from its results; record.sum is set to
+  //the nearest-neighbor sums for the melting curves
 
-    san_entropy=deltas;
-    return san_entropy;
+  record.sum = result.thermo.sum;
 
-  }
+  record.row.clear();
+  fileout.start(record.row);
+  if (record.fully_degenerate)
+    {
+      //No A, C, G or T: "-" in every column that needs them, the Tm range
+      //is in the --degenerate columns
+      int columns = 2 + loaded_tables.size() + ((methods & OUTPUT_TRANSITION) ? 4*NN_MODELS : 0);
+      for (int m=0; m<7; m++) if (methods & (1 << m)) columns++;
+      if (methods & METHOD_CONSENSUS) columns++;
+      fileout << record.id << "\t" << result.thermo.length << "\t-\t-\t" << record.salt_conc << "\t" << record.dna_conc;
+      for (int k=2; k<columns; k++) fileout << "\t-";
+    }
+  else
+    {
+      fileout << record.id << "\t" << result.thermo.length << "\t" << result.gc_content << "\t" << result.molecular_weight << "\t" << record.salt_conc << "\t" << record.dna_conc;
+      //Tm in Celsius for every method
+      if (methods & METHOD_WALLACE) fileout << "\t" << result.wallace_tm;
+      if (methods & METHOD_SALT) fileout << "\t" << result.salt_tm;
+      if (methods & METHOD_KHANDELWAL) fileout << "\t" << result.khandelwal_tm;
+      if (methods & METHOD_BRE) fileout << "\t" << result.nn_tm[NN_BRE];
+      if (methods & METHOD_SAN) fileout << "\t" << result.nn_tm[NN_SAN];
+      if (methods & METHOD_SUG) fileout << "\t" << result.nn_tm[NN_SUG];
+      if (methods & METHOD_CONSENSUS) fileout << "\t" << result.consensus_tm << "\t" << consensus_label(result.consensus_class);
+      for (size_t k=0; k<loaded_tables.size(); k++)
+	fileout << "\t" << table_melting_temperature(result.thermo, loaded_tables[k], record.salt_conc, record.dna_conc)-273.15;
+      if (methods & OUTPUT_TRANSITION)
+	{
+	  //Two-state curve transition (K), without initiation and salt terms
+	  for (int m=0; m<NN_MODELS; m++)
+	    {
+	      curve_transition transition = melting_transition(result.thermo.sum.deltah[m]*1000, result.thermo.sum.deltas[m], record.dna_conc);
+	      fileout << "\t" << transition.tm << "\t" << transition.width << "\t" << transition.peak_t << "\t" << transition.peak_slope;
+	    }
+	}
+    }
+  if (methods & OUTPUT_HAIRPIN)
+    {
+      //deltaG at 37 C (kcal/mol) and Tm (C) of the most stable stem-loop,
+      //"-" if none can form (deltaG >= 0) or it has no stack to melt
+      if (record.hairpin_found) fileout << "\t" << record.hairpin.deltag;
+      else fileout << "\t-";
+      if (record.hairpin_found && record.hairpin.tm > 0) fileout << "\t" << record.hairpin.tm-273.15;
+      else fileout << "\t-";
+    }
+  if (methods & OUTPUT_DEGENERATE)
+    {
+      //Tm (C) of the coldest and hottest expansions and their mean
+      static const int nn_methods[NN_MODELS] = {METHOD_BRE, METHOD_SAN, METHOD_SUG};
+      const degenerate_result &degenerate = record.degenerate;
+      fileout << "\t" << degenerate.expansions;
+      for (int m=0; m<NN_MODELS; m++)
+	if (methods & nn_methods[m])
+	  fileout << "\t" << degenerate.tm_min[m] << "\t" << degenerate.tm_max[m] << "\t" << degenerate.tm_mean[m];
+    }
+  fileout << "\n";
+  fileout.done();
+}
 
 
 
+bool batch_row(batch_record &record, int methods, row_stream &fileout, int worker)
+{
+  //Compute every requested method for one record and format its row.
+  //Only touches the record (and the stats of its worker), so records can
+  //be processed concurrently
 
+  melting_result result = melting_result();
+  string_view sequence = record.sequence;
 
-double san_melting_curve(int sequence_length, string specie, double dna_conc)
-{
-  double f, keq, ctkeq;
+  record.row.clear();
+  record.warning.clear();
+  if (record.invalid_conditions)
+    {
+      record.warning = "[WARNING]: record " + string(record.id) + " skipped, invalid salt or DNA concentration";
+      return false;
+    }
 
-  double deltah = san_enthalpy(sequence_length, specie);
-  double deltas = san_entropy(sequence_length, specie);
+  STATS_START(t);
+  int status = summarize_sequence(sequence.data(), sequence.length(), result.thermo);
+  STATS_LAP(t, stats.workers[worker].stage_ns[STAGE_SUMMARY]);
+  if (status == MELTING_URACIL)
+    {
+      record.warning = "[WARNING]: record " + string(record.id) + " skipped, Uracil not (yet) supported!";
+      return false;
+    }
+  //A degenerate sequence without any A, C, G or T still has a Tm range
+  record.fully_degenerate = status == MELTING_EMPTY && (methods & OUTPUT_DEGENERATE) &&
+    degenerate_melting(sequence.data(), sequence.length(), record.salt_conc, record.dna_conc, record.degenerate) == MELTING_OK;
+  if (record.fully_degenerate)
+    {
+      record.hairpin_found = false;
+      batch_format_row(record, methods, result, fileout);
+      return true;
+    }
+  if (status == MELTING_EMPTY)
+    {
+      record.warning = "[WARNING]: record " + string(record.id) + " skipped, empty sequence";
+      return false;
+    }
 
-  double t;
-  double R=1.987; //cal/(K mol)
+  if (methods & OUTPUT_FLOAT32)
+    {
+      //The NN columns were computed for the whole block in float; the
+      //consensus still needs the double Tm
+      int nn_methods = METHOD_BRE | METHOD_SAN | METHOD_SUG;
+      melting_from_thermo(result.thermo, record.salt_conc, record.dna_conc, (methods & METHOD_CONSENSUS) ? methods : methods & ~nn_methods, result);
+      for (int m=0; m<NN_MODELS; m++)
+	if (methods & (METHOD_BRE << m)) result.nn_tm[m] = record.nn_tm_float[m];
+    }
+  else melting_from_thermo(result.thermo, record.salt_conc, record.dna_conc, methods, result);
+  if (methods & OUTPUT_HAIRPIN)
+    record.hairpin_found = find_hairpin(sequence.data(), sequence.length(), batch_hairpin_model, record.salt_conc, hairpin_workspaces[worker], record.hairpin);
+  if (methods & OUTPUT_DEGENERATE)
+    degenerate_melting(sequence.data(), sequence.length(), record.salt_conc, record.dna_conc, record.degenerate);
+  STATS_LAP(t, stats.workers[worker].stage_ns[STAGE_METHODS]);
+  batch_format_row(record, methods, result, fileout);
+  STATS_LAP(t, stats.workers[worker].stage_ns[STAGE_FORMAT]);
+
+#ifndef DNA_MELTING_NO_STATS
+  if (stats.enabled && stats.workers[worker].records++ % STATS_SAMPLE == 0)
+    stats_sample_methods(result.thermo, record.salt_conc, record.dna_conc, methods, stats.workers[worker]);
+#endif
+  return true;
+}
 
-  t=0.0;
-  ofstream fileout("san_melting_curve.out");
 
 
-  for (t=0.0; t<=700.0; t=t+0.5){
-    ctkeq=dna_conc*exp((deltas/R)-(deltah/(R*t)));
-    f=(1+ctkeq-sqrt(1+2*ctkeq))/ctkeq;
-    fileout << t << " " << f << endl;    
-  }
+void batch_curves(batch_record *records, int n, const curve_grid &grid, int curve_format, const double *t, const float *t_float, int temperatures, vector<double> &f, row_stream &fileout)
+{
+  //Melting curves of the three models for a group of records, evaluated
+  //as one tile on the uniform grid t (or sampled adaptively if
+  //grid.tolerance > 0); if t_float is given, the tile is evaluated by
+  //melting_curve_tile_float() on it. With CURVE_TEXT they are formatted
+  //as gnuplot data blocks ("# id model" header, blocks separated by two
+  //blank lines), otherwise encoded as binary curve file entries
+
+  vector<double> deltah, deltas, dna_conc;
+  for (int i=0; i<n; i++)
+    {
+      if (!records[i].warning.empty() || records[i].fully_degenerate) continue;
+      for (int m=0; m<NN_MODELS; m++)
+	{
+	  deltah.push_back(records[i].sum.deltah[m]*1000);
+	  deltas.push_back(records[i].sum.deltas[m]);
+	  dna_conc.push_back(records[i].dna_conc);
+	}
+    }
 
-  return 0;
+  int curves = deltah.size();
+  if (curves == 0) return;
+  bool adaptive = grid.tolerance > 0;
+  vector<double> ta, fa;
+  if (!adaptive)
+    {
+      f.resize((size_t) curves*temperatures);
+      if (t_float)
+	{
+	  vector<float> deltah_float(deltah.begin(), deltah.end()), deltas_float(deltas.begin(), deltas.end());
+	  vector<float> dna_float(dna_conc.begin(), dna_conc.end()), f_float(f.size());
+	  melting_curve_tile_float(curves, &deltah_float[0], &deltas_float[0], &dna_float[0], temperatures, t_float, &f_float[0]);
+	  copy(f_float.begin(), f_float.end(), f.begin());
+	}
+      else melting_curve_tile(curves, &deltah[0], &deltas[0], &dna_conc[0], temperatures, t, &f[0]);
+    }
 
+  int c = 0;
+  for (int i=0; i<n; i++)
+    {
+      batch_record &record = records[i];
+      record.curve.clear();
+      if (!record.warning.empty() || record.fully_degenerate) continue;
+
+      if (curve_format == CURVE_TEXT) fileout.start(record.curve);
+      for (int m=0; m<NN_MODELS; m++, c++)
+	{
+	  const double *tc = t, *fc;
+	  int points = temperatures;
+	  if (adaptive)
+	    {
+	      sample_melting_curve(deltah[c], deltas[c], dna_conc[c], grid, ta, fa);
+	      tc = &ta[0];
+	      fc = &fa[0];
+	      points = ta.size();
+	    }
+	  else fc = &f[(size_t) c*temperatures];
+
+	  if (curve_format == CURVE_TEXT)
+	    {
+	      fileout << "# " << record.id << " " << curve_model_names[m] << "\n";
+	      for (int k=0; k<points; k++) fileout << tc[k] << " " << fc[k] << "\n";
+	      fileout << "\n\n";
+	    }
+	  else
+	    {
+	      size_t before = record.curve.size();
+	      encode_curve_entry(record.curve, record.id, m, record.salt_conc, record.dna_conc, deltah[c], deltas[c], tc, fc, points, curve_format);
+	      record.curve_sizes[m] = record.curve.size() - before;
+	    }
+	}
+      if (curve_format == CURVE_TEXT) fileout.done();
+    }
 }
 
 
 
+/***************************************  
+          Work-stealing thread pool
+***************************************/
 
-double sug_enthalpy(int sequence_length, string specie)
+class work_stealing_pool
 {
-  double sug_enthalpy;
-  int i;
-  double h_aa, h_ac, h_ag, h_at, h_ca, h_cc, h_cg, h_ct, h_ga, h_gc, h_gg, h_gt, h_ta, h_tc, h_tg, h_tt;
-  double deltah;
+  //Runs tasks 0..n-1 on a fixed set of threads. Tasks are first split in
+  //contiguous blocks, one per worker; a worker pops from the back of its
+  //own queue and, once empty, steals from the front of the others, so a
+  //single long sequence does not leave the other cores idle.
+  //The calling thread takes part in the work as worker 0.
 
-  deltah=0;
-  i=0;
+public:
 
-  //Enthalpy
-  //kcal/mol
-  h_aa=h_tt=-8.0;
-  h_at=-5.6;
-  h_ta=-6.6;
-  h_ca=h_tg=-8.2;
-  h_gt=h_ac=-9.4;
-  h_ct=h_ag=-6.6;
-  h_ga=h_tc=-8.8;
-  h_cg=-11.8;
-  h_gc=-10.5;
-  h_gg=h_cc=-10.9;
+  work_stealing_pool(int threads)
+  {
+    if (threads < 1) threads = 1;
+    for (int w=0; w<threads; w++) queues.push_back(new worker_queue);
+    current = 0;
+    generation = 0;
+    active = 0;
+    remaining = 0;
+    stop = false;
+    for (int w=1; w<threads; w++) workers.push_back(thread(&work_stealing_pool::worker, this, w));
+  }
 
-  //ENTHALPY
-  //kcal/mol
-  for(i=0; i<sequence_length-1; i++)
+  ~work_stealing_pool()
+  {
     {
-      if (specie[i]=='A' && specie[i+1]=='A') deltah=deltah+h_aa;
-      if (specie[i]=='A' && specie[i+1]=='C') deltah=deltah+h_ac;
-      if (specie[i]=='A' && specie[i+1]=='G') deltah=deltah+h_ag;
-      if (specie[i]=='A' && specie[i+1]=='T') deltah=deltah+h_at;
+      unique_lock<mutex> lock(state_lock);
+      stop = true;
+    }
+    start_cv.notify_all();
+    for (size_t w=0; w<workers.size(); w++) workers[w].join();
+    for (size_t w=0; w<queues.size(); w++) delete queues[w];
+  }
 
-      if (specie[i]=='C' && specie[i+1]=='A') deltah=deltah+h_ca;
-      if (specie[i]=='C' && specie[i+1]=='C') deltah=deltah+h_cc;
-      if (specie[i]=='C' && specie[i+1]=='G') deltah=deltah+h_cg;
-      if (specie[i]=='C' && specie[i+1]=='T') deltah=deltah+h_ct;
+  int size() const { return queues.size(); }
 
-      if (specie[i]=='G' && specie[i+1]=='A') deltah=deltah+h_ga;
-      if (specie[i]=='G' && specie[i+1]=='C') deltah=deltah+h_gc;
-      if (specie[i]=='G' && specie[i+1]=='G') deltah=deltah+h_gg;
-      if (specie[i]=='G' && specie[i+1]=='T') deltah=deltah+h_gt;
+  //task(index, worker) is called once for every index in [0, tasks)
+  void run(int tasks, const function<void(int, int)> &task)
+  {
+    if (tasks <= 0) return;
 
-      if (specie[i]=='T' && specie[i+1]=='A') deltah=deltah+h_ta;
-      if (specie[i]=='T' && specie[i+1]=='C') deltah=deltah+h_tc;
-      if (specie[i]=='T' && specie[i+1]=='G') deltah=deltah+h_tg;
-      if (specie[i]=='T' && specie[i+1]=='T') deltah=deltah+h_tt;
+    {
+      //A worker still holding the previous task function must leave
+      //before the queues are refilled
+      unique_lock<mutex> lock(state_lock);
+      done_cv.wait(lock, [this]{ return active == 0; });
+
+      int threads = queues.size();
+      for (int w=0; w<threads; w++)
+	{
+	  int first = (long) tasks*w/threads;
+	  int last = (long) tasks*(w+1)/threads;
+	  unique_lock<mutex> qlock(queues[w]->lock);
+	  for (int i=first; i<last; i++) queues[w]->tasks.push_back(i);
+	}
+
+      current = &task;
+      remaining = tasks;
+      generation++;
     }
+    start_cv.notify_all();
 
-  sug_enthalpy=deltah*1000;
+    work(0, task);
 
-  return sug_enthalpy;
-
-}
+    unique_lock<mutex> lock(state_lock);
+    done_cv.wait(lock, [this]{ return remaining == 0; });
+  }
 
+private:
 
+  struct worker_queue
+  {
+    mutex lock;
+    deque<int> tasks;
+  };
 
-double sug_entropy(int sequence_length, string specie)
-{
-  double sug_entropy;
-  int i;
-  double s_aa, s_ac, s_ag, s_at, s_ca, s_cc, s_cg, s_ct, s_ga, s_gc, s_gg, s_gt, s_ta, s_tc, s_tg, s_tt;
-  double deltas;
+  bool next_task(int w, int &task)
+  {
+    {
+      unique_lock<mutex> lock(queues[w]->lock);
+      if (!queues[w]->tasks.empty())
+	{
+	  task = queues[w]->tasks.back();
+	  queues[w]->tasks.pop_back();
+	  return true;
+	}
+    }
 
-  deltas=0;
-  i=0;
+    int threads = queues.size();
+    for (int k=1; k<threads; k++)
+      {
+	worker_queue *victim = queues[(w+k)%threads];
+	unique_lock<mutex> lock(victim->lock);
+	if (!victim->tasks.empty())
+	  {
+	    task = victim->tasks.front();
+	    victim->tasks.pop_front();
+	    return true;
+	  }
+      }
 
-  //Entropy
-  //cal/(K mol)
-  s_aa=s_tt=-21.9;
-  s_at=-15.2;
-  s_ta=-18.4;
-  s_ca=s_tg=-21.0;
-  s_gt=s_ac=-25.5;
-  s_ct=s_ag=-16.4;
-  s_ga=s_tc=-23.5;
-  s_cg=-29.0;
-  s_gc=-26.4;
-  s_gg=s_cc=-28.4;
+    return false;
+  }
 
+  void work(int w, const function<void(int, int)> &task)
+  {
+    int index;
+    while (next_task(w, index))
+      {
+	task(index, w);
+	if (remaining.fetch_sub(1) == 1)
+	  {
+	    unique_lock<mutex> lock(state_lock);
+	    done_cv.notify_all();
+	  }
+      }
+  }
 
-  //ENTROPY
-  for(i=0; i<sequence_length-1; i++)
-    {
-      if (specie[i]=='A' && specie[i+1]=='A') deltas=deltas+s_aa;
-      if (specie[i]=='A' && specie[i+1]=='C') deltas=deltas+s_ac;
-      if (specie[i]=='A' && specie[i+1]=='G') deltas=deltas+s_ag;
-      if (specie[i]=='A' && specie[i+1]=='T') deltas=deltas+s_at;
+  void worker(int w)
+  {
+    long seen = 0;
+    while (true)
+      {
+	const function<void(int, int)> *task;
+	{
+	  unique_lock<mutex> lock(state_lock);
+	  start_cv.wait(lock, [this, seen]{ return stop || generation != seen; });
+	  if (stop) return;
+	  seen = generation;
+	  task = current;
+	  active++;
+	}
+
+	work(w, *task);
+
+	unique_lock<mutex> lock(state_lock);
+	active--;
+	done_cv.notify_all();
+      }
+  }
 
-      if (specie[i]=='C' && specie[i+1]=='A') deltas=deltas+s_ca;
-      if (specie[i]=='C' && specie[i+1]=='C') deltas=deltas+s_cc;
-      if (specie[i]=='C' && specie[i+1]=='G') deltas=deltas+s_cg;
-      if (specie[i]=='C' && specie[i+1]=='T') deltas=deltas+s_ct;
+  vector<worker_queue *> queues;
+  vector<thread> workers;
+  mutex state_lock;
+  condition_variable start_cv, done_cv;
+  const function<void(int, int)> *current;
+  long generation;
+  int active;
+  atomic<int> remaining;
+  bool stop;
+};
 
-      if (specie[i]=='G' && specie[i+1]=='A') deltas=deltas+s_ga;
-      if (specie[i]=='G' && specie[i+1]=='C') deltas=deltas+s_gc;
-      if (specie[i]=='G' && specie[i+1]=='G') deltas=deltas+s_gg;
-      if (specie[i]=='G' && specie[i+1]=='T') deltas=deltas+s_gt;
 
-      if (specie[i]=='T' && specie[i+1]=='A') deltas=deltas+s_ta;
-      if (specie[i]=='T' && specie[i+1]=='C') deltas=deltas+s_tc;
-      if (specie[i]=='T' && specie[i+1]=='G') deltas=deltas+s_tg;
-      if (specie[i]=='T' && specie[i+1]=='T') deltas=deltas+s_tt;
 
+int run_batch(istream &filein, ostream &fileout, double default_salt, double default_dna, int methods, int threads, ostream *curveout, curve_file_writer *curvewriter, int curve_format, const curve_grid &grid)
+{
+  //Stream a multi-record FASTA or TSV input and write one tab separated
+  //row per record, in input order. Records are read in blocks that are
+  //processed by a work-stealing pool, so memory depends on the block
+  //size and not on the number of records. The records are views into
+  //the arena of a record_reader and the rows are formatted into strings
+  //kept from block to block, so the number of allocations does not grow
+  //with the number of records either.
+  //If curveout (text) or curvewriter (binary, curve_format) is given, the
+  //melting curves of the three NN models are written to it, computed in
+  //tiles of CURVE_TILE_SEQ/3 records.
+  //With OUTPUT_FLOAT32 the NN Tm of a block go through
+  //melting_batch_float(), FLOAT_BATCH_BLOCK records per task, and the
+  //curve tiles through melting_curve_tile_float().
+  //Returns the number of records processed
+
+  bool curves = curveout || curvewriter;
+
+  //Curves are large: use smaller blocks when they are requested
+  const int block_records = curves ? 512 : 8192;
+  const int curve_group = CURVE_TILE_SEQ/NN_MODELS;
+  const size_t block_bases = 1<<24;
+
+  int records = 0;
+
+  work_stealing_pool pool(threads);
+#ifndef DNA_MELTING_NO_STATS
+  stats_workers(pool.size());
+#endif
+  vector<batch_record> block(block_records);
+  vector<row_stream> formatters(pool.size());
+  vector< vector<double> > curve_buffers(pool.size());
+  if (methods & OUTPUT_HAIRPIN) hairpin_workspaces.resize(pool.size());
+
+  if (curves) methods |= OUTPUT_CURVES;
+
+  int temperatures = curve_points(grid.t_min, grid.t_max, grid.t_step);
+  vector<double> t(temperatures);
+  for (int k=0; k<temperatures; k++) t[k] = grid.t_min + k*grid.t_step;
+
+  //Struct-of-arrays view of a block for the single precision path
+  bool single = methods & OUTPUT_FLOAT32;
+  vector<float> t_float(t.begin(), t.end());
+  vector<const char *> pointers(single ? block_records : 0);
+  vector<size_t> lengths(pointers.size());
+  vector<double> salt_conc(pointers.size()), dna_conc(pointers.size());
+  vector<float> nn_tm_float[NN_MODELS];
+  melting_batch_float_output float_output = melting_batch_float_output();
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      nn_tm_float[m].resize(pointers.size());
+      if (single && (methods & (METHOD_BRE << m))) float_output.nn_tm[m] = &nn_tm_float[m][0];
     }
 
-  sug_entropy=deltas;
+  //FASTA if the first non blank character is '>', TSV otherwise
+  record_reader reader(filein);
+
+  batch_header(fileout, methods);
 
-  return sug_entropy;
+  bool more = true;
+  while (more)
+    {
+      //Fill a block; the previous one is written, so its chunks of the
+      //arena are reused, and record strings keep their capacity
+      STATS_START(timer);
+      reader.recycle();
+      int n = 0;
+      size_t bases = 0;
+      while (n < block_records && bases < block_bases)
+	{
+	  batch_record &record = block[n];
+	  record.salt_conc = default_salt;
+	  record.dna_conc = default_dna;
+
+	  more = reader.next(record.id, record.sequence, record.salt_conc, record.dna_conc);
+	  if (!more) break;
+	  record.invalid_conditions = reader.invalid;
+
+	  bases += record.sequence.length();
+	  n++;
+	}
+      STATS_ADD(stats.records_read, n);
+      STATS_ADD(stats.bases, bases);
+      STATS_LAP(timer, stats.stage_ns[STAGE_READ]);
+
+      if (single)
+	{
+	  for (int i=0; i<n; i++)
+	    {
+	      pointers[i] = block[i].sequence.data();
+	      lengths[i] = block[i].sequence.length();
+	      salt_conc[i] = block[i].salt_conc;
+	      dna_conc[i] = block[i].dna_conc;
+	    }
+	  melting_batch_input input = {(size_t) n, &pointers[0], &lengths[0], &salt_conc[0], &dna_conc[0], default_salt, default_dna, methods & METHOD_ALL};
+	  int groups = (n + FLOAT_BATCH_BLOCK - 1)/FLOAT_BATCH_BLOCK;
+	  pool.run(groups, [&](int g, int){
+	      size_t first = (size_t) g*FLOAT_BATCH_BLOCK;
+	      size_t last = first+FLOAT_BATCH_BLOCK < (size_t) n ? first+FLOAT_BATCH_BLOCK : n;
+	      melting_batch_float(input, float_output, first, last);
+	      for (size_t i=first; i<last; i++)
+		for (int m=0; m<NN_MODELS; m++)
+		  if (float_output.nn_tm[m]) block[i].nn_tm_float[m] = nn_tm_float[m][i];
+	    });
+	}
+
+      pool.run(n, [&](int i, int w){
+	  batch_row(block[i], methods, formatters[w], w);
+	  STATS_ADD(stats.workers[w].tasks, 1);
+	});
+
+      if (curves)
+	{
+	  int groups = (n + curve_group - 1)/curve_group;
+	  pool.run(groups, [&](int g, int w){
+	      int first = g*curve_group;
+	      int count = first+curve_group < n ? curve_group : n-first;
+	      STATS_START(tc);
+	      batch_curves(&block[first], count, grid, curvewriter ? curve_format : CURVE_TEXT, &t[0], single ? &t_float[0] : 0, temperatures, curve_buffers[w], formatters[w]);
+	      STATS_LAP(tc, stats.workers[w].stage_ns[STAGE_CURVES]);
+	      STATS_ADD(stats.workers[w].tasks, 1);
+	    });
+	}
+      STATS_LAP(timer, stats.parallel_ns);
+
+      for (int i=0; i<n; i++)
+	{
+	  if (block[i].warning.empty())
+	    {
+	      fileout << block[i].row;
+	      if (curveout) *curveout << block[i].curve;
+	      if (curvewriter && !block[i].curve.empty()) curvewriter->append(block[i].curve, block[i].curve_sizes, NN_MODELS);
+	      STATS_ADD(stats.bytes_written, block[i].row.size());
+	      STATS_ADD(stats.curve_bytes, block[i].curve.size());
+	      STATS_ADD(stats.records_processed, 1);
+	      records++;
+	    }
+	  else
+	    {
+	      std::cerr << block[i].warning << std::endl;
+	      STATS_ADD(stats.records_skipped, 1);
+	    }
+	}
+      STATS_LAP(timer, stats.stage_ns[STAGE_WRITE]);
+    }
 
+  fileout.flush();
+  if (curveout) curveout->flush();
+  return records;
 }
 
 
 
-double sug_melting_curve(int sequence_length, string specie, double dna_conc)
+/***************************************  
+     Memory-mapped 2-bit packed input
+***************************************/
+
+//Packed reference file (native byte order, every field 8-byte aligned):
+//  "DNAM2BIT"  u64 records
+//  for every record:
+//    u64 name length, name (padded to 8 bytes)
+//    u64 bases, packed bases (4 per byte, first base in the low bits,
+//        padded to 8 bytes); N and other characters are stored as A
+//    u64 N runs, N runs as (u64 start, u64 length) pairs
+#define PACKED_MAGIC "DNAM2BIT"
+
+
+class mapped_file
 {
-  double f, keq, ctkeq;
+  //Read-only memory map of a whole file
 
-  double deltah = sug_enthalpy(sequence_length, specie);
-  double deltas = sug_entropy(sequence_length, specie);
+public:
 
-  double t;
-  double R=1.987; //cal/(K mol)
+  mapped_file() : data(0), size(0) {}
 
-  t=0.0;
-  ofstream fileout("sug_melting_curve.out");
+  ~mapped_file()
+  {
+    if (data && size > 0) munmap((void *) data, size);
+  }
 
+  bool open(const char *filename)
+  {
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) return false;
 
-  for (t=0.0; t<=700.0; t=t+0.5)
-    {
-      ctkeq=dna_conc*exp((deltas/R)-(deltah/(R*t)));
-      f=(1+ctkeq-sqrt(1+2*ctkeq))/ctkeq;
-      fileout << t << " " << f << endl;    
-    }
-  
-    return 0;
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+      {
+	close(fd);
+	return false;
+      }
+
+    size = info.st_size;
+    if (size > 0)
+      {
+	void *map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) map = 0;
+	data = (const char *) map;
+	if (data) madvise(map, size, MADV_SEQUENTIAL);
+      }
+    close(fd);
 
+    return data != 0 || size == 0;
   }
 
+  const char *data;
+  size_t size;
 
+private:
 
+  mapped_file(const mapped_file &);
+  mapped_file &operator=(const mapped_file &);
+};
 
-int main(int argc, char *argv[]) 
+
+
+struct packed_record
 {
+  string name;
+  size_t bases;
+  const unsigned char *packed;
+  size_t n_runs;
+  const unsigned long long *runs;   //start, length pairs, sorted
+};
 
 
-  /***************************************  
-             Read input file
-  ***************************************/
 
-  if ( argv[1] == "--help" || argv[1] == "-h" || argc != 2) {
-    std::cout << " " << std::endl;
-    std::cout << " Welcome to the dna_melting code!" << std::endl;
-    std::cout << " " << std::endl;
-    std::cout << " dna_melting gives information about the sequence (length, GC content, molecular weigth)" << std::endl;
-    std::cout << " and compute melting temperature using:" << std::endl;
-    std::cout << " 1. Wallance rule" << std::endl;
+static inline int packed_base(const unsigned char *packed, size_t i)
+{
+  return (packed[i >> 2] >> ((i & 3) << 1)) & 3;
+}
+
+
+
+static inline unsigned long long packed_word(const unsigned char *packed, size_t i)
+{
+  //32 bases starting at i (i multiple of 4), base i in the low bits
+  unsigned long long word;
+  memcpy(&word, packed + (i >> 2), sizeof(word));
+  return word;
+}
+
+
+
+bool is_packed_file(const mapped_file &file)
+{
+  return file.size >= 16 && memcmp(file.data, PACKED_MAGIC, 8) == 0;
+}
+
+
+
+bool read_packed_records(const mapped_file &file, vector<packed_record> &records)
+{
+  //Index the records of a mapped packed file; bases are not copied
+
+  records.clear();
+  if (!is_packed_file(file)) return false;
+
+  const char *p = file.data + 8;
+  const char *end = file.data + file.size;
+  unsigned long long count, value;
+
+  memcpy(&count, p, 8);
+  p += 8;
+
+  for (unsigned long long r=0; r<count; r++)
+    {
+      packed_record record;
+
+      if (p+8 > end) return false;
+      memcpy(&value, p, 8);
+      p += 8;
+      if (p+value > end) return false;
+      record.name.assign(p, value);
+      p += (value+7) & ~7ULL;
+
+      if (p+8 > end) return false;
+      memcpy(&value, p, 8);
+      p += 8;
+      record.bases = value;
+      record.packed = (const unsigned char *) p;
+      p += (((value+3)/4)+7) & ~7ULL;
+
+      if (p+8 > end) return false;
+      memcpy(&value, p, 8);
+      p += 8;
+      record.n_runs = value;
+      record.runs = (const unsigned long long *) p;
+      p += 16*value;
+      if (p > end) return false;
+
+      records.push_back(record);
+    }
+
+  return true;
+}
+
+
+
+static void write_u64(ostream &fileout, unsigned long long value)
+{
+  fileout.write((const char *) &value, 8);
+}
+
+
+
+static void write_padding(ostream &fileout, size_t written)
+{
+  static const char zeros[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+  if (written % 8) fileout.write(zeros, 8 - written % 8);
+}
+
+
+
+long pack_fasta(istream &filein, const char *filename)
+{
+  //Convert a FASTA stream into a packed reference file. Sequences are
+  //packed as they are read; only the N runs of the current record are
+  //kept in memory. Returns the number of records, -1 on error
+
+  ofstream fileout(filename, ios::binary);
+  if (!fileout.is_open()) return -1;
+
+  fileout.write(PACKED_MAGIC, 8);
+  write_u64(fileout, 0);
+
+  string line;
+  long records = 0;
+  bool open_record = false;
+  streampos length_pos = 0;
+  size_t bases = 0;
+  unsigned char byte = 0;
+  vector<unsigned long long> runs;
+
+  while (true)
+    {
+      bool more = (bool) getline(filein, line);
+
+      if ((!more || (!line.empty() && line[0] == '>')) && open_record)
+	{
+	  //Close the current record
+	  if (bases % 4) fileout.put(byte);
+	  write_padding(fileout, (bases+3)/4);
+	  write_u64(fileout, runs.size()/2);
+	  if (!runs.empty()) fileout.write((const char *) &runs[0], 8*runs.size());
+
+	  streampos here = fileout.tellp();
+	  fileout.seekp(length_pos);
+	  write_u64(fileout, bases);
+	  fileout.seekp(here);
+	  records++;
+	  open_record = false;
+	}
+      if (!more) break;
+
+      if (!line.empty() && line[0] == '>')
+	{
+	  size_t blank = line.find_first_of(" \t");
+	  string name = line.substr(1, blank == string::npos ? string::npos : blank-1);
+	  write_u64(fileout, name.length());
+	  fileout.write(name.data(), name.length());
+	  write_padding(fileout, name.length());
+	  length_pos = fileout.tellp();
+	  write_u64(fileout, 0);
+	  open_record = true;
+	  bases = 0;
+	  byte = 0;
+	  runs.clear();
+	  continue;
+	}
+      if (!open_record) continue;
+
+      for (size_t i=0; i<line.length(); i++)
+	{
+	  if (isspace((unsigned char) line[i])) continue;
+	  int code = base_code[toupper((unsigned char) line[i])];
+	  if (code < 0)
+	    {
+	      //Extend the last N run or start a new one
+	      if (!runs.empty() && runs[runs.size()-2] + runs[runs.size()-1] == bases) runs[runs.size()-1]++;
+	      else
+		{
+		  runs.push_back(bases);
+		  runs.push_back(1);
+		}
+	      code = 0;
+	    }
+	  byte |= code << ((bases & 3) << 1);
+	  bases++;
+	  if ((bases & 3) == 0)
+	    {
+	      fileout.put(byte);
+	      byte = 0;
+	    }
+	}
+    }
+
+  fileout.seekp(8);
+  write_u64(fileout, records);
+  fileout.close();
+
+  return fileout.fail() ? -1 : records;
+}
+
+
+
+static void packed_segment_composition(const unsigned char *packed, size_t first, size_t last, long counts[4], long nibbles[16])
+{
+  //Base counts and dinucleotide histogram of bases [first, last), which
+  //contain no N. 32 bases are taken from each 64-bit word: base counts
+  //come from popcounts of the 2-bit fields, dinucleotides from the 4-bit
+  //fields (w >> 2k) & 15 = base(k) | base(k+1) << 2
+
+  const unsigned long long low = 0x5555555555555555ULL;
+  size_t i = first;
+
+  //Counts
+  while (i < last && (i & 31)) counts[packed_base(packed, i++)]++;
+  for (; i+32 <= last; i+=32)
+    {
+      unsigned long long w = packed_word(packed, i);
+      unsigned long long lo = w & low;
+      unsigned long long hi = (w >> 1) & low;
+      long t = __builtin_popcountll(hi & lo);
+      long g = __builtin_popcountll(hi & ~lo);
+      long c = __builtin_popcountll(~hi & lo);
+      counts[1] += c;
+      counts[2] += g;
+      counts[3] += t;
+      counts[0] += 32 - c - g - t;
+    }
+  while (i < last) counts[packed_base(packed, i++)]++;
+
+  //Dinucleotides (i, i+1)
+  i = first;
+  while (i+1 < last && (i & 31))
+    {
+      nibbles[packed_base(packed, i) | packed_base(packed, i+1) << 2]++;
+      i++;
+    }
+  for (; i+32 < last; i+=32)
+    {
+      unsigned long long w = packed_word(packed, i);
+      for (int k=0; k<31; k++) nibbles[(w >> (2*k)) & 15]++;
+      nibbles[(w >> 62) | packed_base(packed, i+32) << 2]++;
+    }
+  while (i+1 < last)
+    {
+      nibbles[packed_base(packed, i) | packed_base(packed, i+1) << 2]++;
+      i++;
+    }
+}
+
+
+
+void packed_composition(const packed_record &record, size_t first, size_t last, long counts[4], long dinucleotides[16])
+{
+  //Base counts and dinucleotide histogram (indexed as 4*base(i)+base(i+1))
+  //of bases [first, last) of a packed record, skipping the N runs and the
+  //dinucleotides that touch them
+
+  long nibbles[16];
+  for (int k=0; k<4; k++) counts[k] = 0;
+  for (int k=0; k<16; k++) nibbles[k] = 0;
+
+  size_t start = first;
+  for (size_t r=0; r<record.n_runs && start < last; r++)
+    {
+      size_t run_start = record.runs[2*r];
+      size_t run_end = run_start + record.runs[2*r+1];
+      if (run_end <= start) continue;
+      if (run_start > start) packed_segment_composition(record.packed, start, run_start < last ? run_start : last, counts, nibbles);
+      start = run_end;
+    }
+  if (start < last) packed_segment_composition(record.packed, start, last, counts, nibbles);
+
+  for (int k=0; k<16; k++) dinucleotides[4*(k & 3) + (k >> 2)] = nibbles[k];
+}
+
+
+
+bool packed_is_self_complementary(const packed_record &record)
+{
+  if (record.bases == 0 || record.n_runs > 0) return false;
+  for (size_t i=0, j=record.bases-1; i<j; i++, j--)
+    if (packed_base(record.packed, i) != 3-packed_base(record.packed, j)) return false;
+  return record.bases % 2 == 0;
+}
+
+
+
+int run_batch_packed(const vector<packed_record> &records, ostream &fileout, double salt_conc, double dna_conc, int methods, int threads)
+{
+  //Batch rows for every record of a packed reference, computed directly
+  //on the packed words. Returns the number of records processed
+
+  work_stealing_pool pool(threads);
+#ifndef DNA_MELTING_NO_STATS
+  stats_workers(pool.size());
+#endif
+  vector<batch_record> rows(records.size());
+  vector<row_stream> formatters(pool.size());
+
+  batch_header(fileout, methods);
+
+  STATS_START(t);
+  pool.run(records.size(), [&](int i, int w){
+      const packed_record &record = records[i];
+      batch_record &row = rows[i];
+      long counts[4], dinucleotides[16];
+
+      row.id = record.name;
+      row.salt_conc = salt_conc;
+      row.dna_conc = dna_conc;
+      STATS_ADD(stats.workers[w].tasks, 1);
+
+      STATS_START(tw);
+      packed_composition(record, 0, record.bases, counts, dinucleotides);
+      if (counts[0]+counts[1]+counts[2]+counts[3] == 0)
+	{
+	  row.warning = "[WARNING]: record " + record.name + " skipped, empty sequence";
+	  return;
+	}
+
+      sequence_thermo thermo;
+      summarize_composition(record.bases, counts, dinucleotides, packed_is_self_complementary(record), thermo);
+      STATS_LAP(tw, stats.workers[w].stage_ns[STAGE_SUMMARY]);
+
+      melting_result result = melting_result();
+      melting_from_thermo(thermo, salt_conc, dna_conc, methods, result);
+      STATS_LAP(tw, stats.workers[w].stage_ns[STAGE_METHODS]);
+      batch_format_row(row, methods, result, formatters[w]);
+      STATS_LAP(tw, stats.workers[w].stage_ns[STAGE_FORMAT]);
+
+#ifndef DNA_MELTING_NO_STATS
+      if (stats.enabled && stats.workers[w].records++ % STATS_SAMPLE == 0)
+	stats_sample_methods(thermo, salt_conc, dna_conc, methods, stats.workers[w]);
+#endif
+    });
+  STATS_LAP(t, stats.parallel_ns);
+
+  int processed = 0;
+  for (size_t i=0; i<rows.size(); i++)
+    {
+      STATS_ADD(stats.bases, records[i].bases);
+      if (rows[i].warning.empty())
+	{
+	  fileout << rows[i].row;
+	  STATS_ADD(stats.bytes_written, rows[i].row.size());
+	  processed++;
+	}
+      else std::cerr << rows[i].warning << std::endl;
+    }
+  STATS_ADD(stats.records_read, rows.size());
+  STATS_ADD(stats.records_processed, processed);
+  STATS_ADD(stats.records_skipped, rows.size() - processed);
+
+  fileout.flush();
+  STATS_LAP(t, stats.stage_ns[STAGE_WRITE]);
+  return processed;
+}
+
+
+
+struct curve_entry
+{
+  string id;
+  int model;
+  int points;
+  double salt_conc;
+  double dna_conc;
+  double deltah;
+  double deltas;
+  const char *t;   //points values of value_size bytes
+  const char *f;
+};
+
+
+
+class curve_file_reader
+{
+  //Random access to the entries of a memory-mapped binary curve file
+
+public:
+
+  curve_file_reader() : value_size(0), entries(0), index(0) {}
+
+  bool open(const char *filename)
+  {
+    if (!file.open(filename) || file.size < 32 || memcmp(file.data, CURVE_MAGIC, 8) != 0) return false;
+
+    unsigned int header[2];
+    unsigned long long index_offset;
+    memcpy(header, file.data+8, sizeof(header));
+    memcpy(&entries, file.data+16, 8);
+    memcpy(&index_offset, file.data+24, 8);
+    value_size = header[1];
+
+    if (header[0] != CURVE_VERSION || (value_size != CURVE_FLOAT32 && value_size != CURVE_FLOAT64)) return false;
+    if (index_offset + 8*entries > file.size) return false;
+    index = file.data + index_offset;
+    return true;
+  }
+
+  size_t size() const { return entries; }
+
+  bool entry(size_t i, curve_entry &curve) const
+  {
+    unsigned long long offset, length;
+    memcpy(&offset, index + 8*i, 8);
+    const char *p = file.data + offset;
+
+    memcpy(&length, p, 8);
+    p += 8;
+    curve.id.assign(p, length);
+    p += (length+7) & ~7ULL;
+
+    unsigned int header[2];
+    double conditions[4];
+    memcpy(header, p, sizeof(header));
+    p += sizeof(header);
+    memcpy(conditions, p, sizeof(conditions));
+    p += sizeof(conditions);
+
+    curve.model = header[0];
+    curve.points = header[1];
+    curve.salt_conc = conditions[0];
+    curve.dna_conc = conditions[1];
+    curve.deltah = conditions[2];
+    curve.deltas = conditions[3];
+    curve.t = p;
+    curve.f = p + (size_t) value_size*curve.points;
+
+    return curve.f + (size_t) value_size*curve.points <= file.data + file.size;
+  }
+
+  double value(const char *column, int k) const
+  {
+    if (value_size == CURVE_FLOAT64)
+      {
+	double v;
+	memcpy(&v, column + 8*(size_t) k, 8);
+	return v;
+      }
+    float v;
+    memcpy(&v, column + 4*(size_t) k, 4);
+    return v;
+  }
+
+private:
+
+  mapped_file file;
+  int value_size;
+  unsigned long long entries;
+  const char *index;
+};
+
+
+
+long export_curves(const char *filename, const string &record_id, ostream &fileout)
+{
+  //Text export of a binary curve file. Without record_id every curve is
+  //written to fileout as gnuplot data blocks (same layout as the text
+  //--curves output); with record_id its three curves are written to
+  //bre/san/sug_melting_curve.out, the files read by plot_curve.gnu.
+  //Returns the number of curves exported, -1 if the file is not valid
+
+  curve_file_reader reader;
+  if (!reader.open(filename)) return -1;
+
+  curve_entry curve;
+  long exported = 0;
+
+  for (size_t i=0; i<reader.size(); i++)
+    {
+      if (!reader.entry(i, curve)) return -1;
+      if (!record_id.empty() && curve.id != record_id) continue;
+
+      ofstream curvefile;
+      ostream *out = &fileout;
+      if (!record_id.empty())
+	{
+	  string name = string(curve_model_names[curve.model]) + "_melting_curve.out";
+	  curvefile.open(name.c_str());
+	  out = &curvefile;
+	}
+      else *out << "# " << curve.id << " " << curve_model_names[curve.model] << "\n";
+
+      for (int k=0; k<curve.points; k++)
+	*out << reader.value(curve.t, k) << " " << reader.value(curve.f, k) << "\n";
+      if (record_id.empty()) *out << "\n\n";
+
+      exported++;
+    }
+
+  fileout.flush();
+  return exported;
+}
+
+
+
+/***************************************  
+          Sliding-window scan
+***************************************/
+
+//Strands reported by run_scan()
+#define STRAND_PLUS  1
+#define STRAND_MINUS 2
+#define STRAND_BOTH  3
+
+//Window sums are recomputed from scratch every SCAN_RESYNC positions so
+//that rounding errors of the running sums do not build up along a genome
+#define SCAN_RESYNC 65536
+
+
+class window_scanner
+{
+  //Running nearest-neighbor sums of the last "window" bases of a stream.
+  //Each new base adds one dinucleotide and drops the oldest one, so every
+  //window costs O(1) whatever its length. The reverse complement sums
+  //(minus strand) are kept as well, together with rolling hashes of the
+  //window and of its reverse complement to detect self-complementary
+  //windows without comparing them base by base.
+
+public:
+
+  window_scanner(size_t window_length) : window(window_length), ring(window_length)
+  {
+    hash_base = 0x9E3779B97F4A7C15ULL;
+    //Inverse of the (odd) hash base modulo 2^64, by Newton iteration
+    hash_base_inv = hash_base;
+    for (int k=0; k<6; k++) hash_base_inv *= 2 - hash_base*hash_base_inv;
+    hash_base_pow = 1;
+    for (size_t k=1; k<window; k++) hash_base_pow *= hash_base;
+    reset();
+  }
+
+  void reset()
+  {
+    bases = 0;
+    gc = 0;
+    invalid = 0;
+    hash_fwd = hash_rev = 0;
+    hash_fill_pow = 1;
+    for (int m=0; m<NN_MODELS; m++) plus.deltah[m] = plus.deltas[m] = minus.deltah[m] = minus.deltas[m] = 0;
+  }
+
+  //Add the next base (upper case), dropping the oldest one if the window is full
+  void push(char base)
+  {
+    push_code(base_code[(unsigned char) base]);
+  }
+
+  //Same as push() for a base already encoded (-1 for anything but A, C, G, T)
+  void push_code(int code)
+  {
+    size_t slot = bases % window;
+
+    if (bases >= window)
+      {
+	int old = ring[slot];
+	if (window > 1) dinucleotide(old, ring[(bases+1) % window], -1);
+	if (old < 0) invalid--;
+	else if (old == 1 || old == 2) gc--;
+	hash_fwd -= hash_digit(old)*hash_base_pow;
+	hash_rev = (hash_rev - hash_digit(3-old))*hash_base_inv;
+      }
+
+    if (bases > 0 && window > 1) dinucleotide(ring[(bases+window-1) % window], code, +1);
+    ring[slot] = code;
+    bases++;
+
+    if (code < 0) invalid++;
+    else if (code == 1 || code == 2) gc++;
+    hash_fwd = hash_fwd*hash_base + hash_digit(code);
+    if (bases <= window)
+      {
+	//Still filling the first window
+	hash_rev += hash_digit(3-code)*hash_fill_pow;
+	hash_fill_pow *= hash_base;
+      }
+    else hash_rev += hash_digit(3-code)*hash_base_pow;
+
+    if (bases % SCAN_RESYNC == 0) resync();
+  }
+
+  bool full() const { return bases >= window; }
+
+  //Window holds only A, C, G and T
+  bool valid() const { return invalid == 0; }
+
+  //0-based start of the current window
+  size_t start() const { return bases - window; }
+
+  int gc_count() const { return gc; }
+
+  const nn_sum &plus_sums() const { return plus; }
+  const nn_sum &minus_sums() const { return minus; }
+
+  bool self_complementary() const
+  {
+    if (!valid() || hash_fwd != hash_rev) return false;
+    for (size_t i=0; i<window/2; i++)
+      {
+	int a = ring[(bases-window+i) % window];
+	int b = ring[(bases-1-i) % window];
+	if (a != 3-b) return false;
+      }
+    return window % 2 == 0;
+  }
+
+private:
+
+  //Hash value of a base code; characters other than A, C, G, T count as 0
+  //(such windows are never reported)
+  static unsigned long long hash_digit(int code)
+  {
+    return (code >= 0 && code <= 3) ? code+1 : 0;
+  }
+
+  void dinucleotide(int prev, int next, int sign)
+  {
+    if ((prev | next) < 0) return;
+    int nn = 4*prev+next;
+    int rc = 4*(3-next)+(3-prev);
+    for (int m=0; m<NN_MODELS; m++)
+      {
+	plus.deltah[m] += sign*nn_models[m]->h[nn];
+	plus.deltas[m] += sign*nn_models[m]->s[nn];
+	minus.deltah[m] += sign*nn_models[m]->h[rc];
+	minus.deltas[m] += sign*nn_models[m]->s[rc];
+      }
+  }
+
+  void resync()
+  {
+    //Recompute the sums of the current window from the ring
+    for (int m=0; m<NN_MODELS; m++) plus.deltah[m] = plus.deltas[m] = minus.deltah[m] = minus.deltas[m] = 0;
+    size_t first = bases > window ? bases-window : 0;
+    for (size_t i=first+1; i<bases; i++) dinucleotide(ring[(i-1) % window], ring[i % window], +1);
+  }
+
+  size_t window;
+  vector<signed char> ring;
+  size_t bases;
+  int gc;
+  int invalid;
+  nn_sum plus, minus;
+  unsigned long long hash_base, hash_base_inv, hash_base_pow, hash_fill_pow, hash_fwd, hash_rev;
+};
+
+
+
+static int format_fixed(char *buffer, double value, int decimals)
+{
+  //Fixed-point formatting of value with the given number of decimals
+  //(at most 8); much faster than printf("%.*f") on per-base tracks
+
+  static const long long powers[9] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+  if (!(value == value) || value > 1e12 || value < -1e12)
+    return sprintf(buffer, "%g", value);
+
+  int n = 0;
+  if (value < 0)
+    {
+      buffer[n++] = '-';
+      value = -value;
+    }
+
+  long long scaled = (long long) (value*powers[decimals] + 0.5);
+  long long integer = scaled/powers[decimals];
+  long long fraction = scaled%powers[decimals];
+
+  char digits[24];
+  int d = 0;
+  do
+    {
+      digits[d++] = '0' + integer%10;
+      integer /= 10;
+    }
+  while (integer > 0);
+  while (d > 0) buffer[n++] = digits[--d];
+
+  if (decimals > 0)
+    {
+      buffer[n++] = '.';
+      for (int k=decimals-1; k>=0; k--)
+	{
+	  buffer[n+k] = '0' + fraction%10;
+	  fraction /= 10;
+	}
+      n += decimals;
+    }
+
+  return n;
+}
+
+
+
+void scan_row(ostream &fileout, const string &name, size_t start, size_t window, char strand, int gc, const nn_sum &sum, bool self_compl, double salt_conc, double dna_conc)
+{
+  //A genome scan writes one row per base: rows are formatted by hand,
+  //ostream formatting of doubles would dominate the run time
+  char buffer[160];
+  int n = sprintf(buffer, "\t%zu\t%zu\t%c\t", start, start+window, strand);
+  n += format_fixed(buffer+n, 100.0*gc/window, 2);
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      buffer[n++] = '\t';
+      n += format_fixed(buffer+n, nn_melting_temperature(*nn_models[m], sum.deltah[m], sum.deltas[m], self_compl, gc > 0, salt_conc, dna_conc)-273.15, 4);
+    }
+  buffer[n++] = '\n';
+
+  fileout << name;
+  fileout.write(buffer, n);
+  STATS_ADD(stats.bytes_written, name.size() + n);
+}
+
+
+
+struct scan_state
+{
+  window_scanner scanner;
+  ostream &fileout;
+  size_t window;
+  size_t step;
+  int strands;
+  double salt_conc;
+  double dna_conc;
+  string name;
+  long windows;
+
+  scan_state(ostream &out, size_t window_length, size_t window_step, int scan_strands, double salt, double dna)
+    : scanner(window_length), fileout(out), window(window_length), step(window_step), strands(scan_strands), salt_conc(salt), dna_conc(dna), windows(0) {}
+};
+
+
+
+void scan_record(scan_state &state, const char *header, size_t length)
+{
+  //Start a new record; header is the FASTA header without '>'
+  const char *end = header;
+  while (end < header+length && !isspace((unsigned char) *end)) end++;
+  state.name.assign(header, end-header);
+  state.scanner.reset();
+  STATS_ADD(stats.records_read, 1);
+}
+
+
+
+inline void scan_code(scan_state &state, int code)
+{
+  window_scanner &scanner = state.scanner;
+  scanner.push_code(code);
+
+  if (!scanner.full() || !scanner.valid() || scanner.start() % state.step != 0) return;
+
+  bool self_compl = scanner.self_complementary();
+  if (state.strands & STRAND_PLUS) scan_row(state.fileout, state.name, scanner.start(), state.window, '+', scanner.gc_count(), scanner.plus_sums(), self_compl, state.salt_conc, state.dna_conc);
+  if (state.strands & STRAND_MINUS) scan_row(state.fileout, state.name, scanner.start(), state.window, '-', scanner.gc_count(), scanner.minus_sums(), self_compl, state.salt_conc, state.dna_conc);
+  state.windows++;
+}
+
+
+
+void scan_line(scan_state &state, const char *line, size_t length)
+{
+  //One line of FASTA text
+  if (length > 0 && line[0] == '>')
+    {
+      scan_record(state, line+1, length-1);
+      return;
+    }
+  STATS_ADD(stats.bases, length);
+
+  for (size_t i=0; i<length; i++)
+    {
+      if (isspace((unsigned char) line[i])) continue;
+      scan_code(state, base_code[toupper((unsigned char) line[i])]);
+    }
+}
+
+
+
+void scan_header(ostream &fileout)
+{
+  fileout << "#name\tstart\tend\tstrand\tgc_content\tbre_tm\tsan_tm\tsug_tm\n";
+}
+
+
+
+long run_scan(istream &filein, ostream &fileout, size_t window, size_t step, int strands, double salt_conc, double dna_conc)
+{
+  //Tm track of every window of "window" bases (every "step" bases) along
+  //each record of a FASTA stream, for the three NN models. The input is
+  //streamed base by base: memory only depends on the window length.
+  //Windows containing characters other than A, C, G, T are not reported.
+  //Output columns: name, start (0-based), end, strand, GC%, bre, san, sug
+  //Tm (Celsius). Returns the number of windows reported
+
+  scan_state state(fileout, window, step, strands, salt_conc, dna_conc);
+  string line;
+
+  scan_header(fileout);
+  STATS_START(t);
+  while (getline(filein, line))
+    {
+      STATS_LAP(t, stats.stage_ns[STAGE_READ]);
+      scan_line(state, line.data(), line.length());
+      STATS_LAP(t, stats.stage_ns[STAGE_SCAN]);
+    }
+
+  fileout.flush();
+  STATS_LAP(t, stats.stage_ns[STAGE_WRITE]);
+  STATS_ADD(stats.records_processed, state.windows);
+  return state.windows;
+}
+
+
+
+long run_scan_mapped(const mapped_file &file, ostream &fileout, size_t window, size_t step, int strands, double salt_conc, double dna_conc)
+{
+  //Same as run_scan() on a memory-mapped file: a packed reference is
+  //decoded with shifts straight from the mapping, FASTA text is scanned
+  //in place without copying lines
+
+  scan_state state(fileout, window, step, strands, salt_conc, dna_conc);
+  scan_header(fileout);
+  STATS_START(t);
+
+  vector<packed_record> records;
+  if (read_packed_records(file, records))
+    {
+      for (size_t r=0; r<records.size(); r++)
+	{
+	  const packed_record &record = records[r];
+	  scan_record(state, record.name.data(), record.name.length());
+	  STATS_ADD(stats.bases, record.bases);
+
+	  size_t i = 0;
+	  for (size_t k=0; k<=record.n_runs; k++)
+	    {
+	      size_t run_start = k < record.n_runs ? record.runs[2*k] : record.bases;
+	      size_t run_end = k < record.n_runs ? run_start + record.runs[2*k+1] : record.bases;
+
+	      //Bases up to the next N run, a word at a time when aligned
+	      while (i < run_start && (i & 31)) scan_code(state, packed_base(record.packed, i++));
+	      for (; i+32 <= run_start; i+=32)
+		{
+		  unsigned long long w = packed_word(record.packed, i);
+		  for (int b=0; b<32; b++, w>>=2) scan_code(state, w & 3);
+		}
+	      while (i < run_start) scan_code(state, packed_base(record.packed, i++));
+
+	      for (; i < run_end; i++) scan_code(state, -1);
+	    }
+	}
+    }
+  else
+    {
+      const char *p = file.data;
+      const char *end = file.data + file.size;
+      while (p < end)
+	{
+	  const char *eol = (const char *) memchr(p, '\n', end-p);
+	  if (!eol) eol = end;
+	  scan_line(state, p, eol-p);
+	  p = eol+1;
+	}
+    }
+  STATS_LAP(t, stats.stage_ns[STAGE_SCAN]);
+
+  fileout.flush();
+  STATS_LAP(t, stats.stage_ns[STAGE_WRITE]);
+  STATS_ADD(stats.records_processed, state.windows);
+  return state.windows;
+}
+
+
+
+/***************************************  
+            Condition sweep
+***************************************/
+
+static const char *sweep_method_names[7] = {"wallace", "salt", "khandelwal", "bre", "san", "sug", "consensus"};
+
+
+bool parse_grid(const string &text, vector<double> &values)
+{
+  //Comma separated values, or MIN:MAX:N for N values evenly spaced on a
+  //log scale (concentrations span decades)
+
+  values.clear();
+  if (count(text.begin(), text.end(), ':') == 2)
+    {
+      double first, last;
+      int points;
+      if (sscanf(text.c_str(), "%lf:%lf:%d", &first, &last, &points) != 3 || first <= 0 || last <= 0 || points < 1) return false;
+      for (int k=0; k<points; k++)
+	values.push_back(points == 1 ? first : first*pow(last/first, (double) k/(points-1)));
+      return true;
+    }
+
+  size_t start = 0;
+  while (start <= text.length())
+    {
+      size_t end = text.find(',', start);
+      if (end == string::npos) end = text.length();
+      char *stop;
+      string field = text.substr(start, end-start);
+      double value = strtod(field.c_str(), &stop);
+      if (field.empty() || *stop || value <= 0) return false;
+      values.push_back(value);
+      start = end+1;
+    }
+  return true;
+}
+
+
+
+long run_sweep(istream &filein, ostream &fileout, const sweep_conditions &conditions, int methods, int threads, bool long_format)
+{
+  //Tm matrix of every record of a FASTA or TSV stream (conditions in the
+  //input are ignored, the grid replaces them). In the wide format each
+  //record has one row per method with one column per condition (salt
+  //major); the long format has one row per record, method and condition.
+  //Returns the number of records processed
+
+  const int block_records = 4096;
+  const size_t salts = conditions.salt_conc.size(), dnas = conditions.dna_conc.size();
+  const size_t n = salts*dnas;
+
+  int blocks_per_record = 0;
+  for (int m=0; m<7; m++) if (methods & (1 << m)) blocks_per_record++;
+
+  if (long_format) fileout << "#id\tmethod\tsalt_conc\tdna_conc\ttm\n";
+  else
+    {
+      fileout << "#id\tmethod";
+      for (size_t i=0; i<salts; i++)
+	for (size_t j=0; j<dnas; j++) fileout << "\tsalt=" << conditions.salt_conc[i] << ",dna=" << conditions.dna_conc[j];
+      fileout << "\n";
+    }
+
+  work_stealing_pool pool(threads);
+  vector<batch_record> block(block_records);
+  vector<row_stream> formatters(pool.size());
+  vector< vector<double> > matrices(pool.size(), vector<double>(blocks_per_record*n));
+  long records = 0;
+
+  record_reader reader(filein);
+
+  bool more = true;
+  while (more)
+    {
+      reader.recycle();
+      int count = 0;
+      while (count < block_records)
+	{
+	  batch_record &record = block[count];
+	  more = reader.next(record.id, record.sequence, record.salt_conc, record.dna_conc);
+	  if (!more) break;
+	  count++;
+	}
+
+      pool.run(count, [&](int r, int w){
+	  batch_record &record = block[r];
+	  row_stream &out = formatters[w];
+	  double *tm = &matrices[w][0];
+	  sequence_thermo thermo;
+
+	  record.row.clear();
+	  record.warning.clear();
+	  int status = summarize_sequence(record.sequence.data(), record.sequence.length(), thermo);
+	  if (status == MELTING_URACIL)
+	    {
+	      record.warning = "[WARNING]: record " + string(record.id) + " skipped, Uracil not (yet) supported!";
+	      return;
+	    }
+	  if (status == MELTING_EMPTY)
+	    {
+	      record.warning = "[WARNING]: record " + string(record.id) + " skipped, empty sequence";
+	      return;
+	    }
+
+	  melting_sweep(thermo, methods, conditions, tm);
+
+	  out.start(record.row);
+	  for (int m=0; m<7; m++)
+	    {
+	      if (!(methods & (1 << m))) continue;
+	      if (long_format)
+		for (size_t i=0; i<salts; i++)
+		  for (size_t j=0; j<dnas; j++)
+		    out << record.id << "\t" << sweep_method_names[m] << "\t" << conditions.salt_conc[i] << "\t" << conditions.dna_conc[j] << "\t" << tm[i*dnas+j] << "\n";
+	      else
+		{
+		  out << record.id << "\t" << sweep_method_names[m];
+		  for (size_t k=0; k<n; k++) out << "\t" << tm[k];
+		  out << "\n";
+		}
+	      tm += n;
+	    }
+	  out.done();
+	});
+
+      for (int r=0; r<count; r++)
+	{
+	  if (block[r].warning.empty())
+	    {
+	      fileout << block[r].row;
+	      records++;
+	    }
+	  else std::cerr << block[r].warning << std::endl;
+	}
+    }
+
+  fileout.flush();
+  return records;
+}
+
+
+
+/***************************************  
+             Primer search
+***************************************/
+
+//Candidates kept on each strand before pairing
+#define PRIMER_PAIR_POOL 1000
+
+
+string primer_sequence(const string &sequence, const primer_candidate &primer)
+{
+  //5'-->3' sequence of a primer; reverse primers are reverse complemented
+
+  static const char complement[4] = {'T', 'G', 'C', 'A'};
+
+  string oligo = sequence.substr(primer.start, primer.length);
+  if (primer.strand == PRIMER_REVERSE)
+    for (int k=0; k<primer.length; k++)
+      oligo[k] = complement[base_code[(unsigned char) sequence[primer.start+primer.length-1-k]]];
+
+  return oligo;
+}
+
+
+
+void primer_columns(ostream &fileout, const string &sequence, const primer_candidate &primer)
+{
+  fileout << primer.start << "\t" << primer.start+primer.length << "\t" << primer_sequence(sequence, primer) << "\t" << primer.gc_content;
+  for (int m=0; m<NN_MODELS; m++) fileout << "\t" << primer.tm[m];
+}
+
+
+
+static bool lower_penalty(const primer_candidate &a, const primer_candidate &b)
+{
+  if (a.penalty != b.penalty) return a.penalty < b.penalty;
+  return a.start < b.start;
+}
+
+
+
+long run_primers(istream &filein, ostream &fileout, const primer_constraints &constraints, size_t top, bool pairs)
+{
+  //Top primers (or primer pairs) of every template of a FASTA stream;
+  //a file without '>' headers is read as a single template. Conditions
+  //in a FASTA header override the defaults. Returns the number of
+  //candidates meeting the constraints
+
+  if (pairs) fileout << "#record\tproduct\tpenalty\tforward_start\tforward_end\tforward_sequence\tforward_gc\tforward_bre_tm\tforward_san_tm\tforward_sug_tm"
+		     << "\treverse_start\treverse_end\treverse_sequence\treverse_gc\treverse_bre_tm\treverse_san_tm\treverse_sug_tm\n";
+  else fileout << "#record\tstrand\tstart\tend\tsequence\tgc_content\tbre_tm\tsan_tm\tsug_tm\tpenalty\n";
+
+  string line, id, sequence;
+  long found = 0;
+  vector<primer_candidate> forward, reverse, best;
+  vector<primer_pair> best_pairs;
+
+  filein >> ws;
+  bool fasta = (filein.peek() == '>');
+
+  while (true)
+    {
+      primer_constraints c = constraints;
+      if (fasta)
+	{
+	  if (!read_fasta_record(filein, line, id, sequence, c.salt_conc, c.dna_conc)) break;
+	}
+      else
+	{
+	  id = "template";
+	  sequence.clear();
+	  while (getline(filein, line))
+	    for (size_t i=0; i<line.length(); i++)
+	      if (!isspace((unsigned char) line[i])) sequence += toupper((unsigned char) line[i]);
+	  if (sequence.empty()) break;
+	}
+
+      found += find_primers(sequence.data(), sequence.length(), c, pairs ? PRIMER_PAIR_POOL : top, forward, reverse);
+
+      if (pairs)
+	{
+	  pair_primers(forward, reverse, c, top, best_pairs);
+	  for (size_t k=0; k<best_pairs.size(); k++)
+	    {
+	      const primer_pair &pair = best_pairs[k];
+	      fileout << id << "\t" << pair.product << "\t" << pair.penalty << "\t";
+	      primer_columns(fileout, sequence, pair.forward);
+	      fileout << "\t";
+	      primer_columns(fileout, sequence, pair.reverse);
+	      fileout << "\n";
+	    }
+	}
+      else
+	{
+	  best.resize(forward.size() + reverse.size());
+	  merge(forward.begin(), forward.end(), reverse.begin(), reverse.end(), best.begin(), lower_penalty);
+	  if (best.size() > top) best.resize(top);
+	  for (size_t k=0; k<best.size(); k++)
+	    {
+	      fileout << id << "\t" << (best[k].strand == PRIMER_FORWARD ? '+' : '-') << "\t";
+	      primer_columns(fileout, sequence, best[k]);
+	      fileout << "\t" << best[k].penalty << "\n";
+	    }
+	}
+
+      if (!fasta) break;
+    }
+
+  fileout.flush();
+  return found;
+}
+
+
+
+/***************************************  
+           Off-target scan
+***************************************/
+
+//Longest seed used by --offtarget unless --seed asks for less
+#define OFFTARGET_SEED 12
+
+
+bool load_reference(const char *filename, reference_genome &reference)
+{
+  //A packed reference is decoded from the mapping, anything else is read
+  //as FASTA
+
+  mapped_file mapped;
+  vector<packed_record> records;
+  if (mapped.open(filename) && read_packed_records(mapped, records))
+    {
+      reference.starts.assign(1, 0);
+      for (size_t r=0; r<records.size(); r++)
+	{
+	  const packed_record &record = records[r];
+	  size_t start = reference.codes.size();
+	  reference.names.push_back(record.name);
+	  reference.codes.resize(start + record.bases);
+	  for (size_t i=0; i<record.bases; i++) reference.codes[start+i] = packed_base(record.packed, i);
+	  for (size_t k=0; k<record.n_runs; k++)
+	    memset(&reference.codes[start + record.runs[2*k]], REF_OTHER, record.runs[2*k+1]);
+	  reference.starts.push_back(reference.codes.size());
+	}
+      return true;
+    }
+
+  ifstream filein(filename);
+  if (!filein.is_open()) return false;
+
+  string line, name, sequence;
+  double salt_conc, dna_conc;
+  while (read_fasta_record(filein, line, name, sequence, salt_conc, dna_conc))
+    add_reference_record(reference, name, sequence.data(), sequence.length());
+  return true;
+}
+
+
+
+long run_offtargets(const reference_genome &reference, const seed_index &index, const nn_duplex_params &duplex, vector<batch_record> &probes, ostream &fileout, int max_mismatches, double min_tm, int threads)
+{
+  //Probes are searched on a work-stealing pool, rows are written in
+  //probe order. Returns the number of sites reported
+
+  work_stealing_pool pool(threads);
+  vector<ostringstream> formatters(pool.size());
+  vector< vector<offtarget_site> > hits(pool.size());
+  vector<long> found(probes.size(), 0);
+
+  fileout << "#probe\trecord\tstart\tend\tstrand\tmismatches\tsite\tdeltah\tdeltas\ttm\n";
+
+  pool.run(probes.size(), [&](int i, int w){
+      batch_record &probe = probes[i];
+      vector<offtarget_site> &sites = hits[w];
+      ostringstream &out = formatters[w];
+
+      found[i] = find_offtargets(reference, index, duplex, probe.sequence.data(), probe.sequence.length(), max_mismatches, min_tm, probe.salt_conc, probe.dna_conc, sites);
+      if (found[i] < 0)
+	{
+	  probe.warning = "[WARNING]: probe " + string(probe.id) + " skipped, only A, C, G, T and at least " + to_string((max_mismatches+1)*index.k) + " bases are supported";
+	  return;
+	}
+
+      out.str("");
+      for (size_t k=0; k<sites.size(); k++)
+	{
+	  const offtarget_site &site = sites[k];
+	  out << probe.id << "\t" << reference.names[site.record] << "\t" << site.start << "\t" << site.start + probe.sequence.length() << "\t" << site.strand
+	      << "\t" << site.mismatches << "\t" << site.site << "\t" << site.deltah << "\t" << site.deltas << "\t" << site.tm << "\n";
+	}
+      probe.row = out.str();
+    });
+
+  long reported = 0;
+  for (size_t i=0; i<probes.size(); i++)
+    {
+      if (probes[i].warning.empty())
+	{
+	  fileout << probes[i].row;
+	  reported += found[i];
+	}
+      else std::cerr << probes[i].warning << std::endl;
+    }
+
+  fileout.flush();
+  return reported;
+}
+
+
+
+/***************************************  
+          Primer-dimer screen
+***************************************/
+
+long run_dimers(vector<batch_record> &primers, ostream &fileout, const dimer_model &model, int threads)
+{
+  //Sparse conflict matrix of the pool: one row per pair (i <= j) with a
+  //dimer at or below model.max_deltag, by i then j. Rows of the matrix
+  //are screened on a work-stealing pool. Returns the number of conflicts
+
+  vector<dimer_primer> encoded;
+  vector<size_t> kept;
+  for (size_t i=0; i<primers.size(); i++)
+    {
+      dimer_primer primer;
+      if (!encode_dimer_primer(primers[i].sequence.data(), primers[i].sequence.length(), primer))
+	{
+	  std::cerr << "[WARNING]: primer " << primers[i].id << " skipped, only A, C, G, T and 2 to " << DIMER_MAX_LENGTH << " bases are supported" << std::endl;
+	  continue;
+	}
+      encoded.push_back(primer);
+      kept.push_back(i);
+    }
+
+  work_stealing_pool pool(threads);
+  vector<ostringstream> formatters(pool.size());
+  vector< vector<primer_dimer> > conflicts(pool.size());
+  vector<long> found(encoded.size(), 0);
+
+  fileout << "#i\tj\tprimer_i\tprimer_j\tdeltag\tdeltah\tdeltas\ttm\tstart_i\tstart_j\tpairs\n";
+
+  pool.run(encoded.size(), [&](int i, int w){
+      vector<primer_dimer> &row = conflicts[w];
+      ostringstream &out = formatters[w];
+
+      screen_dimers(encoded, i, model, row);
+      found[i] = row.size();
+
+      out.str("");
+      for (size_t k=0; k<row.size(); k++)
+	{
+	  const primer_dimer &dimer = row[k];
+	  out << dimer.first << "\t" << dimer.second << "\t" << primers[kept[dimer.first]].id << "\t" << primers[kept[dimer.second]].id
+	      << "\t" << dimer.deltag << "\t" << dimer.deltah << "\t" << dimer.deltas << "\t" << dimer.tm
+	      << "\t" << dimer.start_first << "\t" << dimer.start_second << "\t" << dimer.pairs << "\n";
+	}
+      primers[kept[i]].row = out.str();
+    });
+
+  long reported = 0;
+  for (size_t i=0; i<encoded.size(); i++)
+    {
+      fileout << primers[kept[i]].row;
+      reported += found[i];
+    }
+
+  size_t n = encoded.size();
+  std::cerr << "[INFO]: " << n << " primers, " << n*(n+1)/2 << " pairs screened, " << reported << " conflicts" << std::endl;
+  fileout.flush();
+  return reported;
+}
+
+
+
+/***************************************  
+         Saturation mutagenesis
+***************************************/
+
+long run_variants(vector<batch_record> &records, ostream &fileout, bool indels, int threads)
+{
+  //Every single-base variant of every record, one row each with the Tm
+  //shift of the three models; the Tm of the record itself is given in a
+  //comment line before its variants. Records are processed on a
+  //work-stealing pool, rows are written in input order. Returns the
+  //number of variants
+
+  work_stealing_pool pool(threads);
+  vector<ostringstream> formatters(pool.size());
+  vector< vector<sequence_variant> > variants(pool.size());
+  vector<long> found(records.size(), 0);
+
+  fileout << "#id\tposition\tref\talt\tbre_dtm\tsan_dtm\tsug_dtm\n";
+
+  pool.run(records.size(), [&](int i, int w){
+      batch_record &record = records[i];
+      ostringstream &out = formatters[w];
+      double baseline[NN_MODELS];
+
+      found[i] = scan_variants(record.sequence.data(), record.sequence.length(), record.salt_conc, record.dna_conc, indels, baseline, variants[w]);
+      if (found[i] < 0)
+	{
+	  record.warning = "[WARNING]: record " + string(record.id) + " skipped, only A, C, G, T are supported";
+	  return;
+	}
+
+      //Positions are 1-based; an insertion goes before the base at its position
+      out.str("");
+      out << "# " << record.id << "\tbre_tm " << baseline[NN_BRE] << "\tsan_tm " << baseline[NN_SAN] << "\tsug_tm " << baseline[NN_SUG] << "\n";
+      for (size_t k=0; k<variants[w].size(); k++)
+	{
+	  const sequence_variant &variant = variants[w][k];
+	  out << record.id << "\t" << variant.position+1 << "\t" << variant.ref << "\t" << variant.alt
+	      << "\t" << variant.delta_tm[NN_BRE] << "\t" << variant.delta_tm[NN_SAN] << "\t" << variant.delta_tm[NN_SUG] << "\n";
+	}
+      record.row = out.str();
+    });
+
+  long reported = 0;
+  for (size_t i=0; i<records.size(); i++)
+    {
+      if (records[i].warning.empty())
+	{
+	  fileout << records[i].row;
+	  reported += found[i];
+	}
+      else std::cerr << records[i].warning << std::endl;
+    }
+
+  fileout.flush();
+  return reported;
+}
+
+
+
+/***************************************  
+            Inverse design
+***************************************/
+
+//Chains started together; fixed, so the output does not depend on the
+//number of threads
+#define DESIGN_ROUND 64
+
+
+static size_t hamming_distance(const string &a, const string &b)
+{
+  size_t distance = 0;
+  for (size_t i=0; i<a.length(); i++) distance += a[i] != b[i];
+  return distance;
+}
+
+
+
+long run_design(ostream &fileout, const primer_constraints &constraints, size_t length, long count, size_t min_distance, long steps, unsigned long long seed, long max_chains, int threads)
+{
+  //Rounds of independent annealing chains (chain k from seed+k) on a
+  //work-stealing pool; their sequences are taken in chain order if they
+  //meet the constraints and differ from every sequence kept in at least
+  //min_distance bases. Returns the number of sequences written
+
+  work_stealing_pool pool(threads);
+  vector<string> designed, results(DESIGN_ROUND);
+  vector<char> met(DESIGN_ROUND);
+  long chains = 0, meeting = 0;
+
+  while (chains < max_chains && (long) designed.size() < count)
+    {
+      int n = max_chains-chains < DESIGN_ROUND ? max_chains-chains : DESIGN_ROUND;
+      pool.run(n, [&](int k, int){
+	  met[k] = anneal_design(constraints, length, steps, seed+chains+k, results[k]);
+	});
+
+      for (int k=0; k<n; k++)
+	{
+	  if (!met[k]) continue;
+	  meeting++;
+	  if ((long) designed.size() == count) continue;
+	  bool distinct = true;
+	  for (size_t d=0; d<designed.size() && distinct; d++)
+	    distinct = hamming_distance(results[k], designed[d]) >= min_distance;
+	  if (distinct) designed.push_back(results[k]);
+	}
+      chains += n;
+    }
+
+  fileout << "#id\tsequence\tlength\tgc_content\tbre_tm\tsan_tm\tsug_tm\n";
+  for (size_t d=0; d<designed.size(); d++)
+    {
+      melting_result result = melting_result();
+      melting_temperatures(designed[d].data(), length, constraints.salt_conc, constraints.dna_conc, METHOD_BRE|METHOD_SAN|METHOD_SUG, result);
+      fileout << "design" << d+1 << "\t" << designed[d] << "\t" << length << "\t" << result.gc_content
+	      << "\t" << result.nn_tm[NN_BRE] << "\t" << result.nn_tm[NN_SAN] << "\t" << result.nn_tm[NN_SUG] << "\n";
+    }
+  fileout.flush();
+
+  std::cerr << "[INFO]: " << chains << " chains, " << meeting << " met the constraints, " << designed.size() << " sequences kept" << std::endl;
+  if ((long) designed.size() < count)
+    std::cerr << "[WARNING]: only " << designed.size() << " of " << count << " sequences found (try more --chains or --steps, or wider windows)" << std::endl;
+  return designed.size();
+}
+
+
+
+/***************************************  
+        Poland-Scheraga melting
+***************************************/
+
+//Bases read before a block of records is melted
+#define PS_BLOCK_BASES 4000000
+
+
+struct ps_record
+{
+  string id;
+  string sequence;
+  bool any_cg;
+  vector<ps_chunk> chunks;
+  vector<ps_chunk_result> results;
+  vector<float> tm_map;
+};
+
+
+void write_ps_record(const ps_record &record, const nn_params &params, double dna_conc, const vector<double> &t, ostream &fileout, ostream *mapout)
+{
+  //Curve rows: t (K), theta, -dtheta/dt (1/K, central differences). The
+  //Tm of the molecule (theta = 0.5) goes to the log
+
+  int n = t.size();
+  vector<double> theta(n);
+  ps_melting_curve(record.chunks, record.results, params, record.any_cg, dna_conc, n, &theta[0]);
+
+  double tm = 0;
+  for (int k=0; k<n; k++)
+    {
+      int lo = k > 0 ? k-1 : 0, hi = k+1 < n ? k+1 : n-1;
+      double slope = hi > lo ? -(theta[hi]-theta[lo])/(t[hi]-t[lo]) : 0;
+      fileout << record.id << "\t" << t[k] << "\t" << theta[k] << "\t" << slope << "\n";
+      if (k > 0 && theta[k-1] >= 0.5 && theta[k] < 0.5) tm = t[k-1] + (t[k]-t[k-1])*(theta[k-1]-0.5)/(theta[k-1]-theta[k]);
+    }
+
+  if (tm > 0) std::cerr << "[INFO]: record " << record.id << ", " << record.sequence.length() << " bp in " << record.chunks.size() << " chunk(s): Tm = " << tm << " K" << std::endl;
+  else std::cerr << "[INFO]: record " << record.id << ", " << record.sequence.length() << " bp in " << record.chunks.size() << " chunk(s): theta does not cross 0.5 in the temperature range" << std::endl;
+
+  if (mapout)
+    for (size_t i=0; i<record.sequence.length(); i++)
+      *mapout << record.id << "\t" << i << "\t" << record.sequence[i] << "\t" << record.tm_map[i] << "\n";
+}
+
+
+
+long run_ps(istream &filein, ostream &fileout, ostream *mapout, const nn_params &params, const ps_model &model, double dna_conc, size_t chunk, size_t overlap, const vector<double> &t, int threads)
+{
+  //Records are read in blocks of about PS_BLOCK_BASES bases, and the
+  //chunks of all the records of a block are melted on a work-stealing
+  //pool, so both many amplicons and one long sequence use every thread.
+  //Returns the number of records melted
+
+  work_stealing_pool pool(threads);
+  vector<ps_record> block;
+  vector< pair<size_t, size_t> > tasks;  //record, chunk
+  string line, id, sequence;
+  double salt_conc, record_dna;
+  long records = 0;
+
+  fileout << "#id\tt\ttheta\tdtheta\n";
+  if (mapout) *mapout << "#id\tposition\tbase\ttm\n";
+
+  bool more = true;
+  while (more)
+    {
+      block.clear();
+      tasks.clear();
+      size_t bases = 0;
+      while (bases < PS_BLOCK_BASES && (more = read_fasta_record(filein, line, id, sequence, salt_conc, record_dna)))
+	{
+	  if (sequence.find("U") != string::npos)
+	    {
+	      std::cerr << "[WARNING]: record " << id << " skipped, Uracil not (yet) supported!" << std::endl;
+	      continue;
+	    }
+	  if (sequence.empty())
+	    {
+	      std::cerr << "[WARNING]: record " << id << " skipped, empty sequence" << std::endl;
+	      continue;
+	    }
+
+	  block.push_back(ps_record());
+	  ps_record &record = block.back();
+	  record.id = id;
+	  record.sequence.swap(sequence);
+	  record.any_cg = record.sequence.find_first_of("CG") != string::npos;
+	  record.tm_map.resize(mapout ? record.sequence.length() : 0);
+	  plan_ps_chunks(record.sequence.length(), chunk, overlap, record.chunks);
+	  record.results.resize(record.chunks.size());
+	  bases += record.sequence.length();
+	}
+
+      for (size_t r=0; r<block.size(); r++)
+	for (size_t c=0; c<block[r].chunks.size(); c++) tasks.push_back(make_pair(r, c));
+
+      pool.run(tasks.size(), [&](int k, int){
+	  ps_record &record = block[tasks[k].first];
+	  size_t c = tasks[k].second;
+	  ps_melt_chunk(record.sequence.data(), record.chunks[c], model, t.size(), &t[0], record.results[c], mapout ? &record.tm_map[0] : 0);
+	});
+
+      for (size_t r=0; r<block.size(); r++) write_ps_record(block[r], params, dna_conc, t, fileout, mapout);
+      records += block.size();
+    }
+
+  fileout.flush();
+  if (mapout) mapout->flush();
+  return records;
+}
+
+
+
+/***************************************
+               Server mode
+***************************************/
+
+//A long-running process answering Tm queries on stdin/stdout or on a
+//Unix domain socket. Each request is
+//  sequence [salt [dna [methods]]]
+//(whitespace separated, missing fields take the server defaults), one per
+//line or, with length-prefixed framing, as a 4-byte big-endian length
+//followed by the same text. Answers come back in request order with the
+//same framing: the batch row without the id,
+//  length gc_content molecular_weight salt_conc dna_conc <Tm of each method>
+//or "ERROR: ..." for a request that cannot be computed. The request
+//"stats" is answered with the latency percentiles.
+//Requests arriving together, from one or many clients, are computed as
+//one micro-batch and their answers are written with one call per client
+
+#define SERVE_LINES  0
+#define SERVE_LENGTH 1
+
+//Requests taken in one micro-batch; the rest wait for the next round
+#define SERVE_BATCH      256
+//Micro-batches smaller than this are not worth waking the pool
+#define SERVE_POOL_BATCH 64
+//Largest length-prefixed request (bytes)
+#define SERVE_MAX_REQUEST 1048576
+
+//Log-linear latency histogram: 32 buckets per power of two of
+//nanoseconds, i.e. 3% resolution
+#define LATENCY_SUB     32
+#define LATENCY_BUCKETS (LATENCY_SUB*40)
+
+
+class latency_histogram
+{
+public:
+  latency_histogram() : counts(LATENCY_BUCKETS, 0), total(0) {}
+
+  void add(long ns)
+  {
+    if (ns < 0) ns = 0;
+    size_t bucket;
+    if (ns < 2*LATENCY_SUB) bucket = ns;
+    else
+      {
+	int shift = 63 - __builtin_clzll(ns) - 5;
+	bucket = LATENCY_SUB*(shift+1) + (ns >> shift) - LATENCY_SUB;
+      }
+    if (bucket >= counts.size()) bucket = counts.size()-1;
+    counts[bucket]++;
+    total++;
+  }
+
+  long count() const { return total; }
+
+  double percentile(double p) const
+  {
+    //Latency (ns) below which a fraction p of the samples fall, taken
+    //at the middle of its bucket
+    long rank = (long) ceil(p*total);
+    if (rank < 1) rank = 1;
+    long seen = 0;
+    for (size_t b=0; b<counts.size(); b++)
+      {
+	seen += counts[b];
+	if (seen < rank) continue;
+	if (b < 2*LATENCY_SUB) return b;
+	int shift = b/LATENCY_SUB - 1;
+	return double(((b % LATENCY_SUB) + LATENCY_SUB) << shift) + 0.5*(1L << shift);
+      }
+    return 0;
+  }
+
+private:
+  vector<long> counts;
+  long total;
+};
+
+
+
+struct serve_connection
+{
+  int in_fd;
+  int out_fd;
+  bool socket;     //a client of the Unix socket (non-blocking)
+  bool closed;     //no more input
+  string input;    //bytes read and not parsed yet
+  string output;   //answers not written yet
+};
+
+
+struct serve_request
+{
+  int connection;
+  bool stats;
+  string sequence;
+  double salt_conc;
+  double dna_conc;
+  int methods;
+  string answer;
+};
+
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int)
+{
+  serve_stop = 1;
+}
+
+
+
+void parse_request(const char *text, size_t length, double default_salt, double default_dna, int default_methods, serve_request &request)
+{
+  //Split "sequence [salt [dna [methods]]]"; a request that cannot be
+  //parsed gets its error as answer
+
+  string fields[4];
+  int n = 0;
+  size_t i = 0;
+  while (i < length && n < 4)
+    {
+      while (i < length && isspace((unsigned char) text[i])) i++;
+      size_t start = i;
+      while (i < length && !isspace((unsigned char) text[i])) i++;
+      if (i > start) fields[n++].assign(text+start, i-start);
+    }
+
+  request.stats = n == 1 && fields[0] == "stats";
+  request.sequence.clear();
+  request.answer.clear();
+  for (size_t k=0; k<fields[0].length(); k++) request.sequence += toupper((unsigned char) fields[0][k]);
+  request.salt_conc = n > 1 ? atof(fields[1].c_str()) : default_salt;
+  request.dna_conc = n > 2 ? atof(fields[2].c_str()) : default_dna;
+  request.methods = n > 3 ? parse_methods(fields[3]) : default_methods;
+
+  if (n == 0) request.answer = "ERROR: Empty request";
+  else if (request.methods == 0) request.answer = "ERROR: Unknown method in " + fields[3];
+  else if (request.salt_conc <= 0 || request.dna_conc <= 0) request.answer = "ERROR: Concentrations must be positive";
+}
+
+
+
+void serve_answer(serve_request &request)
+{
+  //Compute one request; the answer is formatted with snprintf("%g"),
+  //which writes doubles as the default ostream formatting of batch rows
+
+  if (!request.answer.empty() || request.stats) return;
+
+  melting_result result;
+  int status = melting_temperatures(request.sequence.data(), request.sequence.length(), request.salt_conc, request.dna_conc, request.methods, result);
+  if (status == MELTING_URACIL)
+    {
+      request.answer = "ERROR: Uracil not (yet) supported!";
+      return;
+    }
+  if (status == MELTING_EMPTY)
+    {
+      request.answer = "ERROR: No A, C, G or T in the sequence!";
+      return;
+    }
+
+  char buffer[512];
+  int methods = request.methods;
+  int n = snprintf(buffer, sizeof(buffer), "%zu\t%g\t%g\t%g\t%g", result.thermo.length, result.gc_content, result.molecular_weight, request.salt_conc, request.dna_conc);
+  if (methods & METHOD_WALLACE) n += snprintf(buffer+n, sizeof(buffer)-n, "\t%g", result.wallace_tm);
+  if (methods & METHOD_SALT) n += snprintf(buffer+n, sizeof(buffer)-n, "\t%g", result.salt_tm);
+  if (methods & METHOD_KHANDELWAL) n += snprintf(buffer+n, sizeof(buffer)-n, "\t%g", result.khandelwal_tm);
+  for (int m=0; m<NN_MODELS; m++)
+    if (methods & (METHOD_BRE << m)) n += snprintf(buffer+n, sizeof(buffer)-n, "\t%g", result.nn_tm[m]);
+  if (methods & METHOD_CONSENSUS) n += snprintf(buffer+n, sizeof(buffer)-n, "\t%g\t%s", result.consensus_tm, consensus_label(result.consensus_class));
+
+  request.answer.assign(buffer, n);
+}
+
+
+
+bool next_request(string &input, size_t &offset, int framing, bool closed, const char *&text, size_t &length)
+{
+  //Next complete request of a connection input buffer, starting at
+  //offset. Lines: empty lines and lines starting with '#' are skipped, a
+  //last line without newline is taken once the input is closed
+
+  while (offset < input.size())
+    {
+      if (framing == SERVE_LENGTH)
+	{
+	  if (input.size() - offset < 4) return false;
+	  const unsigned char *p = (const unsigned char *) input.data() + offset;
+	  length = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+	  if (input.size() - offset - 4 < length) return false;
+	  text = input.data() + offset + 4;
+	  offset += 4 + length;
+	  return true;
+	}
+
+      size_t end = input.find('\n', offset);
+      if (end == string::npos)
+	{
+	  if (!closed) return false;
+	  end = input.size();
+	}
+      text = input.data() + offset;
+      length = end - offset;
+      offset = end < input.size() ? end+1 : end;
+      if (length > 0 && text[length-1] == '\r') length--;
+      if (length == 0 || text[0] == '#') continue;
+      return true;
+    }
+
+  return false;
+}
+
+
+
+static void serve_frame(string &output, const string &answer, int framing)
+{
+  if (framing == SERVE_LENGTH)
+    {
+      size_t length = answer.size();
+      output += (char) (length >> 24);
+      output += (char) (length >> 16);
+      output += (char) (length >> 8);
+      output += (char) length;
+      output += answer;
+    }
+  else
+    {
+      output += answer;
+      output += '\n';
+    }
+}
+
+
+
+static bool serve_flush(serve_connection &connection)
+{
+  //Write the pending answers. Sockets take what they can without
+  //blocking, the rest is kept for the next round. Returns false if the
+  //client is gone
+
+  size_t written = 0;
+  while (written < connection.output.size())
+    {
+      ssize_t n;
+      if (connection.socket) n = send(connection.out_fd, connection.output.data()+written, connection.output.size()-written, MSG_NOSIGNAL);
+      else n = write(connection.out_fd, connection.output.data()+written, connection.output.size()-written);
+      if (n > 0) written += n;
+      else if (n < 0 && errno == EINTR) continue;
+      else if (n < 0 && connection.socket && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+      else return false;
+    }
+  connection.output.erase(0, written);
+  return true;
+}
+
+
+
+int open_serve_socket(const char *path)
+{
+  //Listening Unix domain socket at path. A stale socket left by a
+  //previous run is replaced; any other existing file is not touched
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(address.sun_path)) return -1;
+  strcpy(address.sun_path, path);
+
+  struct stat info;
+  if (lstat(path, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) return -1;
+  if (bind(fd, (sockaddr *) &address, sizeof(address)) < 0 || listen(fd, 128) < 0)
+    {
+      close(fd);
+      return -1;
+    }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+
+
+long run_serve(int listen_fd, int framing, double default_salt, double default_dna, int default_methods, int threads)
+{
+  //Event loop of the server: wait for input on any connection, take the
+  //complete requests of all of them (up to SERVE_BATCH), compute them as
+  //one micro-batch and write back the answers. Without listen_fd the only
+  //connection is stdin/stdout and the server stops at end of input.
+  //Latency is measured from the wake-up that received a request to the
+  //write of its answer. Returns the number of requests answered
+
+  typedef chrono::steady_clock clock;
+
+  work_stealing_pool pool(threads);
+  vector<serve_connection> connections;
+  vector<serve_request> batch(SERVE_BATCH);
+  vector<pollfd> fds;
+  latency_histogram latency;
+  long rounds = 0;
+  char buffer[65536];
+  bool backlog = false;
+
+  if (listen_fd < 0)
+    {
+      serve_connection console = {0, 1, false, false, "", ""};
+      connections.push_back(console);
+    }
+
+  while (!serve_stop)
+    {
+      fds.clear();
+      if (listen_fd >= 0)
+	{
+	  pollfd listener = {listen_fd, POLLIN, 0};
+	  fds.push_back(listener);
+	}
+      for (size_t c=0; c<connections.size(); c++)
+	{
+	  pollfd client = {connections[c].in_fd, 0, 0};
+	  if (!connections[c].closed) client.events |= POLLIN;
+	  if (connections[c].socket && !connections[c].output.empty()) client.events |= POLLOUT;
+	  fds.push_back(client);
+	}
+
+      //Requests left over from the last round are served without waiting
+      if (poll(&fds[0], fds.size(), backlog ? 0 : -1) < 0)
+	{
+	  if (errno == EINTR) continue;
+	  break;
+	}
+      clock::time_point received = clock::now();
+
+      size_t first = 0;
+      if (listen_fd >= 0)
+	{
+	  first = 1;
+	  if (fds[0].revents & POLLIN)
+	    {
+	      int fd;
+	      while ((fd = accept(listen_fd, 0, 0)) >= 0)
+		{
+		  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		  serve_connection client = {fd, fd, true, false, "", ""};
+		  connections.push_back(client);
+		}
+	    }
+	}
+
+      for (size_t c=0; c+first<fds.size(); c++)
+	{
+	  serve_connection &connection = connections[c];
+	  if (!(fds[c+first].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+	  if (connection.closed) continue;
+
+	  //Sockets are drained, stdin is read once (a read would block)
+	  do
+	    {
+	      ssize_t n = read(connection.in_fd, buffer, sizeof(buffer));
+	      if (n > 0) connection.input.append(buffer, n);
+	      else if (n < 0 && errno == EINTR) continue;
+	      else
+		{
+		  if (n == 0 || !(errno == EAGAIN || errno == EWOULDBLOCK)) connection.closed = true;
+		  break;
+		}
+	    }
+	  while (connection.socket);
+	}
+
+      //Micro-batch: complete requests of every connection, in order
+      int requests = 0;
+      backlog = false;
+      for (size_t c=0; c<connections.size(); c++)
+	{
+	  serve_connection &connection = connections[c];
+	  size_t offset = 0;
+	  const char *text;
+	  size_t length;
+	  while (requests < SERVE_BATCH && next_request(connection.input, offset, framing, connection.closed, text, length))
+	    {
+	      serve_request &request = batch[requests++];
+	      request.connection = c;
+	      parse_request(text, length, default_salt, default_dna, default_methods, request);
+	    }
+	  connection.input.erase(0, offset);
+	  if (requests == SERVE_BATCH) backlog = true;
+
+	  if (framing == SERVE_LENGTH && connection.input.size() >= 4)
+	    {
+	      const unsigned char *p = (const unsigned char *) connection.input.data();
+	      size_t length = ((size_t) p[0] << 24) | ((size_t) p[1] << 16) | ((size_t) p[2] << 8) | p[3];
+	      if (length > SERVE_MAX_REQUEST)
+		{
+		  std::cerr << "[WARNING]: request larger than " << SERVE_MAX_REQUEST << " bytes, connection closed" << std::endl;
+		  connection.input.clear();
+		  connection.closed = true;
+		}
+	    }
+	}
+
+      if (requests >= SERVE_POOL_BATCH && pool.size() > 1)
+	pool.run(requests, [&](int i, int){ serve_answer(batch[i]); });
+      else
+	for (int i=0; i<requests; i++) serve_answer(batch[i]);
+
+      //A "stats" answer includes the requests before it in this batch:
+      //their latency is recorded up to now, the others' after the flush
+      int recorded = 0;
+      for (int i=0; i<requests; i++)
+	{
+	  serve_request &request = batch[i];
+	  if (request.stats)
+	    {
+	      long ns = chrono::duration_cast<chrono::nanoseconds>(clock::now() - received).count();
+	      for (; recorded<i; recorded++) latency.add(ns);
+	      ostringstream stats;
+	      stats << "requests " << latency.count() << " p50_us " << latency.percentile(0.5)/1000 << " p99_us " << latency.percentile(0.99)/1000;
+	      request.answer = stats.str();
+	    }
+	  serve_frame(connections[request.connection].output, request.answer, framing);
+	}
+
+      for (size_t c=0; c<connections.size(); c++)
+	if (!serve_flush(connections[c]))
+	  {
+	    connections[c].closed = true;
+	    connections[c].output.clear();
+	  }
+
+      if (requests > 0)
+	{
+	  long ns = chrono::duration_cast<chrono::nanoseconds>(clock::now() - received).count();
+	  for (int i=recorded; i<requests; i++) latency.add(ns);
+	  rounds++;
+	}
+
+      //Drop the clients that are done
+      for (size_t c=connections.size(); c-- > 0; )
+	{
+	  serve_connection &connection = connections[c];
+	  if (!connection.closed || !connection.output.empty()) continue;
+	  if (backlog && !connection.input.empty()) continue;
+	  if (connection.socket) close(connection.in_fd);
+	  connections.erase(connections.begin()+c);
+	}
+
+      if (listen_fd < 0 && connections.empty()) break;
+    }
+
+  for (size_t c=0; c<connections.size(); c++)
+    {
+      serve_flush(connections[c]);
+      if (connections[c].socket) close(connections[c].in_fd);
+    }
+
+  std::cerr << "[INFO]: " << latency.count() << " requests in " << rounds << " micro-batches, latency p50 " << latency.percentile(0.5)/1000 << " us, p99 " << latency.percentile(0.99)/1000 << " us" << std::endl;
+
+  return latency.count();
+}
+
+
+
+bool parse_curve_option(int argc, char *argv[], int &i, curve_grid &grid)
+{
+  //Melting curve options shared by the single and batch modes:
+  //  --trange Tmin Tmax   temperature range (K)
+  //  --tstep dT           uniform grid step (K)
+  //  --adaptive tol       adaptive sampling, maximum interpolation error on f
+  //Returns false if argv[i] is not one of them
+
+  string option = argv[i];
+  if (option == "--trange" && i+2<argc)
+    {
+      grid.t_min = atof(argv[++i]);
+      grid.t_max = atof(argv[++i]);
+    }
+  else if (option == "--tstep" && i+1<argc) grid.t_step = atof(argv[++i]);
+  else if (option == "--adaptive" && i+1<argc) grid.tolerance = atof(argv[++i]);
+  else return false;
+
+  return true;
+}
+
+
+
+bool check_curve_grid(const curve_grid &grid)
+{
+  if (grid.t_min < 0 || grid.t_max <= grid.t_min || grid.t_step <= 0 || grid.tolerance < 0){
+    std::cout << "ERROR: Invalid melting curve grid" << std::endl;
+    return false;
+  }
+  return true;
+}
+
+
+
+bool print_degenerate(const string &sequence, double saltconc, double dnaconc)
+{
+  //Ambiguous IUPAC codes: the single sequence methods skip them, the NN
+  //range covers every expansion. Prints nothing (and returns false)
+  //without any
+  static const char *curve_names[NN_MODELS] = {"Breslauer", "SantaLucia", "Sugimoto"};
+  degenerate_result degenerate;
+  if (degenerate_melting(sequence.data(), sequence.length(), saltconc, dnaconc, degenerate) != MELTING_OK || degenerate.ambiguous == 0)
+    return false;
+
+  std::cout << " " << std::endl;
+  std::cout << "DEGENERATE SEQUENCE" << std::endl;
+  std::cout << "Ambiguous bases...... " << degenerate.ambiguous << std::endl;
+  std::cout << "Expansions........... " << degenerate.expansions << std::endl;
+  for (int m=0; m<NN_MODELS; m++)
+    std::cout << curve_names[m] << ": Tm " << degenerate.tm_min[m] << " to " << degenerate.tm_max[m] << " °C, mean " << degenerate.tm_mean[m] << " °C" << std::endl;
+  return true;
+}
+
+
+
+void enable_stats(const char *mode)
+{
+#ifndef DNA_MELTING_NO_STATS
+  stats_begin(mode);
+#else
+  (void) mode;
+  std::cerr << "[WARNING]: --stats ignored, built with DNA_MELTING_NO_STATS" << std::endl;
+#endif
+}
+
+
+
+void report_stats()
+{
+#ifndef DNA_MELTING_NO_STATS
+  if (stats.enabled) write_stats(std::cerr);
+#endif
+}
+
+
+
+int main(int argc, char *argv[]) 
+{
+
+
+  /***************************************  
+             Read input file
+  ***************************************/
+
+  if ( argc >= 2 && string(argv[1]) == "--batch" ) {
+
+    //Batch mode
+    //./dna_melting --batch <inputfile|-> [--salt M] [--dna M] [--methods list] [--threads N] [--curves file] [--curve-format F] [--transition] [--hairpin] [--degenerate] [--float32] [--nn-table file]... [--stats] [curve options]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --batch requires an input file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    int methods = METHOD_ALL;
+    int threads = 1;
+    string curve_file;
+    curve_grid grid = default_curve_grid;
+    int outputs = 0;
+    int curve_format = CURVE_TEXT;
+    bool with_stats = false;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--curves" && i+1<argc) curve_file = argv[++i];
+	else if (option == "--transition") outputs |= OUTPUT_TRANSITION;
+	else if (option == "--hairpin") outputs |= OUTPUT_HAIRPIN;
+	else if (option == "--degenerate") outputs |= OUTPUT_DEGENERATE;
+	else if (option == "--float32") outputs |= OUTPUT_FLOAT32;
+	else if (option == "--stats") with_stats = true;
+	else if (option == "--nn-table" && i+1<argc)
+	  {
+	    if (!load_nn_table(argv[++i])) return 0;
+	  }
+	else if (option == "--curve-format" && i+1<argc)
+	  {
+	    string format = argv[++i];
+	    if (format == "text") curve_format = CURVE_TEXT;
+	    else if (format == "float32") curve_format = CURVE_FLOAT32;
+	    else if (format == "float64") curve_format = CURVE_FLOAT64;
+	    else {
+	      std::cout << "ERROR: Unknown curve format " << format << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (parse_curve_option(argc, argv, i, grid));
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else if (option == "--methods" && i+1<argc)
+	  {
+	    methods = parse_methods(argv[++i]);
+	    if (methods == 0){
+	      std::cout << "ERROR: Unknown method in " << argv[i] << std::endl;
+	      return 0;
+	    }
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( !check_curve_grid(grid) ) return 0;
+    methods |= outputs;
+    if ( methods & OUTPUT_HAIRPIN )
+      prepare_hairpin_model(san_params, HAIRPIN_T, HAIRPIN_BAND, batch_hairpin_model);
+
+    std::ios::sync_with_stdio(false);
+    if ( with_stats ) enable_stats("batch");
+
+    ofstream curveout;
+    curve_file_writer curvewriter;
+    if ( !curve_file.empty() ){
+      bool opened;
+      if ( curve_format == CURVE_TEXT ) {
+	curveout.open(curve_file.c_str());
+	opened = curveout.is_open();
+      }
+      else opened = curvewriter.open(curve_file.c_str(), curve_format);
+      if ( !opened ){
+	std::cout<<"ERROR: Could not open file " << curve_file << std::endl;
+	return 0;
+      }
+    }
+    ostream *curves = (curve_file.empty() || curve_format != CURVE_TEXT) ? 0 : &curveout;
+    curve_file_writer *writer = (curve_file.empty() || curve_format == CURVE_TEXT) ? 0 : &curvewriter;
+
+    if ( string(argv[2]) == "-" ){
+      run_batch(std::cin, std::cout, saltconc, dnaconc, methods, threads, curves, writer, curve_format, grid);
+    }
+    else {
+      //A packed reference is processed in place from the mapping
+      mapped_file mapped;
+      vector<packed_record> records;
+      if ( mapped.open(argv[2]) && read_packed_records(mapped, records) ){
+	//Packed records are not decoded to text and hold no IUPAC codes
+	if ( methods & OUTPUT_HAIRPIN ){
+	  std::cerr << "[WARNING]: --hairpin is not available for packed input, ignored" << std::endl;
+	  methods &= ~OUTPUT_HAIRPIN;
+	}
+	if ( methods & OUTPUT_DEGENERATE ){
+	  std::cerr << "[WARNING]: --degenerate is not available for packed input, ignored" << std::endl;
+	  methods &= ~OUTPUT_DEGENERATE;
+	}
+	if ( methods & OUTPUT_FLOAT32 ){
+	  std::cerr << "[WARNING]: --float32 is not available for packed input, ignored" << std::endl;
+	  methods &= ~OUTPUT_FLOAT32;
+	}
+	run_batch_packed(records, std::cout, saltconc, dnaconc, methods, threads);
+	report_stats();
+	return 0;
+      }
+
+      ifstream filein (argv[2]);
+      if ( !filein.is_open() ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      run_batch(filein, std::cout, saltconc, dnaconc, methods, threads, curves, writer, curve_format, grid);
+    }
+
+    if ( writer && !curvewriter.close() )
+      std::cout << "ERROR: Could not write file " << curve_file << std::endl;
+
+    report_stats();
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--scan" ) {
+
+    //Sliding-window scan
+    //./dna_melting --scan <fastafile|-> --window L [--step S] [--strand +|-|both] [--salt M] [--dna M] [--stats]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --scan requires an input file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    long window = 0;
+    long step = 1;
+    int strands = STRAND_BOTH;
+    bool with_stats = false;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--window" && i+1<argc) window = atol(argv[++i]);
+	else if (option == "--step" && i+1<argc) step = atol(argv[++i]);
+	else if (option == "--stats") with_stats = true;
+	else if (option == "--strand" && i+1<argc)
+	  {
+	    string strand = argv[++i];
+	    if (strand == "+") strands = STRAND_PLUS;
+	    else if (strand == "-") strands = STRAND_MINUS;
+	    else if (strand == "both") strands = STRAND_BOTH;
+	    else {
+	      std::cout << "ERROR: Unknown strand " << strand << std::endl;
+	      return 0;
+	    }
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( window < 2 || step < 1 ){
+      std::cout << "ERROR: --scan requires --window >= 2 and --step >= 1" << std::endl;
+      return 0;
+    }
+
+    std::ios::sync_with_stdio(false);
+    if ( with_stats ) enable_stats("scan");
+
+    if ( string(argv[2]) == "-" ){
+      run_scan(std::cin, std::cout, window, step, strands, saltconc, dnaconc);
+    }
+    else {
+      mapped_file mapped;
+      if ( !mapped.open(argv[2]) ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      run_scan_mapped(mapped, std::cout, window, step, strands, saltconc, dnaconc);
+    }
+
+    report_stats();
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--sweep" ) {
+
+    //Condition sweep
+    //./dna_melting --sweep <inputfile|-> [--salt GRID] [--dna GRID] [--methods list] [--threads N] [--long]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --sweep requires an input file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    vector<double> salt_grid(1, 0.05), dna_grid(1, 0.00000005);
+    int methods = METHOD_BRE | METHOD_SAN | METHOD_SUG;
+    int threads = 1;
+    bool long_format = false;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if ((option == "--salt" || option == "--dna") && i+1<argc)
+	  {
+	    if (!parse_grid(argv[++i], option == "--salt" ? salt_grid : dna_grid)){
+	      std::cout << "ERROR: Invalid grid " << argv[i] << " (use v1,v2,... or MIN:MAX:N, all > 0)" << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (option == "--long") long_format = true;
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else if (option == "--methods" && i+1<argc)
+	  {
+	    methods = parse_methods(argv[++i]);
+	    if (methods == 0){
+	      std::cout << "ERROR: Unknown method in " << argv[i] << std::endl;
+	      return 0;
+	    }
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    sweep_conditions conditions;
+    prepare_sweep(salt_grid, dna_grid, conditions);
+    std::ios::sync_with_stdio(false);
+
+    if ( string(argv[2]) == "-" ){
+      run_sweep(std::cin, std::cout, conditions, methods, threads, long_format);
+    }
+    else {
+      ifstream filein (argv[2]);
+      if ( !filein.is_open() ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      run_sweep(filein, std::cout, conditions, methods, threads, long_format);
+    }
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--primers" ) {
+
+    //Primer search
+    //./dna_melting --primers <fastafile|-> [--length MIN MAX] [--tm MODEL MIN MAX]... [--gc MIN MAX] [--clamp MIN MAX] [--max-run N]
+    //              [--strand +|-|both] [--salt M] [--dna M] [--top K] [--pairs] [--product MIN MAX] [--max-tm-diff D]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --primers requires an input file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    primer_constraints constraints = default_primer_constraints;
+    bool tm_given = false;
+    long top = 10;
+    bool pairs = false;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) constraints.salt_conc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) constraints.dna_conc = atof(argv[++i]);
+	else if (option == "--length" && i+2<argc)
+	  {
+	    constraints.min_length = atoi(argv[++i]);
+	    constraints.max_length = atoi(argv[++i]);
+	  }
+	else if (option == "--gc" && i+2<argc)
+	  {
+	    constraints.gc_min = atof(argv[++i]);
+	    constraints.gc_max = atof(argv[++i]);
+	  }
+	else if (option == "--clamp" && i+2<argc)
+	  {
+	    constraints.clamp_min = atoi(argv[++i]);
+	    constraints.clamp_max = atoi(argv[++i]);
+	  }
+	else if (option == "--tm" && i+3<argc)
+	  {
+	    //The first --tm replaces the default window
+	    string model = argv[++i];
+	    int m = model == "bre" ? NN_BRE : model == "san" ? NN_SAN : model == "sug" ? NN_SUG : -1;
+	    if (m < 0){
+	      std::cout << "ERROR: Unknown model " << model << " (use bre, san or sug)" << std::endl;
+	      return 0;
+	    }
+	    if (!tm_given) constraints.tm_models = 0;
+	    tm_given = true;
+	    constraints.tm_models |= 1 << m;
+	    constraints.tm_min[m] = atof(argv[++i]);
+	    constraints.tm_max[m] = atof(argv[++i]);
+	  }
+	else if (option == "--max-run" && i+1<argc) constraints.max_run = atoi(argv[++i]);
+	else if (option == "--top" && i+1<argc) top = atol(argv[++i]);
+	else if (option == "--pairs") pairs = true;
+	else if (option == "--product" && i+2<argc)
+	  {
+	    constraints.product_min = atol(argv[++i]);
+	    constraints.product_max = atol(argv[++i]);
+	  }
+	else if (option == "--max-tm-diff" && i+1<argc) constraints.max_tm_diff = atof(argv[++i]);
+	else if (option == "--strand" && i+1<argc)
+	  {
+	    string strand = argv[++i];
+	    if (strand == "+") constraints.strands = PRIMER_FORWARD;
+	    else if (strand == "-") constraints.strands = PRIMER_REVERSE;
+	    else if (strand == "both") constraints.strands = PRIMER_BOTH;
+	    else {
+	      std::cout << "ERROR: Unknown strand " << strand << std::endl;
+	      return 0;
+	    }
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( constraints.min_length < 2 || constraints.max_length < constraints.min_length || top < 1 ){
+      std::cout << "ERROR: --primers requires 2 <= length MIN <= MAX and --top >= 1" << std::endl;
+      return 0;
+    }
+    if ( pairs && constraints.strands != PRIMER_BOTH ){
+      std::cout << "ERROR: --pairs requires both strands" << std::endl;
+      return 0;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    if ( string(argv[2]) == "-" ){
+      run_primers(std::cin, std::cout, constraints, top, pairs);
+    }
+    else {
+      ifstream filein (argv[2]);
+      if ( !filein.is_open() ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      run_primers(filein, std::cout, constraints, top, pairs);
+    }
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--offtarget" ) {
+
+    //Off-target scan
+    //./dna_melting --offtarget <reference> <probefile|-> [--mismatches N] [--min-tm T] [--seed K] [--model bre|san|sug] [--salt M] [--dna M] [--threads N]
+    if ( argc < 4 ){
+      std::cout << "ERROR: --offtarget requires a reference (FASTA or packed) and a probe file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    int max_mismatches = 2;
+    double min_tm = 40;
+    int seed = OFFTARGET_SEED;
+    int model = NN_SAN;
+    int threads = 1;
+
+    for (int i=4; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--mismatches" && i+1<argc) max_mismatches = atoi(argv[++i]);
+	else if (option == "--min-tm" && i+1<argc) min_tm = atof(argv[++i]);
+	else if (option == "--seed" && i+1<argc) seed = atoi(argv[++i]);
+	else if (option == "--model" && i+1<argc)
+	  {
+	    string name = argv[++i];
+	    model = name == "bre" ? NN_BRE : name == "san" ? NN_SAN : name == "sug" ? NN_SUG : -1;
+	    if (model < 0){
+	      std::cout << "ERROR: Unknown model " << name << " (use bre, san or sug)" << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( max_mismatches < 0 || seed < 1 || seed > SEED_MAX_K ){
+      std::cout << "ERROR: --offtarget requires --mismatches >= 0 and 1 <= --seed <= " << SEED_MAX_K << std::endl;
+      return 0;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    //Probes first: the seed length depends on the shortest one
+    //The records are views into the arena of the reader, kept until the end
+    vector<batch_record> probes;
+    unique_ptr<record_reader> probe_reader;
+    {
+      ifstream probefile;
+      istream *filein = &std::cin;
+      if ( string(argv[3]) != "-" ){
+	probefile.open(argv[3]);
+	if ( !probefile.is_open() ){
+	  std::cout<<"ERROR: Could not open file " << argv[3] << std::endl;
+	  return 0;
+	}
+	filein = &probefile;
+      }
+
+      probe_reader.reset(new record_reader(*filein));
+      batch_record probe;
+      while (true)
+	{
+	  probe.salt_conc = saltconc;
+	  probe.dna_conc = dnaconc;
+	  if (!probe_reader->next(probe.id, probe.sequence, probe.salt_conc, probe.dna_conc)) break;
+	  probes.push_back(probe);
+	  size_t segment = probe.sequence.length()/(max_mismatches+1);
+	  if (segment > 0 && (int) segment < seed) seed = segment;
+	}
+    }
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    reference_genome reference;
+    if ( !load_reference(argv[2], reference) ){
+      std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+      return 0;
+    }
+
+    seed_index index;
+    if ( !build_seed_index(reference, seed, index) ){
+      std::cout << "ERROR: References of 2^32 bases or more are not supported" << std::endl;
+      return 0;
+    }
+    std::cerr << "[INFO]: " << reference.codes.size() << " bases in " << reference.names.size() << " records, " << seed << "-mer seed index built in "
+	      << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s" << std::endl;
+    if ( seed < 8 )
+      std::cerr << "[WARNING]: seeds of " << seed << " bases, the search will be slow (fewer mismatches or longer probes give longer seeds)" << std::endl;
+
+    nn_duplex_params duplex;
+    mismatch_duplex_params(*nn_models[model], duplex);
+
+    run_offtargets(reference, index, duplex, probes, std::cout, max_mismatches, min_tm, threads);
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--dimers" ) {
+
+    //All-pairs primer-dimer screen
+    //./dna_melting --dimers <primerfile|-> [--max-dg G] [--min-run N] [--model bre|san|sug] [--salt M] [--dna M] [--threads N]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --dimers requires a primer file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    double max_dg = DIMER_MAX_DG;
+    int min_run = DIMER_MIN_RUN;
+    int model = NN_SAN;
+    int threads = 1;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--max-dg" && i+1<argc) max_dg = atof(argv[++i]);
+	else if (option == "--min-run" && i+1<argc) min_run = atoi(argv[++i]);
+	else if (option == "--model" && i+1<argc)
+	  {
+	    string name = argv[++i];
+	    model = name == "bre" ? NN_BRE : name == "san" ? NN_SAN : name == "sug" ? NN_SUG : -1;
+	    if (model < 0){
+	      std::cout << "ERROR: Unknown model " << name << " (use bre, san or sug)" << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( min_run < 2 ){
+      std::cout << "ERROR: --dimers requires --min-run >= 2" << std::endl;
+      return 0;
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    //Conditions in the records are ignored: a dimer has two strands
+    //The records are views into the arena of the reader, kept until the end
+    vector<batch_record> primers;
+    unique_ptr<record_reader> primer_reader;
+    {
+      ifstream primerfile;
+      istream *filein = &std::cin;
+      if ( string(argv[2]) != "-" ){
+	primerfile.open(argv[2]);
+	if ( !primerfile.is_open() ){
+	  std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	  return 0;
+	}
+	filein = &primerfile;
+      }
+
+      primer_reader.reset(new record_reader(*filein));
+      batch_record primer;
+      while (primer_reader->next(primer.id, primer.sequence, primer.salt_conc, primer.dna_conc))
+	primers.push_back(primer);
+    }
+
+    dimer_model dimers;
+    prepare_dimer_model(*nn_models[model], saltconc, dnaconc, min_run, max_dg, dimers);
+    run_dimers(primers, std::cout, dimers, threads);
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--variants" ) {
+
+    //Saturation mutagenesis
+    //./dna_melting --variants <inputfile|-> [--indels] [--salt M] [--dna M] [--threads N]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --variants requires an input file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    bool indels = false;
+    int threads = 1;
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--indels") indels = true;
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    std::ios::sync_with_stdio(false);
+
+    //The records are views into the arena of the reader, kept until the end
+    vector<batch_record> records;
+    unique_ptr<record_reader> variant_reader;
+    {
+      ifstream recordfile;
+      istream *filein = &std::cin;
+      if ( string(argv[2]) != "-" ){
+	recordfile.open(argv[2]);
+	if ( !recordfile.is_open() ){
+	  std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	  return 0;
+	}
+	filein = &recordfile;
+      }
+
+      variant_reader.reset(new record_reader(*filein));
+      batch_record record;
+      while (true)
+	{
+	  record.salt_conc = saltconc;
+	  record.dna_conc = dnaconc;
+	  if (!variant_reader->next(record.id, record.sequence, record.salt_conc, record.dna_conc)) break;
+	  records.push_back(record);
+	}
+    }
+
+    run_variants(records, std::cout, indels, threads);
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--design" ) {
+
+    //Inverse design
+    //./dna_melting --design [--length L] [--count N] [--tm MODEL MIN MAX]... [--gc MIN MAX] [--clamp MIN MAX] [--max-run N]
+    //              [--min-distance D] [--steps S] [--chains C] [--seed X] [--salt M] [--dna M] [--threads N]
+    primer_constraints constraints = default_primer_constraints;
+    constraints.tm_models = (1 << NN_BRE) | (1 << NN_SAN) | (1 << NN_SUG);
+    constraints.clamp_min = 0;
+    constraints.clamp_max = PRIMER_CLAMP_BASES;
+    bool tm_given = false;
+    long length = 20;
+    long count = 10;
+    long min_distance = -1;
+    long steps = DESIGN_STEPS;
+    long max_chains = -1;
+    unsigned long long seed = 1;
+    int threads = 1;
+
+    for (int i=2; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) constraints.salt_conc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) constraints.dna_conc = atof(argv[++i]);
+	else if (option == "--length" && i+1<argc) length = atol(argv[++i]);
+	else if (option == "--count" && i+1<argc) count = atol(argv[++i]);
+	else if (option == "--min-distance" && i+1<argc) min_distance = atol(argv[++i]);
+	else if (option == "--steps" && i+1<argc) steps = atol(argv[++i]);
+	else if (option == "--chains" && i+1<argc) max_chains = atol(argv[++i]);
+	else if (option == "--seed" && i+1<argc) seed = strtoull(argv[++i], 0, 10);
+	else if (option == "--gc" && i+2<argc)
+	  {
+	    constraints.gc_min = atof(argv[++i]);
+	    constraints.gc_max = atof(argv[++i]);
+	  }
+	else if (option == "--clamp" && i+2<argc)
+	  {
+	    constraints.clamp_min = atoi(argv[++i]);
+	    constraints.clamp_max = atoi(argv[++i]);
+	  }
+	else if (option == "--tm" && i+3<argc)
+	  {
+	    //The first --tm replaces the default windows
+	    string model = argv[++i];
+	    int m = model == "bre" ? NN_BRE : model == "san" ? NN_SAN : model == "sug" ? NN_SUG : -1;
+	    if (m < 0){
+	      std::cout << "ERROR: Unknown model " << model << " (use bre, san or sug)" << std::endl;
+	      return 0;
+	    }
+	    if (!tm_given) constraints.tm_models = 0;
+	    tm_given = true;
+	    constraints.tm_models |= 1 << m;
+	    constraints.tm_min[m] = atof(argv[++i]);
+	    constraints.tm_max[m] = atof(argv[++i]);
+	  }
+	else if (option == "--max-run" && i+1<argc) constraints.max_run = atoi(argv[++i]);
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( min_distance < 0 ) min_distance = length/4 > 1 ? length/4 : 1;
+    if ( max_chains < 0 ) max_chains = 20*count;
+    if ( length < 2 || count < 1 || steps < 1 || max_chains < 1 ){
+      std::cout << "ERROR: --design requires --length >= 2 and --count, --steps, --chains >= 1" << std::endl;
+      return 0;
+    }
+
+    std::ios::sync_with_stdio(false);
+    run_design(std::cout, constraints, length, count, min_distance, steps, seed, max_chains, threads);
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--ps" ) {
+
+    //Poland-Scheraga melting curves of long sequences
+    //./dna_melting --ps <fastafile|-> [--model bre|san|sug] [--salt M] [--dna M] [--sigma S] [--alpha A] [--chunk N] [--overlap N] [--map file] [--threads N] [--trange Tmin Tmax] [--tstep dT]
+    if ( argc < 3 ){
+      std::cout << "ERROR: --ps requires a FASTA file (use - for stdin)" << std::endl;
+      return 0;
+    }
+
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    double sigma = PS_SIGMA, alpha = PS_ALPHA;
+    long chunk = PS_CHUNK, overlap = PS_OVERLAP;
+    int model = NN_SAN;
+    int threads = 1;
+    const char *mapname = 0;
+    curve_grid grid = {PS_T_MIN, PS_T_MAX, PS_T_STEP, 0.0};
+
+    for (int i=3; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--sigma" && i+1<argc) sigma = atof(argv[++i]);
+	else if (option == "--alpha" && i+1<argc) alpha = atof(argv[++i]);
+	else if (option == "--chunk" && i+1<argc) chunk = atol(argv[++i]);
+	else if (option == "--overlap" && i+1<argc) overlap = atol(argv[++i]);
+	else if (option == "--map" && i+1<argc) mapname = argv[++i];
+	else if (option == "--model" && i+1<argc)
+	  {
+	    string name = argv[++i];
+	    model = name == "bre" ? NN_BRE : name == "san" ? NN_SAN : name == "sug" ? NN_SUG : -1;
+	    if (model < 0){
+	      std::cout << "ERROR: Unknown model " << name << " (use bre, san or sug)" << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else if (option != "--adaptive" && parse_curve_option(argc, argv, i, grid));
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    if ( !check_curve_grid(grid) ) return 0;
+    if ( sigma <= 0 || alpha <= 0 || chunk < 1 || overlap < 0 ){
+      std::cout << "ERROR: --ps requires --sigma > 0, --alpha > 0, --chunk >= 1 and --overlap >= 0" << std::endl;
+      return 0;
+    }
+
+    vector<double> t(curve_points(grid.t_min, grid.t_max, grid.t_step));
+    for (size_t k=0; k<t.size(); k++) t[k] = grid.t_min + k*grid.t_step;
+
+    ps_model weights;
+    prepare_ps_model(*nn_models[model], saltconc, sigma, alpha, chunk, weights);
+
+    ofstream mapfile;
+    if ( mapname ){
+      mapfile.open(mapname);
+      if ( !mapfile.is_open() ){
+	std::cout<<"ERROR: Could not open file " << mapname << std::endl;
+	return 0;
+      }
+    }
+
+    std::ios::sync_with_stdio(false);
+
+    if ( string(argv[2]) == "-" ){
+      run_ps(std::cin, std::cout, mapname ? &mapfile : 0, *nn_models[model], weights, dnaconc, chunk, overlap, t, threads);
+    }
+    else {
+      ifstream filein (argv[2]);
+      if ( !filein.is_open() ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      run_ps(filein, std::cout, mapname ? &mapfile : 0, *nn_models[model], weights, dnaconc, chunk, overlap, t, threads);
+    }
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--print-nn-table" ) {
+
+    //Built-in table in the --nn-table file format
+    //./dna_melting --print-nn-table bre|san|sug
+    string name = argc == 3 ? argv[2] : "";
+    int model = name == "bre" ? NN_BRE : name == "san" ? NN_SAN : name == "sug" ? NN_SUG : -1;
+    if ( model < 0 ){
+      std::cout << "ERROR: --print-nn-table requires a model (bre, san or sug)" << std::endl;
+      return 0;
+    }
+    std::cout << format_nn_params(*nn_models[model], name);
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--export-curves" ) {
+
+    //Text export of a binary curve file
+    //./dna_melting --export-curves <curvefile> [--record id]
+    if ( argc != 3 && !(argc == 5 && string(argv[3]) == "--record") ){
+      std::cout << "ERROR: --export-curves requires a curve file and optionally --record id" << std::endl;
+      return 0;
+    }
+
+    string record_id = argc == 5 ? argv[4] : "";
+    std::ios::sync_with_stdio(false);
+    long exported = export_curves(argv[2], record_id, std::cout);
+
+    if ( exported < 0 ) std::cout << "ERROR: " << argv[2] << " is not a valid curve file" << std::endl;
+    else if ( exported == 0 && !record_id.empty() ) std::cout << "ERROR: Record " << record_id << " not found" << std::endl;
+    else if ( !record_id.empty() ) std::cout << "Melting curve files written: bre_melting_curve.out, san_melting_curve.out and sug_melting_curve.out" << std::endl;
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--pack" ) {
+
+    //Packed reference
+    //./dna_melting --pack <fastafile|-> <packedfile>
+    if ( argc != 4 ){
+      std::cout << "ERROR: --pack requires an input FASTA file (use - for stdin) and an output file" << std::endl;
+      return 0;
+    }
+
+    long records;
+    if ( string(argv[2]) == "-" ){
+      records = pack_fasta(std::cin, argv[3]);
+    }
+    else {
+      ifstream filein (argv[2]);
+      if ( !filein.is_open() ){
+	std::cout<<"ERROR: Could not open file " << argv[2] << std::endl;
+	return 0;
+      }
+      records = pack_fasta(filein, argv[3]);
+    }
+
+    if ( records < 0 ) std::cout << "ERROR: Could not write file " << argv[3] << std::endl;
+    else std::cout << records << " records packed in " << argv[3] << std::endl;
+
+    return 0;
+  }
+  else if ( argc >= 2 && string(argv[1]) == "--serve" ) {
+
+    //Server mode
+    //./dna_melting --serve [--socket path] [--framing line|length] [--salt M] [--dna M] [--methods list] [--threads N]
+    double saltconc = 0.05;
+    double dnaconc = 0.00000005;
+    int methods = METHOD_ALL;
+    int threads = 1;
+    int framing = SERVE_LINES;
+    string socket_path;
+
+    for (int i=2; i<argc; i++)
+      {
+	string option = argv[i];
+	if (option == "--salt" && i+1<argc) saltconc = atof(argv[++i]);
+	else if (option == "--dna" && i+1<argc) dnaconc = atof(argv[++i]);
+	else if (option == "--socket" && i+1<argc) socket_path = argv[++i];
+	else if (option == "--framing" && i+1<argc)
+	  {
+	    string format = argv[++i];
+	    if (format == "line") framing = SERVE_LINES;
+	    else if (format == "length") framing = SERVE_LENGTH;
+	    else {
+	      std::cout << "ERROR: Unknown framing " << format << std::endl;
+	      return 0;
+	    }
+	  }
+	else if (option == "--threads" && i+1<argc)
+	  {
+	    threads = atoi(argv[++i]);
+	    if (threads <= 0) threads = thread::hardware_concurrency();
+	  }
+	else if (option == "--methods" && i+1<argc)
+	  {
+	    methods = parse_methods(argv[++i]);
+	    if (methods == 0){
+	      std::cout << "ERROR: Unknown method in " << argv[i] << std::endl;
+	      return 0;
+	    }
+	  }
+	else {
+	  std::cout << "ERROR: Unknown option " << option << std::endl;
+	  return 0;
+	}
+      }
+
+    int listen_fd = -1;
+    if ( !socket_path.empty() ){
+      listen_fd = open_serve_socket(socket_path.c_str());
+      if ( listen_fd < 0 ){
+	std::cout << "ERROR: Could not listen on socket " << socket_path << std::endl;
+	return 0;
+      }
+    }
+
+    signal(SIGINT, serve_signal);
+    signal(SIGTERM, serve_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    run_serve(listen_fd, framing, saltconc, dnaconc, methods, threads);
+
+    if ( listen_fd >= 0 ){
+      close(listen_fd);
+      unlink(socket_path.c_str());
+    }
+
+    return 0;
+  }
+  else if ( argc < 2 || argv[1][0] == '-' ) {
+    std::cout << " " << std::endl;
+    std::cout << " Welcome to the dna_melting code!" << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " dna_melting gives information about the sequence (length, GC content, molecular weigth)" << std::endl;
+    std::cout << " and compute melting temperature using:" << std::endl;
+    std::cout << " 1. Wallance rule" << std::endl;
     std::cout << " 2. Salt adjusted method" << std::endl;
     std::cout << " 3. Khandelwal method" << std::endl;
     std::cout << " 4. Breslauer method (profile in bre_melting_curve.out)" << std::endl;
@@ -1022,17 +4465,117 @@ int main(int argc, char *argv[])
     std::cout << " 7. Consensus method" << std::endl;
     std::cout << " " << std::endl;
     std::cout << " " << std::endl;
-    std::cout << " Usage: ./dna_melting <inputfile> " << std::endl;
+    std::cout << " Usage: ./dna_melting <inputfile> [--transition] [curve options]" << std::endl;
+    std::cout << "        ./dna_melting --batch <inputfile|-> [--salt M] [--dna M] [--methods list] [--threads N]" << std::endl;
+    std::cout << "                      [--curves file] [--curve-format text|float32|float64] [--transition] [--hairpin]" << std::endl;
+    std::cout << "                      [--degenerate] [--float32]" << std::endl;
+    std::cout << "                      [--nn-table file]... [--stats] [curve options]" << std::endl;
+    std::cout << "        ./dna_melting --scan <fastafile|-> --window L [--step S] [--strand +|-|both] [--salt M] [--dna M] [--stats]" << std::endl;
+    std::cout << "        ./dna_melting --sweep <inputfile|-> [--salt GRID] [--dna GRID] [--methods list] [--threads N] [--long]" << std::endl;
+    std::cout << "        ./dna_melting --primers <fastafile|-> [--length MIN MAX] [--tm bre|san|sug MIN MAX]... [--gc MIN MAX]" << std::endl;
+    std::cout << "                      [--clamp MIN MAX] [--max-run N] [--strand +|-|both] [--salt M] [--dna M] [--top K]" << std::endl;
+    std::cout << "                      [--pairs [--product MIN MAX] [--max-tm-diff D]]" << std::endl;
+    std::cout << "        ./dna_melting --offtarget <reference> <probefile|-> [--mismatches N] [--min-tm T] [--seed K]" << std::endl;
+    std::cout << "                      [--model bre|san|sug] [--salt M] [--dna M] [--threads N]" << std::endl;
+    std::cout << "        ./dna_melting --dimers <primerfile|-> [--max-dg G] [--min-run N] [--model bre|san|sug] [--salt M] [--dna M]" << std::endl;
+    std::cout << "                      [--threads N]" << std::endl;
+    std::cout << "        ./dna_melting --variants <inputfile|-> [--indels] [--salt M] [--dna M] [--threads N]" << std::endl;
+    std::cout << "        ./dna_melting --design [--length L] [--count N] [--tm bre|san|sug MIN MAX]... [--gc MIN MAX]" << std::endl;
+    std::cout << "                      [--clamp MIN MAX] [--max-run N] [--min-distance D] [--steps S] [--chains C]" << std::endl;
+    std::cout << "                      [--seed X] [--salt M] [--dna M] [--threads N]" << std::endl;
+    std::cout << "        ./dna_melting --ps <fastafile|-> [--model bre|san|sug] [--salt M] [--dna M] [--sigma S] [--alpha A]" << std::endl;
+    std::cout << "                      [--chunk N] [--overlap N] [--map file] [--threads N] [--trange Tmin Tmax] [--tstep dT]" << std::endl;
+    std::cout << "        ./dna_melting --pack <fastafile|-> <packedfile>" << std::endl;
+    std::cout << "        ./dna_melting --export-curves <curvefile> [--record id]" << std::endl;
+    std::cout << "        ./dna_melting --print-nn-table bre|san|sug" << std::endl;
+    std::cout << "        ./dna_melting --serve [--socket path] [--framing line|length] [--salt M] [--dna M] [--methods list] [--threads N]" << std::endl;
     std::cout << " " << std::endl;
     std::cout << " The inputfile should contain the following lines" << std::endl;
     std::cout << " sequence (5'-->3') " << std::endl;
     std::cout << " salt concentration [M] (deal [Na+] = 0.05 M)" << std::endl;
     std::cout << " total nucleotide strand concentration [M] (ideal concentration 5e-8M) " << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In batch mode the inputfile is a multi-record FASTA (conditions may be given" << std::endl;
+    std::cout << " in the header as salt=<M> dna=<M>) or a TSV file (id, sequence[, salt[, dna]])." << std::endl;
+    std::cout << " One tab separated row is written per record; methods are a comma separated" << std::endl;
+    std::cout << " list of wallace,salt,khandelwal,bre,san,sug,consensus (default: all)." << std::endl;
+    std::cout << " --threads N processes records on N threads (0 = all cores), output keeps input order." << std::endl;
+    std::cout << " --curves file writes the Breslauer, SantaLucia and Sugimoto melting curves of every record." << std::endl;
+    std::cout << " With --curve-format float32|float64 they go to one indexed binary file instead;" << std::endl;
+    std::cout << " --export-curves turns it back into text (all curves, or the three *_melting_curve.out" << std::endl;
+    std::cout << " files of one record for plot_curve.gnu)." << std::endl;
+    std::cout << " --transition adds the curve Tm, width (f=0.9..0.1) and -df/dT peak of the three models." << std::endl;
+    std::cout << " --hairpin adds the deltaG at 37 C (kcal/mol) and Tm of the most stable hairpin (stem-loop)." << std::endl;
+    std::cout << " --degenerate adds, for each of bre, san, sug selected, the lowest, highest and mean Tm over" << std::endl;
+    std::cout << " every expansion of the IUPAC codes (N, R, Y, ...) of the sequence, and their number." << std::endl;
+    std::cout << " --float32 computes the bre, san, sug Tm and the curves in single precision (faster; within" << std::endl;
+    std::cout << " 0.01 K of the default, checked by dna_melting_bench --accuracy)." << std::endl;
+    std::cout << " --nn-table file adds the Tm of a nearest-neighbor table read from file (see --print-nn-table" << std::endl;
+    std::cout << " for the format); it is computed by the same kernel as the built-in models." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " Curve options: --trange Tmin Tmax (K, default 0 700), --tstep dT (K, default 0.5)," << std::endl;
+    std::cout << " --adaptive tol (sample only where f changes, with interpolation error below tol)." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In scan mode the Breslauer, SantaLucia and Sugimoto Tm of every window of L bases" << std::endl;
+    std::cout << " (every S bases) of each FASTA record is written as a per-position track." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In sweep mode the Tm of every record is computed for every salt and DNA concentration of" << std::endl;
+    std::cout << " the grids (v1,v2,... or MIN:MAX:N log-spaced values; default methods bre,san,sug)." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In primer mode every window of MIN..MAX bases of each template (default 18..25) on both" << std::endl;
+    std::cout << " strands is checked against the Tm windows (default san 52..65 C), GC% (40..60), the G/C" << std::endl;
+    std::cout << " among the last 5 bases at the 3' end (1..3) and the longest run of one base (4); the K" << std::endl;
+    std::cout << " closest to the centres of the Tm windows are written, or with --pairs the K best pairs" << std::endl;
+    std::cout << " (product 100..1000 bases, Tm difference up to 5 C)." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In off-target mode every site of the reference (FASTA or packed) within N mismatches" << std::endl;
+    std::cout << " (default 2) of a probe, on either strand, is scored with mismatch NN parameters and" << std::endl;
+    std::cout << " reported if its Tm is at least T (default 40 C)." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In dimers mode every pair of primers of the pool (each one with itself included) is" << std::endl;
+    std::cout << " annealed antiparallel at every offset; pairs whose most stable duplex has deltaG at 37 C" << std::endl;
+    std::cout << " at or below G (default -6 kcal/mol) are written as a sparse conflict matrix. Offsets" << std::endl;
+    std::cout << " without N (default 4) complementary bases in a row are not scored." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In variants mode the Breslauer, SantaLucia and Sugimoto Tm shift of every single-base" << std::endl;
+    std::cout << " substitution (and with --indels insertion and deletion) of each record is written." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In design mode N sequences of L bases (default 10 of 20) with their Tm in every window" << std::endl;
+    std::cout << " (default 52..65 C for bre, san and sug), GC content, GC clamp and longest run within" << std::endl;
+    std::cout << " limits are searched by simulated annealing chains; kept sequences differ in at least" << std::endl;
+    std::cout << " D bases (default L/4)." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " In ps mode the melting curve of long sequences (amplicons, genomic fragments) is computed" << std::endl;
+    std::cout << " with the Poland-Scheraga model: fraction of closed base pairs and -dtheta/dT over" << std::endl;
+    std::cout << " Tmin..Tmax (default 320..380 K, step 0.5); --map writes the Tm of every base pair." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " --pack converts a FASTA file into a 2-bit packed reference, which --batch and --scan" << std::endl;
+    std::cout << " read directly through a memory map." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " --stats (batch and scan) writes records, bases, bytes written, seconds per stage," << std::endl;
+    std::cout << " sampled time per method and per-thread utilization to stderr as JSON at exit." << std::endl;
+    std::cout << " " << std::endl;
+    std::cout << " --serve answers requests \"sequence [salt [dna [methods]]]\" on stdin/stdout or on a Unix" << std::endl;
+    std::cout << " socket until stopped, one answer line per request; \"stats\" gives the p50/p99 latency." << std::endl;
     std::cout << "  " << std::endl;
     std::cout << " For further information please check the manual." << std::endl;
     std::cout << "  " << std::endl;
   }
   else {
+    //Optional melting curve options after the input file; the curve
+    //transition is only printed if one of them (or --transition) is given
+    curve_grid grid = default_curve_grid;
+    bool with_transition = false;
+    for (int i=2; i<argc; i++)
+      {
+	with_transition = true;
+	if (string(argv[i]) != "--transition" && !parse_curve_option(argc, argv, i, grid)){
+	  std::cout << "ERROR: Unknown option " << argv[i] << std::endl;
+	  return 0;
+	}
+      }
+    if ( !check_curve_grid(grid) ) return 0;
+
     ifstream filein (argv[1]);
 
     string sequence;
@@ -1051,10 +4594,6 @@ int main(int argc, char *argv[])
 
 
     int seqlen;
-    int acnt = 0;
-    int ccnt = 0;
-    int gcnt = 0;
-    int tcnt = 0;
 
     //Find lenght of sequence
     seqlen = sequence.length();
@@ -1065,42 +4604,28 @@ int main(int argc, char *argv[])
     std::cout << "Sequence............. " << sequence << std::endl;
     std::cout << "Length............... " << seqlen << std::endl;
 
-    //Count number of bases in the sequence
-    for (int i=0; i<seqlen; i++)
+    //One pass over the sequence: every method below works on its summary
+    sequence_thermo thermo;
+    int status = summarize_sequence(sequence.data(), sequence.length(), thermo);
+    if (status == MELTING_URACIL)
       {
-	if (sequence[i] == 'A')
-	  acnt++;
-	else if (sequence[i] == 'C')
-	  ccnt++;
-	else if (sequence[i] == 'G')
-	  gcnt++;
-	else if (sequence[i] == 'T')
-	  tcnt++;
-	else if (sequence[i] == 'U')
-	  {
-	    std::cout << "[ERROR]: Uracil not (yet) supported!" << std::endl;
-	    return 0;
-	  }
+	std::cout << "[ERROR]: Uracil not (yet) supported!" << std::endl;
+	return 0;
+      }
+    if (status == MELTING_EMPTY)
+      {
+	//Only ambiguous codes: the Tm range of the expansions is all there is
+	if (!print_degenerate(sequence, saltconc, dnaconc))
+	  std::cout << "[ERROR]: No A, C, G or T in the sequence!" << std::endl;
+	return 0;
       }
 
-    //Compute GC content
-    double gccnt = (double(ccnt + gcnt)/double(acnt + ccnt + gcnt + tcnt))*100.0;
-
-    std::cout << "Number of Adenine.... " << acnt << std::endl;
-    std::cout << "Number of Cytosine... " << ccnt << std::endl;
-    std::cout << "Number of Guanine.... " << gcnt << std::endl;
-    std::cout << "Number of Thymine.... " << tcnt << std::endl;
-    std::cout << "GC content........... " << gccnt << "%" << std::endl;
-
-    //Compute sequence mass
-    double adew=313.2; //Da
-    double cytw=298.2; //Da
-    double guaw=392.2; //Da
-    double thyw=304.2; //Da
-
-    double molw = acnt*adew+ccnt*cytw+gcnt*guaw+tcnt*thyw;
-
-    std::cout << "Molecular weigth..... " << molw << " Da" << std::endl;
+    std::cout << "Number of Adenine.... " << thermo.counts[0] << std::endl;
+    std::cout << "Number of Cytosine... " << thermo.counts[1] << std::endl;
+    std::cout << "Number of Guanine.... " << thermo.counts[2] << std::endl;
+    std::cout << "Number of Thymine.... " << thermo.counts[3] << std::endl;
+    std::cout << "GC content........... " << gc_content(thermo) << "%" << std::endl;
+    std::cout << "Molecular weigth..... " << molecular_weight(thermo) << " Da" << std::endl;
     std::cout << " " << std::endl;
 
 
@@ -1111,48 +4636,66 @@ int main(int argc, char *argv[])
 
     std::cout << "EXTIMATED MELTING TEMPERATURE" << std::endl;
 
-    double wallace_tm = wallace_rule(seqlen, acnt, ccnt, gcnt, tcnt);
+    double wallace_tm = wallace_rule(thermo);
     std::cout << "1. Wallace rule " << std::endl;
     std::cout << "Tm: " << wallace_tm << "°C  =  " << wallace_tm+273.15 << " K" << std::endl;
     std::cout << " " << std::endl;
 
-    double salt_tm = salt(saltconc, acnt, ccnt, gcnt, tcnt);
+    double salt_tm = salt(thermo, saltconc);
     std::cout << "2. Salt adjusted method " << std::endl;
     std::cout << "Tm: " << salt_tm << "°C  =  " << salt_tm+273.15 << " K" << std::endl;
     std::cout << " " << std::endl;
 
-    double khandelwal_tm = khandelwal(seqlen, sequence, saltconc, dnaconc);
+    double khandelwal_tm = khandelwal(thermo, saltconc, dnaconc);
     std::cout << "3. Khandelwal method "  << std::endl;
     std::cout << "Tm: " << khandelwal_tm << "°C  =  " << khandelwal_tm+273.15 << " K" << std::endl;
     std::cout << " " << std::endl;
  
-    double bre_tm = bre_nearest_neighbor(seqlen, sequence, saltconc, dnaconc, acnt, ccnt, gcnt, tcnt);
+    double bre_tm = bre_nearest_neighbor(thermo, saltconc, dnaconc);
     std::cout << "4. Breslauer method "  << std::endl;
     std::cout << "Tm: " << bre_tm-273.15 << "°C  =  " << bre_tm << " K" << std::endl;
     std::cout << " " << std::endl;
 
-    double san_tm = san_nearest_neighbor(seqlen, sequence, saltconc, dnaconc, acnt, ccnt, gcnt, tcnt);
+    double san_tm = san_nearest_neighbor(thermo, saltconc, dnaconc);
     std::cout << "5. SantaLucia method " << std::endl;
     std::cout << "Tm: " << san_tm-273.15 << "°C  =  " << san_tm << " K" << std::endl;
     std::cout << " " << std::endl;
 
-    double sug_tm = sug_nearest_neighbor(seqlen, sequence, saltconc, dnaconc, acnt, ccnt, gcnt, tcnt);
+    double sug_tm = sug_nearest_neighbor(thermo, saltconc, dnaconc);
     std::cout << "6. Sugimoto method " << std::endl;
     std::cout << "Tm: " << sug_tm-273.15 << "°C  =  " << sug_tm << " K" << std::endl;
     std::cout << " " << std::endl;
 
     std::cout << "7. Consensus method " << std::endl;
-    double consensus_tm = consensus(seqlen, sequence, saltconc, dnaconc, acnt, ccnt, gcnt, tcnt);
+    int consensus_class;
+    double consensus_tm = consensus(thermo, saltconc, dnaconc, consensus_class);
+    std::cout << consensus_label(consensus_class) << " " << std::endl;
     std::cout << "Tm: " << consensus_tm-273.15 << "°C  =  " << consensus_tm << " K" << std::endl;
     std::cout << " " << std::endl;
 
     //Write melting curves files
-    bre_melting_curve(seqlen, sequence, dnaconc);
-    san_melting_curve(seqlen, sequence, dnaconc);
-    sug_melting_curve(seqlen, sequence, dnaconc);
+    bre_melting_curve(thermo, dnaconc, grid);
+    san_melting_curve(thermo, dnaconc, grid);
+    sug_melting_curve(thermo, dnaconc, grid);
 
     std::cout << "Melting curve files written: bre_melting_curve.out, san_melting_curve.out and sug_melting_curve.out" << std::endl;
 
+    //Transition of the two-state curves
+    if ( with_transition ){
+      std::cout << " " << std::endl;
+      const nn_sum &sum = thermo.sum;
+      static const char *curve_names[NN_MODELS] = {"Breslauer", "SantaLucia", "Sugimoto"};
+      std::cout << "MELTING CURVE TRANSITION" << std::endl;
+      for (int m=0; m<NN_MODELS; m++)
+	{
+	  curve_transition transition = melting_transition(sum.deltah[m]*1000, sum.deltas[m], dnaconc);
+	  std::cout << curve_names[m] << ": f=0.5 at " << transition.tm << " K, width (f=0.9..0.1) " << transition.width << " K, max -df/dT " << transition.peak_slope << " 1/K at " << transition.peak_t << " K" << std::endl;
+	}
+    }
+
+    //Ambiguous IUPAC codes: the methods above skip them
+    print_degenerate(sequence, saltconc, dnaconc);
+
     return 0;
   }
 }
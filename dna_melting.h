@@ -0,0 +1,867 @@
+//Code to compute DNA melting temperature
+//by
+//Lara Querciagrossa
+//
+//Library interface (libdna_melting). Nothing here reads or writes files
+//or prints, and no function modifies shared state, so they can be called
+//from several threads at once. All Tm in melting_result are in Celsius.
+
+#ifndef DNA_MELTING_H
+#define DNA_MELTING_H
+
+#include <cmath>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+
+/***************************************
+       Nearest-neighbor parameters
+***************************************/
+
+//Dinucleotides are indexed as 4*base(i)+base(i+1) with A=0, C=1, G=2, T=3:
+//AA AC AG AT CA CC CG CT GA GC GG GT TA TC TG TT
+
+//Any character other than A, C, G, T maps to -1
+extern signed char base_code[256];
+
+struct nn_params
+{
+  double h[16];         //kcal/mol
+  double s[16];         //cal/(K mol)
+  double simm_corr;     //cal/(K mol)
+  double non_self_compl;//cal/(K mol)
+  double only_at;       //cal/(K mol)
+  double any_cg;        //cal/(K mol)
+};
+
+//Built-in tables, compile-time constants for nn_kernel
+
+//Breslauer, Frank, Blocker and Marky, 1986
+inline constexpr nn_params bre_params = {
+  {-9.1, -6.5, -7.8, -8.6, -5.8, -11.0, -11.9, -7.8, -5.6, -11.1, -11.0, -6.5, -6.0, -5.6, -5.8, -9.1},
+  {-24.0, -17.3, -20.8, -23.9, -12.9, -26.6, -27.8, -20.8, -13.5, -26.7, -26.6, -17.3, -16.9, -13.5, -12.9, -24.0},
+  -1.34, 0.0, -20.13, -16.77
+};
+
+//SantaLucia, Allawi and Seneviratne, 1996
+inline constexpr nn_params san_params = {
+  {-8.4, -8.6, -6.1, -6.5, -7.4, -6.7, -10.1, -6.1, -7.7, -11.1, -6.7, -8.6, -6.3, -7.7, -7.4, -8.4},
+  {-23.6, -23.0, -16.1, -18.8, -19.3, -15.6, -25.5, -16.1, -20.3, -28.4, -15.6, -23.0, -18.5, -20.3, -19.3, -23.6},
+  -1.4, 0.0, -9.0, -5.9
+};
+
+//Sugimoto, Nakano, Yoneyama and Honda, 1996
+inline constexpr nn_params sug_params = {
+  {-8.0, -9.4, -6.6, -5.6, -8.2, -10.9, -11.8, -6.6, -8.8, -10.5, -10.9, -9.4, -6.6, -8.8, -8.2, -8.0},
+  {-21.9, -25.5, -16.4, -15.2, -21.0, -28.4, -29.0, -16.4, -23.5, -26.4, -28.4, -25.5, -18.4, -23.5, -21.0, -21.9},
+  -1.4, 0.0, -9.0, -9.0
+};
+
+//Khandelwal and Bhyravabhotla, 2010 (stacking strength)
+extern const double khandelwal_strength[16];
+
+//Models accumulated by nearest_neighbor_sums()
+#define NN_BRE    0
+#define NN_SAN    1
+#define NN_SUG    2
+#define NN_MODELS 3
+
+extern const nn_params *nn_models[NN_MODELS];
+
+
+struct nn_sum
+{
+  double deltah[NN_MODELS];  //kcal/mol
+  double deltas[NN_MODELS];  //cal/(K mol)
+};
+
+
+//Everything the methods need to know about a sequence, computed once by
+//summarize_sequence(); adding methods or conditions costs no extra pass
+//over the sequence
+struct sequence_thermo
+{
+  size_t length;
+  long counts[4];           //A, C, G, T
+  long dinucleotides[16];   //4*base(i)+base(i+1)
+  nn_sum sum;               //stacking sums of every model
+  double strength;          //Khandelwal stacking strength
+  bool self_complementary;
+};
+
+//Status of a sequence
+#define MELTING_OK     0
+#define MELTING_URACIL 1  //Uracil not (yet) supported
+#define MELTING_EMPTY  2  //no A, C, G or T
+
+int summarize_sequence(const char *sequence, size_t length, sequence_thermo &thermo);
+void summarize_composition(size_t length, const long counts[4], const long dinucleotides[16], bool self_compl, sequence_thermo &thermo);
+
+
+
+/***************************************
+         Nearest-neighbor kernel
+***************************************/
+
+//A model policy gives the table of a model through params(). For the
+//built-in models it is a constexpr function, so nn_kernel<bre_model> is
+//compiled with the Breslauer table folded in; table_model runs the same
+//code on a table loaded at runtime
+struct bre_model
+{
+  static constexpr const nn_params &params() { return bre_params; }
+};
+
+struct san_model
+{
+  static constexpr const nn_params &params() { return san_params; }
+};
+
+struct sug_model
+{
+  static constexpr const nn_params &params() { return sug_params; }
+};
+
+struct table_model
+{
+  const nn_params *table;
+  const nn_params &params() const { return *table; }
+};
+
+
+//Condition terms of the two-state Tm: R ln(dna_conc/b), b = 1 for a
+//self-complementary sequence and 4 otherwise, and the salt correction
+inline double nn_dna_term(double dna_conc, bool self_compl)
+{
+  double R=1.987; //cal/(K mol)
+  double b = self_compl ? 1 : 4;
+  return R*std::log(dna_conc/b);
+}
+
+inline double nn_salt_term(double salt_conc)
+{
+  return 16.6*std::log10(salt_conc);
+}
+
+
+template <class Model>
+struct nn_kernel
+{
+  Model model;
+
+  //Stacking sums over a sequence; dinucleotides with a character other
+  //than A, C, G, T are skipped
+  void sums(const char *sequence, size_t length, double &deltah, double &deltas) const
+  {
+    const nn_params &params = model.params();
+    double h = 0, s = 0;
+    int prev = length > 0 ? base_code[(unsigned char) sequence[0]] : -1;
+    for (size_t i=1; i<length; i++)
+      {
+	int next = base_code[(unsigned char) sequence[i]];
+	if ((prev | next) >= 0)
+	  {
+	    h += params.h[4*prev+next];
+	    s += params.s[4*prev+next];
+	  }
+	prev = next;
+      }
+    deltah = h;
+    deltas = s;
+  }
+
+  //Stacking sums from a dinucleotide histogram
+  void sums(const long dinucleotides[16], double &deltah, double &deltas) const
+  {
+    const nn_params &params = model.params();
+    deltah = deltas = 0;
+    for (int k=0; k<16; k++)
+      {
+	deltah += dinucleotides[k]*params.h[k];
+	deltas += dinucleotides[k]*params.s[k];
+      }
+  }
+
+  //Two-state Tm (K) from the stacking sums, adding initiation, symmetry
+  //and salt corrections
+  double melting_temperature(double deltah_d, double deltas_d, bool self_compl, bool any_cg, double salt_conc, double dna_conc) const
+  {
+    const nn_params &params = model.params();
+    double deltas_self = self_compl ? params.simm_corr : params.non_self_compl;
+
+    double deltah_i=0;
+    double deltas_i = any_cg ? params.any_cg : params.only_at;
+
+    //enthalpy&R in cal
+    double num=deltah_d*1000+deltah_i*1000;
+    double den=deltas_d+deltas_i+deltas_self+nn_dna_term(dna_conc, self_compl);
+    double salt_adj=nn_salt_term(salt_conc);
+
+    return num/den+salt_adj;
+  }
+
+  //Tm (K) over a grid of conditions, from their precomputed terms:
+  //salt_term[i] = nn_salt_term(), dna_term[j] = nn_dna_term() with the
+  //same self_compl. Condition (i, j) goes to tm[i*dnas+j]
+  void melting_temperatures(double deltah_d, double deltas_d, bool self_compl, bool any_cg, const double *salt_term, size_t salts, const double *dna_term, size_t dnas, double *tm) const
+  {
+    const nn_params &params = model.params();
+    double deltas_self = self_compl ? params.simm_corr : params.non_self_compl;
+    double deltas_i = any_cg ? params.any_cg : params.only_at;
+
+    double num=deltah_d*1000;
+    double den=deltas_d+deltas_i+deltas_self;
+
+    for (size_t i=0; i<salts; i++)
+      for (size_t j=0; j<dnas; j++)
+	tm[i*dnas+j] = num/(den+dna_term[j])+salt_term[i];
+  }
+};
+
+
+//Tables in text form, one entry per line ('#' starts a comment):
+//  name <name>
+//  XY <deltaH> <deltaS>       stack 5'-XY-3' (kcal/mol, cal/(K mol))
+//  XY/X'Y' <deltaH> <deltaS>  stack XY and its reverse complement
+//  symmetry, non_self_compl, only_at, any_cg <deltaS>
+//All 16 stacks and the four corrections are required. Return false and
+//set error if the text is not a complete table
+bool parse_nn_params(const std::string &text, nn_params &params, std::string &name, std::string &error);
+std::string format_nn_params(const nn_params &params, const std::string &name);
+
+
+
+/***************************************
+          Melting temperatures
+***************************************/
+
+double gc_content(const sequence_thermo &thermo);        //%
+double molecular_weight(const sequence_thermo &thermo);  //Da
+
+//Tm in Celsius
+double wallace_rule(double sequence_length, double a_count , double c_count, double g_count, double t_count);
+double wallace_rule(const sequence_thermo &thermo);
+double salt(double salt_conc, double a_count , double c_count, double g_count, double t_count);
+double salt(const sequence_thermo &thermo, double salt_conc);
+double khandelwal_from_strength(double sequence_length, double strength, double salt_conc, double dna_conc);
+double khandelwal(const sequence_thermo &thermo, double salt_conc, double dna_conc);
+
+void nearest_neighbor_sums(const char *specie, size_t length, nn_sum &sum);
+void nearest_neighbor_sums(const std::string &specie, nn_sum &sum);
+void nn_sums_from_histogram(const long dinucleotides[16], nn_sum &sum);
+bool is_self_complementary(const char *specie, size_t length);
+bool is_self_complementary(const std::string &specie);
+
+//Tm in K
+double nn_melting_temperature(const nn_params &params, double deltah_d, double deltas_d, bool self_compl, bool any_cg, double salt_conc, double dna_conc);
+double nn_melting_temperature(const sequence_thermo &thermo, int model, double salt_conc, double dna_conc);
+double bre_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc);
+double san_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc);
+double sug_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc);
+double table_melting_temperature(const sequence_thermo &thermo, const nn_params &table, double salt_conc, double dna_conc);
+
+//Methods averaged by the consensus
+#define CONSENSUS_FULL    0
+#define CONSENSUS_BRE_SUG 1
+#define CONSENSUS_SAN_SUG 2
+#define CONSENSUS_NONE    3
+
+const char *consensus_label(int consensus_class);
+double consensus_from_tm(int sequence_length, double gc_content, double bre_tm, double san_tm, double sug_tm, int &consensus_class);
+double consensus(const sequence_thermo &thermo, double salt_conc, double dna_conc, int &consensus_class);
+
+//deltaH in cal/mol, deltaS in cal/(K mol)
+double bre_enthalpy(const sequence_thermo &thermo);
+double bre_entropy(const sequence_thermo &thermo);
+double san_enthalpy(const sequence_thermo &thermo);
+double san_entropy(const sequence_thermo &thermo);
+double sug_enthalpy(const sequence_thermo &thermo);
+double sug_entropy(const sequence_thermo &thermo);
+
+
+
+/***************************************
+           Melting curve engine
+***************************************/
+
+//Default temperature grid of the melting curves (K)
+#define CURVE_T_MIN  0.0
+#define CURVE_T_MAX  700.0
+#define CURVE_T_STEP 0.5
+
+//Tile sizes of melting_curve_tile(): a block of temperatures is reused
+//for a block of sequences while it is still in L1
+#define CURVE_TILE_T   256
+#define CURVE_TILE_SEQ 64
+
+
+struct curve_grid
+{
+  double t_min;      //K
+  double t_max;      //K
+  double t_step;     //K, uniform grid
+  double tolerance;  //if > 0, adaptive sampling with this maximum error on f
+};
+
+static const curve_grid default_curve_grid = {CURVE_T_MIN, CURVE_T_MAX, CURVE_T_STEP, 0.0};
+
+
+struct curve_transition
+{
+  double tm;          //K, f = 0.5
+  double t_high;      //K, f = 0.9
+  double t_low;       //K, f = 0.1
+  double width;       //K, t_low - t_high
+  double peak_t;      //K, maximum of -df/dT
+  double peak_slope;  //1/K, -df/dT at peak_t
+};
+
+
+//deltah in cal/mol, deltas in cal/(K mol), temperatures in K
+int curve_points(double t_min, double t_max, double t_step);
+void melting_curve_tile(int sequences, const double *deltah, const double *deltas, const double *dna_conc, int temperatures, const double *t, double *f);
+//Single precision melting_curve_tile(), with the exponentials
+//vectorized; f within 1e-3 and the f = 0.5 point within 0.01 K of the
+//double curve (dna_melting_bench --accuracy)
+void melting_curve_tile_float(int sequences, const float *deltah, const float *deltas, const float *dna_conc, int temperatures, const float *t, float *f);
+double two_state_fraction(double deltah, double deltas, double dna_conc, double t);
+double two_state_temperature(double deltah, double deltas, double dna_conc, double f);
+curve_transition melting_transition(double deltah, double deltas, double dna_conc);
+void sample_melting_curve(double deltah, double deltas, double dna_conc, const curve_grid &grid, std::vector<double> &t, std::vector<double> &f);
+
+
+
+/***************************************
+     Poland-Scheraga melting (long DNA)
+***************************************/
+
+//Helix-coil model of a long duplex: every base pair is closed or open,
+//two adjacent closed pairs stack with the NN weights, an internal loop of
+//m open pairs between closed ones weighs sigma*(m+1)^-alpha, and open
+//ends are free. The loop factor is replaced by a sum of I exponentials
+//(Fixman and Freire, 1977), so the partition function is computed in
+//O(N*I) per temperature instead of O(N^2)
+
+#define PS_SIGMA     1e-5   //loop initiation (cooperativity) factor
+#define PS_ALPHA     2.15   //loop entropy exponent
+#define PS_TERMS_MAX 32     //most exponentials of the loop factor
+
+//Long sequences are cut into chunks melted independently; only the core
+//of each chunk (overlap bases away from its cut ends) is kept
+#define PS_CHUNK   20000
+#define PS_OVERLAP 2000
+
+//Default temperature grid of the Poland-Scheraga curves (K)
+#define PS_T_MIN  320.0
+#define PS_T_MAX  380.0
+#define PS_T_STEP 0.5
+
+
+//(m+1)^-alpha ~ sum_k a[k]*x[k]^m for 1 <= m <= max_loop
+struct ps_loop_factor
+{
+  int terms;
+  double a[PS_TERMS_MAX];
+  double x[PS_TERMS_MAX];
+};
+
+void fixman_freire_fit(double alpha, size_t max_loop, ps_loop_factor &loop);
+
+
+//Stacking weights of a model at a salt concentration. As for the
+//two-state Tm, the salt correction shifts the whole curve: the weights at
+//t are those of 1 M Na+ at t - t_shift
+struct ps_model
+{
+  double deltah[16];  //cal/mol
+  double deltas[16];  //cal/(K mol)
+  double t_shift;     //K, nn_salt_term()
+  double sigma;
+  ps_loop_factor loop;
+};
+
+void prepare_ps_model(const nn_params &params, double salt_conc, double sigma, double alpha, size_t max_loop, ps_model &model);
+
+
+//Bases [first, last) are melted, the pairs of [core_first, core_last)
+//are reported
+struct ps_chunk
+{
+  size_t first, last;
+  size_t core_first, core_last;
+};
+
+void plan_ps_chunks(size_t length, size_t chunk, size_t overlap, std::vector<ps_chunk> &chunks);
+
+struct ps_chunk_result
+{
+  std::vector<double> closed;  //sum of the closed probabilities of the core, per temperature
+  std::vector<double> log_z;   //log of the partition function of the chunk, per temperature
+  long pairs;                  //core pairs that can close (A, C, G, T)
+};
+
+//Melting of one chunk of sequence over the temperatures t (K, ascending).
+//tm_map (if not null) gets, for each core pair, the temperature at which
+//its closed probability in the associated duplex drops below 0.5,
+//interpolated between grid points (0 if closed at no temperature, t.back()
+//if never open); it is indexed from the start of the sequence, so chunks
+//of the same sequence may write it concurrently. Characters other than
+//A, C, G, T never close
+void ps_melt_chunk(const char *sequence, const ps_chunk &chunk, const ps_model &model, int temperatures, const double *t, ps_chunk_result &result, float *tm_map);
+
+//Fraction of closed pairs theta(t) of the whole sequence from its chunks.
+//A single chunk also accounts for strand dissociation (initiation entropy
+//of params, total strand concentration dna_conc); a molecule long enough
+//to be cut stays associated while any pair is closed
+void ps_melting_curve(const std::vector<ps_chunk> &chunks, const std::vector<ps_chunk_result> &results, const nn_params &params, bool any_cg, double dna_conc, int temperatures, double *theta);
+
+//Chunks melted one after the other, then ps_melting_curve()
+void ps_melt_sequence(const char *sequence, size_t length, const nn_params &params, const ps_model &model, double dna_conc, size_t chunk, size_t overlap, int temperatures, const double *t, double *theta, float *tm_map);
+
+
+/***************************************
+               Batch interface
+***************************************/
+
+//Methods computed by melting_temperatures() and melting_batch()
+#define METHOD_WALLACE    1
+#define METHOD_SALT       2
+#define METHOD_KHANDELWAL 4
+#define METHOD_BRE        8
+#define METHOD_SAN        16
+#define METHOD_SUG        32
+#define METHOD_CONSENSUS  64
+#define METHOD_ALL        127
+
+
+struct melting_result
+{
+  int status;
+  sequence_thermo thermo;   //counts, histogram, deltaH and deltaS
+  double gc_content;        //%
+  double molecular_weight;  //Da
+  double wallace_tm;
+  double salt_tm;
+  double khandelwal_tm;
+  double nn_tm[NN_MODELS];
+  double consensus_tm;
+  int consensus_class;
+};
+
+//Only the requested methods are computed, the other Tm are left at 0
+int melting_temperatures(const char *sequence, size_t length, double salt_conc, double dna_conc, int methods, melting_result &result);
+void melting_from_thermo(const sequence_thermo &thermo, double salt_conc, double dna_conc, int methods, melting_result &result);
+
+
+//Struct-of-arrays batch: sequence i is sequences[i], with lengths[i]
+//characters (NUL terminated if lengths is 0); salt_conc and dna_conc are
+//per sequence arrays, or 0 to use the defaults for every sequence
+struct melting_batch_input
+{
+  size_t count;
+  const char *const *sequences;
+  const size_t *lengths;
+  const double *salt_conc;   //M
+  const double *dna_conc;    //M
+  double default_salt;       //M
+  double default_dna;        //M
+  int methods;
+};
+
+//Arrays of count values allocated by the caller; arrays left at 0 are
+//not written. deltah in kcal/mol, deltas in cal/(K mol), Tm in Celsius
+struct melting_batch_output
+{
+  int *status;
+  double *gc_content;
+  double *molecular_weight;
+  double *wallace_tm;
+  double *salt_tm;
+  double *khandelwal_tm;
+  double *nn_tm[NN_MODELS];
+  double *deltah[NN_MODELS];
+  double *deltas[NN_MODELS];
+  double *consensus_tm;
+  int *consensus_class;
+};
+
+//Sequences [first, last) of the batch; disjoint ranges can be computed on
+//different threads. Return the number of sequences with MELTING_OK
+size_t melting_batch(const melting_batch_input &input, const melting_batch_output &output, size_t first, size_t last);
+size_t melting_batch(const melting_batch_input &input, const melting_batch_output &output);
+
+
+//Opt-in single precision path of the nearest-neighbor methods: the
+//dinucleotides are counted exactly, then the stacking sums, the
+//condition terms and the Tm are computed in float over blocks of
+//FLOAT_BATCH_BLOCK sequences, vectorized across the block. Only the BRE,
+//SAN and SUG methods of input.methods are computed; the Tm stay within
+//0.01 K of melting_batch() (checked by dna_melting_bench --accuracy)
+#define FLOAT_BATCH_BLOCK 64
+
+struct melting_batch_float_output
+{
+  int *status;
+  float *nn_tm[NN_MODELS];   //Celsius
+  float *deltah[NN_MODELS];  //kcal/mol
+  float *deltas[NN_MODELS];  //cal/(K mol)
+};
+
+size_t melting_batch_float(const melting_batch_input &input, const melting_batch_float_output &output, size_t first, size_t last);
+size_t melting_batch_float(const melting_batch_input &input, const melting_batch_float_output &output);
+
+
+
+/***************************************
+             Condition sweep
+***************************************/
+
+//Grid of conditions (every salt_conc with every dna_conc) with their
+//terms computed once for all the sequences of a sweep
+struct sweep_conditions
+{
+  std::vector<double> salt_conc;    //M
+  std::vector<double> dna_conc;     //M
+  std::vector<double> salt_term;    //nn_salt_term()
+  std::vector<double> dna_term[2];  //nn_dna_term(), not and self-complementary
+};
+
+void prepare_sweep(const std::vector<double> &salt_conc, const std::vector<double> &dna_conc, sweep_conditions &conditions);
+
+//Tm (Celsius) of the requested methods under every condition. tm holds
+//one block of salts*dnas values per method, in METHOD_* order, with
+//condition (i, j) at i*dnas+j. Return the number of blocks
+int melting_sweep(const sequence_thermo &thermo, int methods, const sweep_conditions &conditions, double *tm);
+
+
+/***************************************
+               Primer search
+***************************************/
+
+//Strands searched by find_primers(): forward primers are substrings of
+//the template, reverse primers are reverse complements of substrings
+#define PRIMER_FORWARD 1
+#define PRIMER_REVERSE 2
+#define PRIMER_BOTH    3
+
+//GC clamp: G or C among the last bases at the 3' end
+#define PRIMER_CLAMP_BASES 5
+
+
+struct primer_constraints
+{
+  int min_length;
+  int max_length;
+  int tm_models;               //1 << NN_* of the models with a Tm window
+  double tm_min[NN_MODELS];    //Celsius
+  double tm_max[NN_MODELS];    //Celsius
+  double gc_min;               //%
+  double gc_max;               //%
+  int clamp_min;               //G or C among the last PRIMER_CLAMP_BASES bases
+  int clamp_max;
+  int max_run;                 //longest run of one base, 0 for no limit
+  double salt_conc;            //M
+  double dna_conc;             //M
+  int strands;
+  long product_min;            //pairs: bases from forward 5' to reverse 5' end
+  long product_max;
+  double max_tm_diff;          //pairs: Celsius, on every model with a Tm window
+};
+
+static const primer_constraints default_primer_constraints = {
+  18, 25, 1 << NN_SAN, {52, 52, 52}, {65, 65, 65}, 40, 60, 1, 3, 4, 0.05, 0.00000005, PRIMER_BOTH, 100, 1000, 5
+};
+
+
+//Template positions are 0-based, the window is [start, start+length) on
+//the template whatever the strand
+struct primer_candidate
+{
+  size_t start;
+  int length;
+  int strand;                 //PRIMER_FORWARD or PRIMER_REVERSE
+  double gc_content;          //%
+  double tm[NN_MODELS];       //Celsius
+  double penalty;             //distance of the Tm from the centres of their windows
+};
+
+struct primer_pair
+{
+  primer_candidate forward;
+  primer_candidate reverse;
+  long product;
+  double penalty;             //penalties of both primers plus their Tm difference
+};
+
+//Keep the "top" candidates of lowest penalty of each strand, sorted by
+//penalty. Return the number of candidates meeting the constraints
+size_t find_primers(const char *sequence, size_t length, const primer_constraints &constraints, size_t top, std::vector<primer_candidate> &forward, std::vector<primer_candidate> &reverse);
+
+//The "top" pairs of lowest penalty among the given candidates
+void pair_primers(const std::vector<primer_candidate> &forward, const std::vector<primer_candidate> &reverse, const primer_constraints &constraints, size_t top, std::vector<primer_pair> &pairs);
+
+
+
+/***************************************
+       Mismatched duplexes, off-targets
+***************************************/
+
+//Stacks of a duplex that may contain mismatches, indexed as
+//64*x+16*y+4*x'+y' for the top strand 5'-xy-3' paired with the bottom
+//strand 3'-x'y'-5' (codes A=0, C=1, G=2, T=3). Watson-Crick stacks come
+//from a model, single internal mismatches from the mismatch table;
+//stacks without parameters (tandem mismatches) are "unknown"
+struct nn_duplex_params
+{
+  const nn_params *params;
+  double h[256];        //kcal/mol
+  double s[256];        //cal/(K mol)
+  bool known[256];
+};
+
+void mismatch_duplex_params(const nn_params &params, nn_duplex_params &duplex);
+
+//Probe and site are codes in the probe sense: base i of the probe pairs
+//with the complement of site[i] (4 or more for N). Mismatches at the ends
+//fray, the duplex starts and ends on the outermost matched pairs.
+//Return the Tm (K) or 0 if fewer than two pairs are formed
+double duplex_melting_temperature(const nn_duplex_params &duplex, const unsigned char *probe, const unsigned char *site, int length, double salt_conc, double dna_conc, double &deltah, double &deltas);
+
+
+//Reference held as base codes, with N (or any other character) as
+//REF_OTHER. Record r is codes[starts[r], starts[r+1])
+#define REF_OTHER 4
+
+struct reference_genome
+{
+  std::vector<std::string> names;
+  std::vector<size_t> starts;
+  std::vector<unsigned char> codes;
+};
+
+void add_reference_record(reference_genome &reference, const std::string &name, const char *sequence, size_t length);
+
+
+//Positions of every k-mer of the reference (k-mers across records or
+//with N are not indexed), bucketed by k-mer code
+#define SEED_MAX_K 14
+
+struct seed_index
+{
+  int k;
+  std::vector<unsigned int> offsets;    //4^k+1
+  std::vector<unsigned int> positions;
+};
+
+//False if the reference has 2^32 bases or more
+bool build_seed_index(const reference_genome &reference, int k, seed_index &index);
+
+
+struct offtarget_site
+{
+  size_t record;
+  size_t start;            //0-based, window [start, start+length) of the record
+  char strand;             //'+': the window reads as the probe, '-': as its reverse complement
+  int mismatches;
+  double deltah;           //kcal/mol
+  double deltas;           //cal/(K mol)
+  double tm;               //Celsius
+  std::string site;        //window in the probe sense
+};
+
+//Sites with up to max_mismatches and Tm >= min_tm, sorted by record,
+//start and strand. Seeds are index.k bases long and the probe needs
+//(max_mismatches+1)*k of them. Return the number of sites, or -1 if the
+//probe has a character other than A, C, G, T or is too short
+long find_offtargets(const reference_genome &reference, const seed_index &index, const nn_duplex_params &duplex, const char *probe, size_t length, int max_mismatches, double min_tm, double salt_conc, double dna_conc, std::vector<offtarget_site> &sites);
+
+
+/***************************************
+       Secondary structure (hairpins)
+***************************************/
+
+//Lowest free energy stem-loop of a single strand: a stem of Watson-Crick
+//stacks, possibly interrupted by bulges and internal loops, closed by a
+//hairpin loop. Loops of more than HAIRPIN_MAX_INTERNAL unpaired bases in
+//the stem are not considered, nor pairs more than band bases apart
+#define HAIRPIN_MIN_LOOP     3
+#define HAIRPIN_MAX_LOOP     30
+#define HAIRPIN_MAX_INTERNAL 8
+#define HAIRPIN_BAND         100
+#define HAIRPIN_T            310.15  //K, 37 C
+
+struct hairpin_model
+{
+  nn_duplex_params duplex;  //Watson-Crick stacks and single (1x1) mismatches
+  double temperature;       //K, the structure of lowest deltaG at this temperature is searched
+  int band;                 //most bases between the two bases of a pair, minus one
+  //deltaG (kcal/mol) at temperature of the loops by length, and the
+  //terminal A-T penalty of a helix end
+  double hairpin_g[HAIRPIN_MAX_LOOP+1];
+  double bulge_g[HAIRPIN_MAX_INTERNAL+1];
+  double internal_g[HAIRPIN_MAX_INTERNAL+1];
+  double asymmetry_g;
+  double terminal_at_h, terminal_at_g;
+};
+
+void prepare_hairpin_model(const nn_params &params, double temperature, int band, hairpin_model &model);
+
+//Scratch arrays of find_hairpin(), reused from one sequence to the next
+struct hairpin_workspace
+{
+  std::vector<double> g, h;      //by diagonal (j-i) then i
+  std::vector<double> per_base;  //stack, terminal and bulge terms of each base
+  std::vector<unsigned char> codes;
+};
+
+struct hairpin_result
+{
+  double deltag;  //kcal/mol at the temperature of the model, salt corrected
+  double deltah;  //kcal/mol
+  double deltas;  //cal/(K mol), salt corrected
+  double tm;      //K, deltah/deltas; 0 if the structure has no stack
+  int first;      //outermost pair (0-based), -1 if no pair can form
+  int last;
+};
+
+//Banded dynamic programming over the diagonals j-i, each one computed
+//with branch-free loops over i. Salt shifts the Tm as for duplexes.
+//Return false if no stem-loop can form or the most stable one has
+//deltaG >= 0 (result still describes it)
+bool find_hairpin(const char *sequence, size_t length, const hairpin_model &model, double salt_conc, hairpin_workspace &work, hairpin_result &result);
+
+
+/***************************************
+       Primer dimers
+***************************************/
+
+//Cross-dimers of a primer pool: primer a (5'->3') annealed antiparallel
+//to primer b with every offset, without gaps. Primers are 2-bit packed
+//in one 64-bit word (base i in bits 2i, 2i+1), so they are at most
+//DIMER_MAX_LENGTH bases
+#define DIMER_MAX_LENGTH 32
+#define DIMER_MIN_RUN    4
+#define DIMER_MAX_DG     -6.0    //kcal/mol
+#define DIMER_T          310.15  //K, 37 C
+
+struct dimer_primer
+{
+  unsigned long long forward;  //5'->3'
+  unsigned long long reverse;  //3'->5'
+  int length;
+  unsigned char codes[DIMER_MAX_LENGTH];
+};
+
+//False if the primer has fewer than 2 or more than DIMER_MAX_LENGTH
+//bases, or a character other than A, C, G, T
+bool encode_dimer_primer(const char *sequence, size_t length, dimer_primer &primer);
+
+struct dimer_model
+{
+  nn_duplex_params duplex;  //Watson-Crick stacks and single (1x1) mismatches
+  double g[256];            //kcal/mol at DIMER_T, by duplex stack
+  double salt_conc, dna_conc;
+  int min_run;              //offsets without min_run complementary bases in a row are not scored
+  double max_deltag;        //kcal/mol, weaker dimers are not conflicts
+};
+
+void prepare_dimer_model(const nn_params &params, double salt_conc, double dna_conc, int min_run, double max_deltag, dimer_model &model);
+
+struct primer_dimer
+{
+  size_t first, second;     //primer indices, first <= second
+  double deltag;            //kcal/mol at DIMER_T, salt corrected
+  double deltah;            //kcal/mol
+  double deltas;            //cal/(K mol), with initiation, salt corrected
+  double tm;                //Celsius
+  int start_first;          //0-based, first base of first in the duplex
+  int start_second;         //0-based, base of second paired with it
+  int pairs;                //bases of the duplex, mismatches included
+};
+
+//Most stable duplex of two primers. The offsets are prefiltered on the
+//packed words: XOR of a and reversed b has both bits of a base set where
+//the bases are complementary. Return false if no offset passes
+bool score_dimer(const dimer_primer &a, const dimer_primer &b, const dimer_model &model, primer_dimer &dimer);
+
+//Row "first" of the conflict matrix: dimers of primer first with primers
+//first..n-1 (itself included) with deltaG <= model.max_deltag, by index
+void screen_dimers(const std::vector<dimer_primer> &primers, size_t first, const dimer_model &model, std::vector<primer_dimer> &conflicts);
+
+
+/***************************************
+     Degenerate (IUPAC) sequences
+***************************************/
+
+//Bases of an IUPAC code as a set, bit b for base code b: A=1, C=2, G=4,
+//T=8, R=A|G, Y=C|T, ... N=15. Characters that are not IUPAC codes map to 0
+extern unsigned char iupac_mask[256];
+
+struct degenerate_result
+{
+  double expansions;          //concrete sequences of the primer
+  int ambiguous;              //positions with more than one base
+  double tm_min[NN_MODELS];   //Celsius, coldest expansion
+  double tm_max[NN_MODELS];   //Celsius, hottest expansion
+  double tm_mean[NN_MODELS];  //Celsius, mean Tm of the expansions (to second order)
+};
+
+//Range of the nearest-neighbor Tm over every expansion of a degenerate
+//sequence (all equally likely), in time linear in the length: the
+//extreme expansions are found by a few dynamic programs over the
+//dinucleotide chain, which tell self-complementary expansions from the
+//others. The mean takes the expansions of a degenerate sequence as non
+//self-complementary. Characters other than IUPAC codes break the chain
+//as in summarize_sequence(). Return MELTING_OK, MELTING_URACIL or
+//MELTING_EMPTY (no IUPAC code)
+int degenerate_melting(const char *sequence, size_t length, double salt_conc, double dna_conc, degenerate_result &result);
+
+
+/***************************************
+       Single-base variants
+***************************************/
+
+#define VARIANT_SUBSTITUTION 0
+#define VARIANT_INSERTION    1
+#define VARIANT_DELETION     2
+
+struct sequence_variant
+{
+  size_t position;              //0-based base substituted or deleted, or the insertion goes before it (length: at the end)
+  int type;
+  char ref, alt;                //'-' for the missing base of an indel
+  double delta_tm[NN_MODELS];   //K, Tm of the variant minus Tm of the sequence
+};
+
+//Every substitution and, with indels, every distinct single-base
+//insertion and deletion (in a run of equal bases only the first one).
+//The sequence is summarized once; a variant only changes the
+//dinucleotides around it, so it costs the same whatever the length.
+//baseline_tm is set to the Tm (Celsius) of the sequence. Return the
+//number of variants, -1 if the sequence has a character other than A,
+//C, G, T
+long scan_variants(const char *sequence, size_t length, double salt_conc, double dna_conc, bool indels, double baseline_tm[NN_MODELS], std::vector<sequence_variant> &variants);
+
+
+/***************************************
+            Inverse design
+***************************************/
+
+//Simulated annealing of random sequences towards the Tm windows
+//(constraints.tm_models), GC content, GC clamp and longest run of
+//primer_constraints; its lengths, strands and products are not used.
+//The temperature of the chain decreases geometrically from DESIGN_T_START
+//to DESIGN_T_END (in units of the penalty: Celsius outside a Tm window,
+//bases outside the GC, clamp and run limits)
+#define DESIGN_STEPS   20000
+#define DESIGN_T_START 5.0
+#define DESIGN_T_END   0.05
+
+//One chain of length bases from a given seed: the same seed gives the
+//same sequence. Return false if it ends without meeting every
+//constraint (checked again on the final sequence from scratch)
+bool anneal_design(const primer_constraints &constraints, size_t length, long steps, unsigned long long seed, std::string &sequence);
+
+
+#endif
@@ -0,0 +1,742 @@
+//Benchmarks of libdna_melting
+//by
+//Lara Querciagrossa
+//
+//Synthetic sequences of given length and GC content are generated and
+//every method, the curve generators and the batch interface are timed
+//on them. Results are written as one TSV row (or JSON object) per
+//benchmark, so that runs of two commits can be compared with --compare
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+#include <thread>
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <unistd.h>
+
+#include "dna_melting.h"
+using namespace std;
+
+
+//Sequence lengths of the micro-benchmarks (up to --max-length)
+static const size_t bench_lengths[] = {10, 20, 30, 100, 1000, 10000, 100000, 1000000, 10000000};
+#define BENCH_LENGTHS 9
+
+//Timed runs of every benchmark; the reported time is their median
+#define BENCH_RUNS 5
+
+//Largest deviations of the float32 path accepted by --accuracy
+#define ACCURACY_TM_LIMIT 0.01  //K
+#define ACCURACY_F_LIMIT  1e-3  //fraction of hybridized strands
+
+//Sequences of --accuracy whose float curves are also checked
+#define ACCURACY_CURVES 4096
+
+
+struct bench_options
+{
+  size_t max_length;
+  double gc_content;  //%
+  double min_time;    //s per benchmark
+  int threads;
+  bool json;
+  string filter;
+  string compare;
+  string cli;         //dna_melting program for the end-to-end benchmarks
+  bool accuracy;      //float32 path against the double one, no timing
+};
+
+
+struct bench_result
+{
+  string name;
+  size_t length;      //bases per sequence
+  size_t batch;       //sequences per call
+  long iterations;    //calls per timed run
+  double ns_min;      //ns per call, fastest run
+  double ns_median;   //ns per call, median run
+};
+
+
+//Results are kept from being optimized away by adding them here
+static volatile double bench_sink;
+
+
+
+string synthetic_sequence(size_t length, double gc_content, unsigned long long seed)
+{
+  //Random sequence with the given GC content (%), from a xorshift
+  //generator so that every run and every machine sees the same bases
+
+  string sequence(length, 'A');
+  unsigned long long state = seed*0x9E3779B97F4A7C15ULL + 1;
+  unsigned long long gc_threshold = (unsigned long long) (gc_content/100.0*4294967296.0);
+
+  for (size_t i=0; i<length; i++)
+    {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      unsigned long long r = state & 0xffffffffULL;
+      bool strong = r < gc_threshold;
+      bool second = (state >> 32) & 1;
+      sequence[i] = strong ? (second ? 'G' : 'C') : (second ? 'T' : 'A');
+    }
+
+  return sequence;
+}
+
+
+
+bench_result run_benchmark(const string &name, size_t length, size_t batch, double min_time, const function<void()> &call)
+{
+  //Calibrate the number of calls so that a run takes min_time/BENCH_RUNS,
+  //then time BENCH_RUNS runs
+
+  typedef chrono::steady_clock clock;
+  double run_time = min_time/BENCH_RUNS;
+
+  long iterations = 1;
+  while (true)
+    {
+      clock::time_point start = clock::now();
+      for (long k=0; k<iterations; k++) call();
+      double elapsed = chrono::duration<double>(clock::now() - start).count();
+      if (elapsed >= run_time || iterations >= (1L << 40)) break;
+      double scale = elapsed > 0 ? 1.2*run_time/elapsed : 100;
+      if (scale > 100) scale = 100;
+      if (scale < 2) scale = 2;
+      iterations = (long) (iterations*scale);
+    }
+
+  vector<double> ns(BENCH_RUNS);
+  for (int r=0; r<BENCH_RUNS; r++)
+    {
+      clock::time_point start = clock::now();
+      for (long k=0; k<iterations; k++) call();
+      ns[r] = chrono::duration<double, nano>(clock::now() - start).count()/iterations;
+    }
+  sort(ns.begin(), ns.end());
+
+  bench_result result = {name, length, batch, iterations, ns[0], ns[BENCH_RUNS/2]};
+  return result;
+}
+
+
+
+void write_result(ostream &fileout, const bench_result &result, bool json, bool &first)
+{
+  //seq_per_s and bases_per_s from the median run
+  double seconds = result.ns_median*1e-9;
+  double seq_per_s = result.batch/seconds;
+  double bases_per_s = (double) result.batch*result.length/seconds;
+
+  if (json)
+    {
+      fileout << (first ? "[\n" : ",\n");
+      fileout << "  {\"benchmark\": \"" << result.name << "\", \"length\": " << result.length << ", \"batch\": " << result.batch
+	      << ", \"iterations\": " << result.iterations << ", \"ns_min\": " << result.ns_min << ", \"ns_median\": " << result.ns_median
+	      << ", \"seq_per_s\": " << seq_per_s << ", \"bases_per_s\": " << bases_per_s << "}";
+    }
+  else
+    {
+      if (first) fileout << "#benchmark\tlength\tbatch\titerations\tns_min\tns_median\tseq_per_s\tbases_per_s\n";
+      fileout << result.name << "\t" << result.length << "\t" << result.batch << "\t" << result.iterations << "\t"
+	      << result.ns_min << "\t" << result.ns_median << "\t" << seq_per_s << "\t" << bases_per_s << "\n";
+    }
+  fileout.flush();
+  first = false;
+}
+
+
+
+bool read_results(const char *filename, map<string, double> &ns_median)
+{
+  //Median times of a previous TSV run, keyed by benchmark, length and
+  //batch size
+
+  ifstream filein(filename);
+  if (!filein.is_open()) return false;
+
+  string line;
+  while (getline(filein, line))
+    {
+      if (line.empty() || line[0] == '#') continue;
+      istringstream fields(line);
+      string name;
+      size_t length, batch;
+      long iterations;
+      double ns_min, median;
+      if (fields >> name >> length >> batch >> iterations >> ns_min >> median)
+	{
+	  ostringstream key;
+	  key << name << "\t" << length << "\t" << batch;
+	  ns_median[key.str()] = median;
+	}
+    }
+  return true;
+}
+
+
+
+double curve_midpoint(const float *t, const float *f, int temperatures)
+{
+  //Temperature where f crosses 0.5, interpolated between grid points
+  for (int k=1; k<temperatures; k++)
+    if (f[k] < 0.5f)
+      {
+	if (f[k-1] < 0.5f) return t[k-1];
+	return t[k-1] + (t[k]-t[k-1])*(f[k-1]-0.5)/(f[k-1]-f[k]);
+      }
+  return t[temperatures-1];
+}
+
+
+
+int run_accuracy(const bench_options &options)
+{
+  //Every result of melting_batch_float() and melting_curve_tile_float()
+  //against melting_batch() and melting_curve_tile(), on synthetic
+  //sequences of all GC contents (one in seven self-complementary) under
+  //log-uniform conditions. One row per check and model with the maximum
+  //deviation; the exit status is 1 if one is above its limit
+
+  static const size_t lengths[] = {8, 12, 16, 20, 25, 30, 40, 60, 100, 1000, 10000, 100000, 1000000, 10000000};
+  static const size_t counts[] = {20000, 20000, 20000, 20000, 20000, 20000, 20000, 20000, 20000, 2000, 200, 20, 4, 1};
+
+  vector<string> sequences;
+  vector<double> salt_conc, dna_conc;
+  unsigned long long state = 88172645463325252ULL;
+  auto uniform = [&](){
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (state >> 11)*(1.0/9007199254740992.0);
+  };
+
+  for (int l=0; l<14 && lengths[l] <= options.max_length; l++)
+    for (size_t i=0; i<counts[l]; i++)
+      {
+	size_t length = lengths[l];
+	double gc = double((i*37) % 101);
+	string sequence;
+	if (i % 7 == 0)
+	  {
+	    //Half and its reverse complement
+	    sequence = synthetic_sequence(length/2, gc, 31*i + length);
+	    for (size_t k=length/2; k-- > 0; )
+	      sequence += "TGCA"[string("ACGT").find(sequence[k])];
+	  }
+	else sequence = synthetic_sequence(length, gc, 31*i + length);
+	sequences.push_back(sequence);
+	salt_conc.push_back(pow(10.0, -2.0 + 2.0*uniform()));   //0.01 to 1 M
+	dna_conc.push_back(pow(10.0, -9.0 + 4.0*uniform()));    //1 nM to 10 uM
+      }
+
+  size_t count = sequences.size();
+  vector<const char *> pointers(count);
+  vector<size_t> sizes(count);
+  for (size_t i=0; i<count; i++)
+    {
+      pointers[i] = sequences[i].data();
+      sizes[i] = sequences[i].length();
+    }
+
+  int methods = METHOD_BRE | METHOD_SAN | METHOD_SUG;
+  melting_batch_input input = {count, &pointers[0], &sizes[0], &salt_conc[0], &dna_conc[0], 0.05, 0.00000005, methods};
+
+  vector<double> tm[NN_MODELS], deltah[NN_MODELS], deltas[NN_MODELS];
+  vector<float> tm_float[NN_MODELS], deltah_float[NN_MODELS], deltas_float[NN_MODELS];
+  melting_batch_output output = melting_batch_output();
+  melting_batch_float_output output_float = melting_batch_float_output();
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      tm[m].resize(count);
+      deltah[m].resize(count);
+      deltas[m].resize(count);
+      tm_float[m].resize(count);
+      deltah_float[m].resize(count);
+      deltas_float[m].resize(count);
+      output.nn_tm[m] = &tm[m][0];
+      output.deltah[m] = &deltah[m][0];
+      output.deltas[m] = &deltas[m][0];
+      output_float.nn_tm[m] = &tm_float[m][0];
+      output_float.deltah[m] = &deltah_float[m][0];
+      output_float.deltas[m] = &deltas_float[m][0];
+    }
+  melting_batch(input, output);
+  melting_batch_float(input, output_float);
+
+  //Curves of ACCURACY_CURVES sequences, one per model, on the default grid
+  int temperatures = curve_points(CURVE_T_MIN, CURVE_T_MAX, CURVE_T_STEP);
+  int curves = count < ACCURACY_CURVES ? (int) count : ACCURACY_CURVES;
+  vector<double> t(temperatures), f((size_t) curves*temperatures), dh(curves), ds(curves), dc(curves);
+  vector<float> t_float(temperatures), f_float((size_t) curves*temperatures), dh_float(curves), ds_float(curves), dc_float(curves);
+  for (int k=0; k<temperatures; k++)
+    {
+      t[k] = CURVE_T_MIN + k*CURVE_T_STEP;
+      t_float[k] = (float) t[k];
+    }
+
+  bool passed = true;
+  std::cout << "#check\tmodel\tcompared\tmax_deviation\tlimit\tresult" << std::endl;
+  auto report = [&](const char *check, const char *model, size_t compared, double deviation, double limit){
+    bool pass = deviation <= limit;
+    passed = passed && pass;
+    std::cout << check << "\t" << model << "\t" << compared << "\t" << deviation << "\t" << limit << "\t" << (pass ? "PASS" : "FAIL") << std::endl;
+  };
+
+  static const char *model_names[NN_MODELS] = {"bre", "san", "sug"};
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      double tm_deviation = 0;
+      for (size_t i=0; i<count; i++)
+	tm_deviation = max(tm_deviation, fabs(tm_float[m][i] - tm[m][i]));
+      report("batch_tm", model_names[m], count, tm_deviation, ACCURACY_TM_LIMIT);
+
+      //Curves of sequences spread over all the lengths, from the double
+      //sums so that only the curve evaluation differs
+      for (int s=0; s<curves; s++)
+	{
+	  size_t i = s*count/curves;
+	  dh[s] = deltah[m][i]*1000;
+	  ds[s] = deltas[m][i];
+	  dc[s] = dna_conc[i];
+	  dh_float[s] = (float) dh[s];
+	  ds_float[s] = (float) ds[s];
+	  dc_float[s] = (float) dc[s];
+	}
+      melting_curve_tile(curves, &dh[0], &ds[0], &dc[0], temperatures, &t[0], &f[0]);
+      melting_curve_tile_float(curves, &dh_float[0], &ds_float[0], &dc_float[0], temperatures, &t_float[0], &f_float[0]);
+
+      double f_deviation = 0, midpoint_deviation = 0;
+      vector<float> f_double(temperatures);
+      for (int s=0; s<curves; s++)
+	{
+	  const double *fs = &f[(size_t) s*temperatures];
+	  const float *fs_float = &f_float[(size_t) s*temperatures];
+	  for (int k=0; k<temperatures; k++)
+	    {
+	      f_deviation = max(f_deviation, fabs(fs_float[k] - fs[k]));
+	      f_double[k] = (float) fs[k];
+	    }
+	  double midpoint = curve_midpoint(&t_float[0], &f_double[0], temperatures);
+	  midpoint_deviation = max(midpoint_deviation, fabs(curve_midpoint(&t_float[0], fs_float, temperatures) - midpoint));
+	}
+      report("curve_f", model_names[m], (size_t) curves*temperatures, f_deviation, ACCURACY_F_LIMIT);
+      report("curve_tm", model_names[m], curves, midpoint_deviation, ACCURACY_TM_LIMIT);
+    }
+
+  //The same path end to end: rows and text curves of dna_melting --batch
+  //with --float32 against the default ones, on ACCURACY_CURVES of the
+  //sequences up to 100 nt
+  if (access(options.cli.c_str(), X_OK) == 0)
+    {
+      const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+      ostringstream prefix;
+      prefix << tmpdir << "/dna_melting_accuracy_" << getpid();
+      string input = prefix.str() + ".tsv";
+
+      size_t short_count = 0;
+      while (short_count < count && sizes[short_count] <= 100) short_count++;
+      int records = short_count < ACCURACY_CURVES ? (int) short_count : ACCURACY_CURVES;
+
+      ofstream fileout(input.c_str());
+      fileout.precision(17);
+      for (int r=0; r<records; r++)
+	{
+	  size_t i = (size_t) r*short_count/records;
+	  fileout << "s" << i << "\t" << sequences[i] << "\t" << salt_conc[i] << "\t" << dna_conc[i] << "\n";
+	}
+      fileout.close();
+
+      string rows[2], curve_files[2];
+      bool ran = (bool) fileout;
+      for (int single=0; single<2 && ran; single++)
+	{
+	  rows[single] = prefix.str() + (single ? "_float32.tsv" : "_double.tsv");
+	  curve_files[single] = prefix.str() + (single ? "_float32.curves" : "_double.curves");
+	  ostringstream command;
+	  command << options.cli << " --batch " << input << " --methods bre,san,sug --threads " << options.threads
+		  << " --curves " << curve_files[single] << (single ? " --float32" : "") << " > " << rows[single];
+	  ran = system(command.str().c_str()) == 0;
+	}
+
+      if (ran)
+	{
+	  //Rows: id, length, gc, weight, salt, dna, then the three NN Tm
+	  double tm_deviation[NN_MODELS] = {0, 0, 0};
+	  ifstream row_double(rows[0].c_str()), row_float(rows[1].c_str());
+	  string line_double, line_float;
+	  size_t compared = 0;
+	  while (getline(row_double, line_double) && getline(row_float, line_float))
+	    {
+	      if (line_double.empty() || line_double[0] == '#') continue;
+	      istringstream fields_double(line_double), fields_float(line_float);
+	      string skip;
+	      double tm_d[NN_MODELS], tm_f[NN_MODELS];
+	      for (int k=0; k<6; k++) fields_double >> skip, fields_float >> skip;
+	      for (int m=0; m<NN_MODELS; m++)
+		{
+		  fields_double >> tm_d[m];
+		  fields_float >> tm_f[m];
+		  tm_deviation[m] = max(tm_deviation[m], fabs(tm_f[m] - tm_d[m]));
+		}
+	      compared++;
+	    }
+
+	  //Curves: "# id model" then "t f" lines, the models in order
+	  double f_deviation[NN_MODELS] = {0, 0, 0};
+	  ifstream curve_double(curve_files[0].c_str()), curve_float(curve_files[1].c_str());
+	  int block = -1;
+	  size_t points = 0;
+	  while (getline(curve_double, line_double) && getline(curve_float, line_float))
+	    {
+	      if (line_double.empty()) continue;
+	      if (line_double[0] == '#')
+		{
+		  block++;
+		  continue;
+		}
+	      double t_d, f_d, t_f, f_f;
+	      istringstream(line_double) >> t_d >> f_d;
+	      istringstream(line_float) >> t_f >> f_f;
+	      f_deviation[block % NN_MODELS] = max(f_deviation[block % NN_MODELS], fabs(f_f - f_d));
+	      points++;
+	    }
+
+	  for (int m=0; m<NN_MODELS; m++)
+	    {
+	      report("cli_tm", model_names[m], compared, tm_deviation[m], ACCURACY_TM_LIMIT);
+	      report("cli_curve_f", model_names[m], points/NN_MODELS, f_deviation[m], ACCURACY_F_LIMIT);
+	    }
+	}
+      else std::cerr << "[WARNING]: " << options.cli << " --batch failed, end-to-end --float32 check skipped" << std::endl;
+
+      unlink(input.c_str());
+      for (int single=0; single<2; single++)
+	{
+	  unlink(rows[single].c_str());
+	  unlink(curve_files[single].c_str());
+	}
+    }
+  else std::cerr << "[WARNING]: " << options.cli << " not found, end-to-end --float32 check skipped" << std::endl;
+
+  return passed ? 0 : 1;
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  bench_options options = {10000000, 50.0, 0.5, (int) thread::hardware_concurrency(), false, "", "", "./dna_melting", false};
+  if (options.threads <= 0) options.threads = 1;
+
+  for (int i=1; i<argc; i++)
+    {
+      string option = argv[i];
+      if (option == "--max-length" && i+1<argc) options.max_length = atol(argv[++i]);
+      else if (option == "--gc" && i+1<argc) options.gc_content = atof(argv[++i]);
+      else if (option == "--min-time" && i+1<argc) options.min_time = atof(argv[++i]);
+      else if (option == "--threads" && i+1<argc) options.threads = atoi(argv[++i]);
+      else if (option == "--filter" && i+1<argc) options.filter = argv[++i];
+      else if (option == "--compare" && i+1<argc) options.compare = argv[++i];
+      else if (option == "--cli" && i+1<argc) options.cli = argv[++i];
+      else if (option == "--json") options.json = true;
+      else if (option == "--accuracy") options.accuracy = true;
+      else {
+	std::cout << " Usage: ./dna_melting_bench [--max-length N] [--gc %] [--min-time s] [--threads N] [--filter name] [--json] [--compare old.tsv]" << std::endl;
+	std::cout << "                           [--cli path] [--accuracy]" << std::endl;
+	std::cout << " " << std::endl;
+	std::cout << " Times every method, the curve generators and the batch interface on synthetic" << std::endl;
+	std::cout << " sequences of 10 nt up to --max-length (default 10 Mb) with --gc % GC (default 50)." << std::endl;
+	std::cout << " One TSV row (or, with --json, JSON object) is written per benchmark; --compare adds" << std::endl;
+	std::cout << " the ratio to the median times of a previous TSV run. The end-to-end benchmarks run" << std::endl;
+	std::cout << " --cli (default ./dna_melting) in batch mode on generated FASTA files." << std::endl;
+	std::cout << " " << std::endl;
+	std::cout << " --accuracy times nothing: every Tm and curve of the float32 path is compared to the" << std::endl;
+	std::cout << " double one and the maximum deviation per model is reported; the exit status is 1 if" << std::endl;
+	std::cout << " one is above its limit (0.01 K for the Tm). The rows and curves of --cli --batch with" << std::endl;
+	std::cout << " --float32 are checked against the default ones the same way." << std::endl;
+	return 0;
+      }
+    }
+  if (options.gc_content < 0 || options.gc_content > 100 || options.min_time <= 0 || options.threads <= 0){
+    std::cout << "ERROR: Invalid benchmark options" << std::endl;
+    return 0;
+  }
+
+  if (options.accuracy) return run_accuracy(options);
+
+  map<string, double> previous;
+  if (!options.compare.empty() && !read_results(options.compare.c_str(), previous)){
+    std::cout << "ERROR: Could not open file " << options.compare << std::endl;
+    return 0;
+  }
+
+  double salt_conc = 0.05;
+  double dna_conc = 0.00000005;
+  bool first = true;
+  vector<bench_result> results;
+
+  //Everything goes through this, so --filter and --compare apply to all
+  auto bench = [&](const string &name, size_t length, size_t batch, const function<void()> &call){
+    if (!options.filter.empty() && name.find(options.filter) == string::npos) return;
+    bench_result result = run_benchmark(name, length, batch, options.min_time, call);
+    write_result(std::cout, result, options.json, first);
+    results.push_back(result);
+  };
+
+
+  /***************************************
+          Per-method micro-benchmarks
+  ***************************************/
+
+  static const char *method_names[7] = {"wallace_rule", "salt", "khandelwal", "bre_nearest_neighbor", "san_nearest_neighbor", "sug_nearest_neighbor", "consensus"};
+
+  for (int l=0; l<BENCH_LENGTHS && bench_lengths[l] <= options.max_length; l++)
+    {
+      size_t length = bench_lengths[l];
+      string sequence = synthetic_sequence(length, options.gc_content, length);
+      const char *data = sequence.data();
+
+      //The pass over the sequence shared by all the methods
+      sequence_thermo thermo;
+      bench("summarize_sequence", length, 1, [&](){
+	  summarize_sequence(data, length, thermo);
+	  bench_sink = thermo.sum.deltah[NN_BRE];
+	});
+
+      //Each method alone, from the sequence
+      melting_result result;
+      for (int m=0; m<7; m++)
+	{
+	  int method = 1 << m;
+	  bench(method_names[m], length, 1, [&](){
+	      melting_temperatures(data, length, salt_conc, dna_conc, method, result);
+	      bench_sink = result.khandelwal_tm + result.nn_tm[NN_SAN] + result.consensus_tm;
+	    });
+	}
+
+      bench("all_methods", length, 1, [&](){
+	  melting_temperatures(data, length, salt_conc, dna_conc, METHOD_ALL, result);
+	  bench_sink = result.consensus_tm;
+	});
+
+      //The NN kernel on a built-in table and on the same table loaded at
+      //runtime
+      nn_params table = san_params;
+      nn_kernel<table_model> runtime = {{&table}};
+      double deltah, deltas;
+      bench("nn_kernel_san", length, 1, [&](){
+	  nn_kernel<san_model>().sums(data, length, deltah, deltas);
+	  bench_sink = nn_kernel<san_model>().melting_temperature(deltah, deltas, false, true, salt_conc, dna_conc);
+	});
+      bench("nn_kernel_table", length, 1, [&](){
+	  runtime.sums(data, length, deltah, deltas);
+	  bench_sink = runtime.melting_temperature(deltah, deltas, false, true, salt_conc, dna_conc);
+	});
+    }
+
+
+  /***************************************
+               Melting curves
+  ***************************************/
+
+  {
+    sequence_thermo thermo;
+    string sequence = synthetic_sequence(20, options.gc_content, 20);
+    summarize_sequence(sequence.data(), sequence.length(), thermo);
+    double deltah = bre_enthalpy(thermo), deltas = bre_entropy(thermo);
+    vector<double> t, f;
+
+    curve_grid uniform = default_curve_grid;
+    bench("melting_curve_uniform", 20, 1, [&](){
+	sample_melting_curve(deltah, deltas, dna_conc, uniform, t, f);
+	bench_sink = f[f.size()/2];
+      });
+
+    curve_grid adaptive = default_curve_grid;
+    adaptive.tolerance = 0.001;
+    bench("melting_curve_adaptive", 20, 1, [&](){
+	sample_melting_curve(deltah, deltas, dna_conc, adaptive, t, f);
+	bench_sink = f[f.size()/2];
+      });
+
+    bench("melting_transition", 20, 1, [&](){
+	bench_sink = melting_transition(deltah, deltas, dna_conc).peak_t;
+      });
+
+    //Three curves for each of 64 sequences, as batch --curves evaluates them
+    int curves = 3*64;
+    int temperatures = curve_points(CURVE_T_MIN, CURVE_T_MAX, CURVE_T_STEP);
+    vector<double> dh(curves), ds(curves), ct(curves, dna_conc), tt(temperatures), ft((size_t) curves*temperatures);
+    for (int k=0; k<temperatures; k++) tt[k] = CURVE_T_MIN + k*CURVE_T_STEP;
+    for (int s=0; s<64; s++)
+      {
+	string oligo = synthetic_sequence(20, options.gc_content, 1000+s);
+	summarize_sequence(oligo.data(), oligo.length(), thermo);
+	for (int m=0; m<NN_MODELS; m++)
+	  {
+	    dh[3*s+m] = thermo.sum.deltah[m]*1000;
+	    ds[3*s+m] = thermo.sum.deltas[m];
+	  }
+      }
+    bench("melting_curve_tile", 20, curves, [&](){
+	melting_curve_tile(curves, &dh[0], &ds[0], &ct[0], temperatures, &tt[0], &ft[0]);
+	bench_sink = ft[temperatures/2];
+      });
+
+    vector<float> dh_float(dh.begin(), dh.end()), ds_float(ds.begin(), ds.end()), ct_float(ct.begin(), ct.end());
+    vector<float> tt_float(tt.begin(), tt.end()), ft_float(ft.size());
+    bench("melting_curve_tile_float", 20, curves, [&](){
+	melting_curve_tile_float(curves, &dh_float[0], &ds_float[0], &ct_float[0], temperatures, &tt_float[0], &ft_float[0]);
+	bench_sink = ft_float[temperatures/2];
+      });
+  }
+
+
+  /***************************************
+           Batch throughput
+  ***************************************/
+
+  static const size_t batch_lengths[2] = {20, 1000};
+  static const size_t batch_sizes[3] = {100, 10000, 100000};
+
+  for (int l=0; l<2; l++)
+    for (int b=0; b<3; b++)
+      {
+	size_t length = batch_lengths[l], count = batch_sizes[b];
+	if ((double) length*count > 2e8) continue;
+
+	//Sequences of the same length, varying GC around the requested one
+	vector<string> sequences(count);
+	vector<const char *> pointers(count);
+	vector<size_t> lengths(count, length);
+	for (size_t i=0; i<count; i++)
+	  {
+	    double gc = options.gc_content + (double(i % 21) - 10.0);
+	    sequences[i] = synthetic_sequence(length, gc < 0 ? 0 : gc > 100 ? 100 : gc, 7919*i + length);
+	    pointers[i] = sequences[i].data();
+	  }
+
+	vector<double> tm(count), deltah(count), gc_out(count), mw(count);
+	melting_batch_input input = {count, &pointers[0], &lengths[0], 0, 0, salt_conc, dna_conc, METHOD_ALL};
+	melting_batch_output output = melting_batch_output();
+	output.consensus_tm = &tm[0];
+	output.deltah[NN_SAN] = &deltah[0];
+	output.gc_content = &gc_out[0];
+	output.molecular_weight = &mw[0];
+
+	bench("melting_batch", length, count, [&](){
+	    melting_batch(input, output);
+	    bench_sink = tm[count/2];
+	  });
+
+	//The three NN models alone, in double and through the float32 path
+	melting_batch_input nn_input = input;
+	nn_input.methods = METHOD_BRE | METHOD_SAN | METHOD_SUG;
+	vector<double> nn_tm(3*count);
+	vector<float> nn_tm_float(3*count);
+	melting_batch_output nn_output = melting_batch_output();
+	melting_batch_float_output float_output = melting_batch_float_output();
+	for (int m=0; m<NN_MODELS; m++)
+	  {
+	    nn_output.nn_tm[m] = &nn_tm[m*count];
+	    float_output.nn_tm[m] = &nn_tm_float[m*count];
+	  }
+	bench("melting_batch_nn", length, count, [&](){
+	    melting_batch(nn_input, nn_output);
+	    bench_sink = nn_tm[count/2];
+	  });
+	bench("melting_batch_float", length, count, [&](){
+	    melting_batch_float(nn_input, float_output);
+	    bench_sink = nn_tm_float[count/2];
+	  });
+
+	//The same batch split in ranges over --threads threads
+	if (options.threads > 1)
+	  {
+	    int threads = options.threads;
+	    ostringstream name;
+	    name << "melting_batch_threads" << threads;
+	    bench(name.str(), length, count, [&](){
+		vector<thread> workers;
+		for (int w=0; w<threads; w++)
+		  workers.push_back(thread([&, w](){
+			melting_batch(input, output, count*w/threads, count*(w+1)/threads);
+		      }));
+		for (int w=0; w<threads; w++) workers[w].join();
+		bench_sink = tm[count/2];
+	      });
+	  }
+      }
+
+
+
+  /***************************************
+       End-to-end batch mode of the CLI
+  ***************************************/
+
+  //Parsing, computing and formatting of ./dna_melting --batch, on a FASTA
+  //file written to a temporary directory
+  if (access(options.cli.c_str(), X_OK) == 0)
+    {
+      static const size_t cli_lengths[2] = {20, 1000};
+      static const size_t cli_counts[2] = {100000, 10000};
+      const char *tmpdir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+      for (int c=0; c<2; c++)
+	{
+	  size_t length = cli_lengths[c], count = cli_counts[c];
+	  ostringstream filename;
+	  filename << tmpdir << "/dna_melting_bench_" << getpid() << "_" << length << ".fa";
+
+	  ofstream fileout(filename.str().c_str());
+	  for (size_t i=0; i<count; i++)
+	    fileout << ">s" << i << "\n" << synthetic_sequence(length, options.gc_content, 104729*i + length) << "\n";
+	  fileout.close();
+	  if (!fileout)
+	    {
+	      std::cerr << "[WARNING]: could not write " << filename.str() << ", end-to-end benchmark skipped" << std::endl;
+	      continue;
+	    }
+
+	  ostringstream command;
+	  command << options.cli << " --batch " << filename.str() << " --threads " << options.threads << " > /dev/null";
+	  string text = command.str();
+	  bench("cli_batch", length, count, [&](){
+	      bench_sink = system(text.c_str());
+	    });
+
+	  unlink(filename.str().c_str());
+	}
+    }
+  else std::cerr << "[WARNING]: " << options.cli << " not found, end-to-end benchmarks skipped" << std::endl;
+
+  if (options.json && !first) std::cout << "\n]\n";
+
+  //Ratio to a previous run: > 1 is slower than before
+  if (!previous.empty())
+    {
+      std::cerr << "#benchmark\tlength\tbatch\tns_median\tprevious_ns_median\tratio" << std::endl;
+      for (size_t i=0; i<results.size(); i++)
+	{
+	  ostringstream key;
+	  key << results[i].name << "\t" << results[i].length << "\t" << results[i].batch;
+	  map<string, double>::iterator old = previous.find(key.str());
+	  if (old == previous.end()) continue;
+	  std::cerr << key.str() << "\t" << results[i].ns_median << "\t" << old->second << "\t" << results[i].ns_median/old->second << std::endl;
+	}
+    }
+
+  return 0;
+}
@@ -0,0 +1,3047 @@
+//Code to compute DNA melting temperature
+//by
+//Lara Querciagrossa
+//
+//Compute part of dna_melting, built as libdna_melting
+
+#include "dna_melting.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+#include <string>
+#include <vector>
+using namespace std;
+
+#define SMALL 0.001
+
+
+
+double wallace_rule(double sequence_length, double a_count , double c_count, double g_count, double t_count)
+  {
+    //Marmur and Doty, 1962
+
+    double wallace_melting_temperature;
+
+    if (sequence_length <= 15)
+      {
+	wallace_melting_temperature=2*(a_count+t_count)+4*(c_count+g_count);
+      }
+    else
+      {
+	wallace_melting_temperature=69.3+(((41*(c_count+g_count))/sequence_length)-(650/sequence_length));
+      }
+
+    return wallace_melting_temperature;
+  }
+
+
+
+double salt(double salt_conc, double a_count , double c_count, double g_count, double t_count)
+  {
+    //Howley et al., 1979
+
+    double salt_adjusted_melting_temperature;
+
+    salt_adjusted_melting_temperature=81.5+16.6*log10(salt_conc)+41.0*((c_count+g_count)/(a_count+c_count+g_count+t_count))-(675.0/(a_count+c_count+g_count+t_count));
+
+    return salt_adjusted_melting_temperature;
+  }
+
+
+/***************************************  
+       Nearest-neighbor parameters
+***************************************/
+
+signed char base_code[256];
+
+//Khandelwal and Bhyravabhotla, 2010 (stacking strength)
+const double khandelwal_strength[16] = {5, 10, 8, 7, 7, 11, 10, 8, 8, 13, 11, 10, 4, 8, 7, 5};
+
+const nn_params *nn_models[NN_MODELS] = {&bre_params, &san_params, &sug_params};
+
+
+
+static bool init_base_code()
+{
+  for (int c=0; c<256; c++) base_code[c]=-1;
+  base_code['A']=0;
+  base_code['C']=1;
+  base_code['G']=2;
+  base_code['T']=3;
+  return true;
+}
+
+static bool base_code_ready = init_base_code();
+
+
+
+void nearest_neighbor_sums(const char *specie, size_t sequence_length, nn_sum &sum)
+{
+  //Single pass over the sequence: every base is encoded once and each
+  //dinucleotide adds its enthalpy and entropy for all the models.
+  //Dinucleotides containing a character other than A, C, G, T are skipped
+
+  double h_bre=0, h_san=0, h_sug=0;
+  double s_bre=0, s_san=0, s_sug=0;
+
+  int prev = sequence_length > 0 ? base_code[(unsigned char) specie[0]] : -1;
+
+  for (size_t i=1; i<sequence_length; i++)
+    {
+      int next = base_code[(unsigned char) specie[i]];
+      if ((prev | next) >= 0)
+	{
+	  int nn = 4*prev+next;
+	  h_bre += bre_params.h[nn];
+	  s_bre += bre_params.s[nn];
+	  h_san += san_params.h[nn];
+	  s_san += san_params.s[nn];
+	  h_sug += sug_params.h[nn];
+	  s_sug += sug_params.s[nn];
+	}
+      prev = next;
+    }
+
+  sum.deltah[NN_BRE]=h_bre;
+  sum.deltah[NN_SAN]=h_san;
+  sum.deltah[NN_SUG]=h_sug;
+  sum.deltas[NN_BRE]=s_bre;
+  sum.deltas[NN_SAN]=s_san;
+  sum.deltas[NN_SUG]=s_sug;
+}
+
+
+
+void nearest_neighbor_sums(const string &specie, nn_sum &sum)
+{
+  nearest_neighbor_sums(specie.data(), specie.length(), sum);
+}
+
+
+
+void nn_sums_from_histogram(const long dinucleotides[16], nn_sum &sum)
+{
+  nn_kernel<bre_model>().sums(dinucleotides, sum.deltah[NN_BRE], sum.deltas[NN_BRE]);
+  nn_kernel<san_model>().sums(dinucleotides, sum.deltah[NN_SAN], sum.deltas[NN_SAN]);
+  nn_kernel<sug_model>().sums(dinucleotides, sum.deltah[NN_SUG], sum.deltas[NN_SUG]);
+}
+
+
+
+bool is_self_complementary(const char *specie, size_t sequence_length)
+{
+  //True if the sequence is equal to its reverse complement
+
+  static const char complement[4] = {'T', 'G', 'C', 'A'};
+
+  if (sequence_length == 0) return false;
+
+  for (size_t i=0, j=sequence_length-1; i<=j; i++, j--)
+    {
+      int code = base_code[(unsigned char) specie[i]];
+      if (code < 0 || specie[j] != complement[code]) return false;
+    }
+
+  return true;
+}
+
+
+
+bool is_self_complementary(const string &specie)
+{
+  return is_self_complementary(specie.data(), specie.length());
+}
+
+
+
+static const char *nn_letters = "ACGT";
+static const char *nn_correction_names[4] = {"symmetry", "non_self_compl", "only_at", "any_cg"};
+
+
+static double &nn_correction(nn_params &params, int c)
+{
+  if (c == 0) return params.simm_corr;
+  if (c == 1) return params.non_self_compl;
+  if (c == 2) return params.only_at;
+  return params.any_cg;
+}
+
+
+
+bool parse_nn_params(const string &text, nn_params &params, string &name, string &error)
+{
+  //Table in the text form described in dna_melting.h
+
+  istringstream lines(text);
+  string line;
+  int stacks = 0, corrections = 0, number = 0;
+
+  params = nn_params();
+  name = "table";
+
+  while (getline(lines, line))
+    {
+      number++;
+      size_t comment = line.find('#');
+      if (comment != string::npos) line.erase(comment);
+
+      istringstream fields(line);
+      string key;
+      if (!(fields >> key)) continue;
+      string where = "line " + to_string(number) + ": ";
+
+      if (key == "name")
+	{
+	  if (!(fields >> name)) { error = where + "missing name"; return false; }
+	  continue;
+	}
+
+      int c = 0;
+      while (c < 4 && key != nn_correction_names[c]) c++;
+      if (c < 4)
+	{
+	  if (!(fields >> nn_correction(params, c))) { error = where + "missing value of " + key; return false; }
+	  corrections |= 1 << c;
+	  continue;
+	}
+
+      for (size_t i=0; i<key.length(); i++) key[i] = toupper((unsigned char) key[i]);
+      bool pair = key.length() == 5 && key[2] == '/';
+      int x = key.length() >= 2 ? base_code[(unsigned char) key[0]] : -1;
+      int y = key.length() >= 2 ? base_code[(unsigned char) key[1]] : -1;
+      if ((key.length() != 2 && !pair) || x < 0 || y < 0 ||
+	  (pair && (base_code[(unsigned char) key[3]] != 3-x || base_code[(unsigned char) key[4]] != 3-y)))
+	{
+	  error = where + "unknown entry " + key;
+	  return false;
+	}
+
+      double h, s;
+      if (!(fields >> h >> s)) { error = where + "missing deltaH or deltaS of " + key; return false; }
+
+      //XY/X'Y' is also the stack read on the other strand, Y'X'
+      int stack[2] = {4*x+y, 4*(3-y)+(3-x)};
+      for (int r=0; r<(pair ? 2 : 1); r++)
+	{
+	  params.h[stack[r]] = h;
+	  params.s[stack[r]] = s;
+	  stacks |= 1 << stack[r];
+	}
+    }
+
+  for (int k=0; k<16; k++)
+    if (!(stacks & (1 << k)))
+      {
+	error = string("missing stack ") + nn_letters[k/4] + nn_letters[k%4];
+	return false;
+      }
+  for (int c=0; c<4; c++)
+    if (!(corrections & (1 << c)))
+      {
+	error = string("missing ") + nn_correction_names[c];
+	return false;
+      }
+
+  return true;
+}
+
+
+
+string format_nn_params(const nn_params &params, const string &name)
+{
+  ostringstream text;
+  text << "name " << name << "\n";
+  text << "# stack deltaH (kcal/mol) deltaS (cal/(K mol))\n";
+  for (int k=0; k<16; k++) text << nn_letters[k/4] << nn_letters[k%4] << " " << params.h[k] << " " << params.s[k] << "\n";
+  double corrections[4] = {params.simm_corr, params.non_self_compl, params.only_at, params.any_cg};
+  text << "# corrections, deltaS (cal/(K mol))\n";
+  for (int c=0; c<4; c++) text << nn_correction_names[c] << " " << corrections[c] << "\n";
+  return text.str();
+}
+
+
+
+double nn_melting_temperature(const nn_params &params, double deltah_d, double deltas_d, bool self_compl, bool any_cg, double salt_conc, double dna_conc)
+{
+  //Two-state Tm (K) of any table, through the runtime kernel
+
+  nn_kernel<table_model> kernel = {{&params}};
+  return kernel.melting_temperature(deltah_d, deltas_d, self_compl, any_cg, salt_conc, dna_conc);
+}
+
+
+
+double khandelwal_from_strength(double sequence_length, double strength, double salt_conc, double dna_conc)
+  {
+    //Khandelwal and Bhyravabhotla, 2010
+    //strength is the sum of the stacking strengths of all dinucleotides
+
+    double ee = strength/sequence_length;
+
+    return 7.35*ee+17.34*log(sequence_length)+4.96*log(salt_conc)+0.89*log(dna_conc)-25.42;
+  }
+
+
+
+double khandelwal(const sequence_thermo &thermo, double salt_conc, double dna_conc)
+  {
+    //Khandelwal and Bhyravabhotla, 2010
+
+    return khandelwal_from_strength(thermo.length, thermo.strength, salt_conc, dna_conc);
+  }
+
+
+
+double nn_melting_temperature(const sequence_thermo &thermo, int model, double salt_conc, double dna_conc)
+  {
+    //Tm (K) of one of the nearest-neighbor models, through the kernel
+    //specialized on its table
+
+    bool any_cg = thermo.counts[1]!=0 || thermo.counts[2]!=0;
+    const double h = thermo.sum.deltah[model], s = thermo.sum.deltas[model];
+    bool self_compl = thermo.self_complementary;
+
+    if (model == NN_BRE) return nn_kernel<bre_model>().melting_temperature(h, s, self_compl, any_cg, salt_conc, dna_conc);
+    if (model == NN_SAN) return nn_kernel<san_model>().melting_temperature(h, s, self_compl, any_cg, salt_conc, dna_conc);
+    return nn_kernel<sug_model>().melting_temperature(h, s, self_compl, any_cg, salt_conc, dna_conc);
+  }
+
+
+
+double table_melting_temperature(const sequence_thermo &thermo, const nn_params &table, double salt_conc, double dna_conc)
+  {
+    //Tm (K) of a table loaded at runtime, from the dinucleotide histogram
+
+    nn_kernel<table_model> kernel = {{&table}};
+    double deltah, deltas;
+    kernel.sums(thermo.dinucleotides, deltah, deltas);
+    bool any_cg = thermo.counts[1]!=0 || thermo.counts[2]!=0;
+    return kernel.melting_temperature(deltah, deltas, thermo.self_complementary, any_cg, salt_conc, dna_conc);
+  }
+
+
+
+double bre_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc)
+  {
+    //Breslauer, Frank, Blocker and Marky, 1986
+    return nn_melting_temperature(thermo, NN_BRE, salt_conc, dna_conc);
+  }
+
+
+
+double san_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc)
+  {
+    //SantaLucia, Allawi and Seneviratne, 1996
+    return nn_melting_temperature(thermo, NN_SAN, salt_conc, dna_conc);
+  }
+
+
+
+double sug_nearest_neighbor(const sequence_thermo &thermo, double salt_conc, double dna_conc)
+  {
+    //Sugimoto, Nakano, Yoneyama and Honda, 1996
+    return nn_melting_temperature(thermo, NN_SUG, salt_conc, dna_conc);
+  }
+
+
+
+const char *consensus_label(int consensus_class)
+  {
+    static const char *labels[4] = {"Full consensus sequence", "Bre&Sug consensus sequence", "San&Sug consensus sequence", "Non-consensus sequence"};
+    return labels[consensus_class];
+  }
+
+
+
+double consensus_from_tm(int sequence_length, double gc_content, double bre_tm, double san_tm, double sug_tm, int &consensus_class)
+  {
+    //Panjkovich and Melo, 2005
+    //Picks the methods to average given the length and GC content
+
+    double consensus_melting_temperature;
+
+    if (sequence_length>=16 && sequence_length<=18 && gc_content>=30 && gc_content<=50){
+      consensus_melting_temperature=(bre_tm+san_tm+sug_tm)/3;
+      consensus_class=CONSENSUS_FULL;
+    }
+
+    if (sequence_length>=21 && sequence_length<=22 && gc_content>=0 && gc_content<=10 || sequence_length>=16 && sequence_length<=29 && gc_content>=10 && gc_content<=20 || sequence_length>=16 && sequence_length<=26 && gc_content>=20 && gc_content<=30 || sequence_length>=19 && sequence_length<=21 && gc_content>=30 && gc_content<=40){
+      consensus_melting_temperature=(bre_tm+sug_tm)/2;
+      consensus_class=CONSENSUS_BRE_SUG;
+    }
+
+    if (sequence_length>=19 && sequence_length<=30 && gc_content>=40 && gc_content<=50 || sequence_length>=16 && sequence_length<=30 && gc_content>=50 && gc_content<=80 || sequence_length==16 && gc_content>=80 && gc_content<=90 || sequence_length==17 && gc_content>=80 && gc_content<=90 || sequence_length==20 && gc_content>=80 && gc_content<=90){
+      consensus_melting_temperature=(san_tm+sug_tm)/2;
+      consensus_class=CONSENSUS_SAN_SUG;
+    }
+    
+    else 
+      {
+      consensus_melting_temperature=(bre_tm+san_tm+sug_tm)/3;
+      consensus_class=CONSENSUS_NONE;
+      }
+
+    return consensus_melting_temperature;
+
+  }
+
+
+
+double consensus(const sequence_thermo &thermo, double salt_conc, double dna_conc, int &consensus_class)
+  {
+    //Panjkovich and Melo, 2005
+
+    double bre_tm = bre_nearest_neighbor(thermo, salt_conc, dna_conc);
+    double san_tm = san_nearest_neighbor(thermo, salt_conc, dna_conc);
+    double sug_tm = sug_nearest_neighbor(thermo, salt_conc, dna_conc);
+
+    return consensus_from_tm(thermo.length, gc_content(thermo), bre_tm, san_tm, sug_tm, consensus_class);
+  }
+
+
+
+double bre_enthalpy(const sequence_thermo &thermo)
+  {
+    //cal/mol
+    return thermo.sum.deltah[NN_BRE]*1000;
+  }
+
+
+
+double bre_entropy(const sequence_thermo &thermo)
+  {
+    //cal/(K mol)
+    return thermo.sum.deltas[NN_BRE];
+  }
+
+
+
+double san_enthalpy(const sequence_thermo &thermo)
+  {
+    //cal/mol
+    return thermo.sum.deltah[NN_SAN]*1000;
+  }
+
+
+
+double san_entropy(const sequence_thermo &thermo)
+  {
+    //cal/(K mol)
+    return thermo.sum.deltas[NN_SAN];
+  }
+
+
+
+double sug_enthalpy(const sequence_thermo &thermo)
+  {
+    //cal/mol
+    return thermo.sum.deltah[NN_SUG]*1000;
+  }
+
+
+
+double sug_entropy(const sequence_thermo &thermo)
+  {
+    //cal/(K mol)
+    return thermo.sum.deltas[NN_SUG];
+  }
+
+
+
+/***************************************  
+           Melting curve engine
+***************************************/
+
+int curve_points(double t_min, double t_max, double t_step)
+{
+  return int((t_max-t_min)/t_step + SMALL) + 1;
+}
+
+
+
+static inline double curve_exp(double x)
+{
+  //exp() written with plain arithmetic so that loops calling it are
+  //vectorized by the compiler: x = k*ln2 + r, |r| <= ln2/2, exp(r) from
+  //its Taylor series (relative error < 1e-14), 2^k built in the exponent
+  //bits. x is clamped to [-700, 700]: f is 0 or 1 to double precision
+  //well before that
+  const double shift = 6755399441055744.0;  //2^52+2^51, rounds to integer
+  const double log2e = 1.4426950408889634;
+  const double ln2_hi = 0.6931471803691238;
+  const double ln2_lo = 1.9082149292705877e-10;
+
+  x = x < -700.0 ? -700.0 : x;
+  x = x > 700.0 ? 700.0 : x;
+
+  double kd = x*log2e + shift;
+  double k = kd - shift;
+  double r = x - k*ln2_hi - k*ln2_lo;
+
+  double p = 1.0/479001600.0;
+  p = p*r + 1.0/39916800.0;
+  p = p*r + 1.0/3628800.0;
+  p = p*r + 1.0/362880.0;
+  p = p*r + 1.0/40320.0;
+  p = p*r + 1.0/5040.0;
+  p = p*r + 1.0/720.0;
+  p = p*r + 1.0/120.0;
+  p = p*r + 1.0/24.0;
+  p = p*r + 1.0/6.0;
+  p = p*r + 0.5;
+  p = p*r + 1.0;
+  p = p*r + 1.0;
+
+  //kd and shift share the exponent, so the difference of their bit
+  //patterns is k
+  long long kbits, scale_bits;
+  memcpy(&kbits, &kd, sizeof(kbits));
+  scale_bits = (kbits - 0x4338000000000000LL + 1023) << 52;
+  double scale;
+  memcpy(&scale, &scale_bits, sizeof(scale));
+
+  return p*scale;
+}
+
+
+
+void melting_curve_tile(int sequences, const double *deltah, const double *deltas, const double *dna_conc, int temperatures, const double *t, double *f)
+{
+  //Two-state fraction of hybridized strands f(t) for many sequences over
+  //the same temperatures. deltah in cal/mol, deltas in cal/(K mol).
+  //f is stored sequence by sequence: f[s*temperatures + k].
+  //The per-temperature 1/(R*t) terms are computed once and shared by all
+  //the sequences; the inner loop over temperatures is branch free and
+  //vectorized.
+  //f is evaluated as ctkeq/(1+ctkeq+sqrt(1+2*ctkeq)), which is the same
+  //as (1+ctkeq-sqrt(1+2*ctkeq))/ctkeq without the cancellation at small
+  //ctkeq and the inf/inf at large ctkeq
+
+  double R=1.987; //cal/(K mol)
+
+  vector<double> inv_rt(temperatures);
+  for (int k=0; k<temperatures; k++) inv_rt[k] = 1.0/(R*t[k]);
+
+  vector<double> c0(sequences);
+  for (int s=0; s<sequences; s++) c0[s] = log(dna_conc[s]) + deltas[s]/R;
+
+  for (int tb=0; tb<temperatures; tb+=CURVE_TILE_T)
+    {
+      int te = tb+CURVE_TILE_T < temperatures ? tb+CURVE_TILE_T : temperatures;
+
+      for (int sb=0; sb<sequences; sb+=CURVE_TILE_SEQ)
+	{
+	  int se = sb+CURVE_TILE_SEQ < sequences ? sb+CURVE_TILE_SEQ : sequences;
+
+	  for (int s=sb; s<se; s++)
+	    {
+	      double a = c0[s];
+	      double h = deltah[s];
+	      const double *irt = &inv_rt[0];
+	      double *fs = f + (size_t) s*temperatures;
+
+	      for (int k=tb; k<te; k++)
+		{
+		  double ctkeq = curve_exp(a - h*irt[k]);
+		  fs[k] = ctkeq/(1+ctkeq+sqrt(1+2*ctkeq));
+		}
+	    }
+	}
+    }
+}
+
+
+
+static inline float curve_expf(float x)
+{
+  //Single precision curve_exp(): x clamped to [-80, 80] so that 2^k and
+  //the fractions computed from it stay normal floats (subnormals are
+  //slow and f is 0 or 1 to float precision well before), Taylor series
+  //to r^7 (relative error < 1e-8, below the float rounding)
+  const float shift = 12582912.0f;  //2^23+2^22, rounds to integer
+  const float log2e = 1.44269504f;
+  const float ln2_hi = 0.693145752f;
+  const float ln2_lo = 1.42860677e-6f;
+
+  //A single select: two chained ones are jump-threaded into a branch
+  //that stops the vectorization
+  x = fabsf(x) > 80.0f ? copysignf(80.0f, x) : x;
+
+  float kd = x*log2e + shift;
+  float k = kd - shift;
+  float r = x - k*ln2_hi - k*ln2_lo;
+
+  float p = 1.0f/5040.0f;
+  p = p*r + 1.0f/720.0f;
+  p = p*r + 1.0f/120.0f;
+  p = p*r + 1.0f/24.0f;
+  p = p*r + 1.0f/6.0f;
+  p = p*r + 0.5f;
+  p = p*r + 1.0f;
+  p = p*r + 1.0f;
+
+  int kbits, scale_bits;
+  memcpy(&kbits, &kd, sizeof(kbits));
+  scale_bits = (kbits - 0x4B400000 + 127) << 23;
+  float scale;
+  memcpy(&scale, &scale_bits, sizeof(scale));
+
+  return p*scale;
+}
+
+
+
+void melting_curve_tile_float(int sequences, const float *deltah, const float *deltas, const float *dna_conc, int temperatures, const float *t, float *f)
+{
+  //melting_curve_tile() in single precision, same tiles and layout.
+  //c0 and 1/(R*t) are computed in double and rounded once; the exponent
+  //a - h*irt[k] is the only float arithmetic before curve_expf()
+
+  double R=1.987; //cal/(K mol)
+
+  vector<float> inv_rt(temperatures);
+  for (int k=0; k<temperatures; k++) inv_rt[k] = float(1.0/(R*t[k]));
+
+  vector<float> c0(sequences);
+  for (int s=0; s<sequences; s++) c0[s] = float(log((double) dna_conc[s]) + deltas[s]/R);
+
+  for (int tb=0; tb<temperatures; tb+=CURVE_TILE_T)
+    {
+      int te = tb+CURVE_TILE_T < temperatures ? tb+CURVE_TILE_T : temperatures;
+
+      for (int sb=0; sb<sequences; sb+=CURVE_TILE_SEQ)
+	{
+	  int se = sb+CURVE_TILE_SEQ < sequences ? sb+CURVE_TILE_SEQ : sequences;
+
+	  for (int s=sb; s<se; s++)
+	    {
+	      float a = c0[s];
+	      float h = deltah[s];
+	      const float *irt = &inv_rt[0];
+	      float *fs = f + (size_t) s*temperatures;
+
+	      //The exponentials in a loop of their own: the errno check of
+	      //sqrtf() keeps the second loop from being vectorized
+	      float ctkeq[CURVE_TILE_T];
+	      for (int k=tb; k<te; k++) ctkeq[k-tb] = curve_expf(a - h*irt[k]);
+	      for (int k=tb; k<te; k++)
+		{
+		  float c = ctkeq[k-tb];
+		  fs[k] = c/(1+c+sqrtf(1+2*c));
+		}
+	    }
+	}
+    }
+}
+
+
+
+double two_state_fraction(double deltah, double deltas, double dna_conc, double t)
+{
+  //Scalar version of the fraction evaluated by melting_curve_tile()
+  double R=1.987; //cal/(K mol)
+  double ctkeq = curve_exp(log(dna_conc) + deltas/R - deltah/(R*t));
+  return ctkeq/(1+ctkeq+sqrt(1+2*ctkeq));
+}
+
+
+
+double two_state_temperature(double deltah, double deltas, double dna_conc, double f)
+{
+  //Temperature at which the fraction of hybridized strands is f (0<f<1):
+  //f = c/(1+c+sqrt(1+2c)) gives c = 2f/(1-f)^2, and
+  //c = Ct*exp(dS/R - dH/(R*T)) gives T. Exact, no iteration needed
+  double R=1.987; //cal/(K mol)
+  double ctkeq = 2*f/((1-f)*(1-f));
+  return deltah/(deltas + R*log(dna_conc) - R*log(ctkeq));
+}
+
+
+
+static double two_state_slope(double deltah, double deltas, double dna_conc, double t)
+{
+  //-df/dT = -df/dc * dc/dT, with dc/dT = c*dH/(R*T^2)
+  double R=1.987; //cal/(K mol)
+  double ctkeq = curve_exp(log(dna_conc) + deltas/R - deltah/(R*t));
+  double root = sqrt(1+2*ctkeq);
+  double den = 1+ctkeq+root;
+  double dfdc = (den - ctkeq*(1+1/root))/(den*den);
+  return -dfdc*ctkeq*deltah/(R*t*t);
+}
+
+
+
+curve_transition melting_transition(double deltah, double deltas, double dna_conc)
+{
+  //Tm and width of the transition from the closed form above; the peak
+  //of -df/dT (slightly off Tm, the curve is not symmetric) is located by
+  //golden-section search between the f = 0.9 and f = 0.1 temperatures
+
+  curve_transition transition;
+  transition.tm = two_state_temperature(deltah, deltas, dna_conc, 0.5);
+  transition.t_high = two_state_temperature(deltah, deltas, dna_conc, 0.9);
+  transition.t_low = two_state_temperature(deltah, deltas, dna_conc, 0.1);
+  transition.width = transition.t_low - transition.t_high;
+
+  const double golden = 0.6180339887498949;
+  double a = transition.t_high, b = transition.t_low;
+  double x1 = b - golden*(b-a), x2 = a + golden*(b-a);
+  double s1 = two_state_slope(deltah, deltas, dna_conc, x1);
+  double s2 = two_state_slope(deltah, deltas, dna_conc, x2);
+  while (b-a > 1e-6)
+    {
+      if (s1 > s2)
+	{
+	  b = x2; x2 = x1; s2 = s1;
+	  x1 = b - golden*(b-a);
+	  s1 = two_state_slope(deltah, deltas, dna_conc, x1);
+	}
+      else
+	{
+	  a = x1; x1 = x2; s1 = s2;
+	  x2 = a + golden*(b-a);
+	  s2 = two_state_slope(deltah, deltas, dna_conc, x2);
+	}
+    }
+  transition.peak_t = (a+b)/2;
+  transition.peak_slope = two_state_slope(deltah, deltas, dna_conc, transition.peak_t);
+
+  return transition;
+}
+
+
+
+static void refine_curve(double deltah, double deltas, double dna_conc, double t0, double f0, double t1, double f1, double tolerance, int depth, vector<double> &t, vector<double> &f)
+{
+  //Add the points of (t0, t1] needed for linear interpolation to be
+  //within tolerance of f
+  double tm = (t0+t1)/2;
+  double fm = two_state_fraction(deltah, deltas, dna_conc, tm);
+
+  if (depth > 0 && fabs(fm - (f0+f1)/2) > tolerance)
+    {
+      refine_curve(deltah, deltas, dna_conc, t0, f0, tm, fm, tolerance, depth-1, t, f);
+      refine_curve(deltah, deltas, dna_conc, tm, fm, t1, f1, tolerance, depth-1, t, f);
+    }
+  else
+    {
+      t.push_back(t1);
+      f.push_back(f1);
+    }
+}
+
+
+
+void sample_melting_curve(double deltah, double deltas, double dna_conc, const curve_grid &grid, vector<double> &t, vector<double> &f)
+{
+  //Points of a melting curve: a uniform grid, or (grid.tolerance > 0)
+  //adaptive sampling. Adaptive curves start from the plateau ends and the
+  //analytic f = 0.999 ... 0.001 temperatures, then intervals are split
+  //only where f is not linear within tolerance, so the plateaus take a
+  //handful of points and the transition is resolved finely
+
+  t.clear();
+  f.clear();
+
+  if (grid.tolerance <= 0)
+    {
+      int n = curve_points(grid.t_min, grid.t_max, grid.t_step);
+      t.resize(n);
+      f.resize(n);
+      for (int k=0; k<n; k++) t[k] = grid.t_min + k*grid.t_step;
+      melting_curve_tile(1, &deltah, &deltas, &dna_conc, n, &t[0], &f[0]);
+      return;
+    }
+
+  static const double anchors[7] = {0.999, 0.99, 0.9, 0.5, 0.1, 0.01, 0.001};
+  vector<double> knots;
+  knots.push_back(grid.t_min);
+  for (int k=0; k<7; k++)
+    {
+      double tk = two_state_temperature(deltah, deltas, dna_conc, anchors[k]);
+      if (tk > knots.back() && tk < grid.t_max) knots.push_back(tk);
+    }
+  knots.push_back(grid.t_max);
+
+  t.push_back(knots[0]);
+  f.push_back(two_state_fraction(deltah, deltas, dna_conc, knots[0]));
+  for (size_t k=1; k<knots.size(); k++)
+    {
+      double f1 = two_state_fraction(deltah, deltas, dna_conc, knots[k]);
+      refine_curve(deltah, deltas, dna_conc, t.back(), f.back(), knots[k], f1, grid.tolerance, 20, t, f);
+    }
+}
+
+
+
+
+
+
+/***************************************  
+     Poland-Scheraga melting (long DNA)
+***************************************/
+
+//Step of the quadrature giving the Fixman-Freire exponentials: the
+//relative error of the loop factor is about 2|Gamma(alpha+2i*pi/step)|/
+//Gamma(alpha), below 1% for step 1
+#define PS_LOOP_STEP 1.0
+
+//Partition functions are kept as a double times 2^(PS_SCALE_BITS*n): a
+//value is rescaled when it passes 2^PS_SCALE_BITS, so the product of a
+//forward and a backward value never overflows
+#define PS_SCALE_BITS 256
+
+
+void fixman_freire_fit(double alpha, size_t max_loop, ps_loop_factor &loop)
+{
+  //(m+1)^-alpha = 1/Gamma(alpha) * integral of exp(alpha*u - (m+1)*e^u) du
+  //and the trapezoidal rule in u gives the exponentials directly:
+  //x = exp(-e^u), a = step*exp(alpha*u - e^u)/Gamma(alpha). The nodes run
+  //from where (max_loop+1)^-alpha is resolved to where m = 1 has decayed
+
+  double u_first = -log((double) max_loop + 1) - 4;
+  double u_last = 3.5;
+  double norm = PS_LOOP_STEP/tgamma(alpha);
+
+  loop.terms = 0;
+  for (int k=0; k<PS_TERMS_MAX; k++) loop.a[k] = loop.x[k] = 0;
+  for (double u = u_last; u >= u_first && loop.terms < PS_TERMS_MAX; u -= PS_LOOP_STEP)
+    {
+      loop.x[loop.terms] = exp(-exp(u));
+      loop.a[loop.terms] = norm*exp(alpha*u - exp(u));
+      loop.terms++;
+    }
+}
+
+
+
+void prepare_ps_model(const nn_params &params, double salt_conc, double sigma, double alpha, size_t max_loop, ps_model &model)
+{
+  for (int k=0; k<16; k++)
+    {
+      model.deltah[k] = params.h[k]*1000;
+      model.deltas[k] = params.s[k];
+    }
+  model.t_shift = nn_salt_term(salt_conc);
+  model.sigma = sigma;
+  fixman_freire_fit(alpha, max_loop < 1 ? 1 : max_loop, model.loop);
+}
+
+
+
+void plan_ps_chunks(size_t length, size_t chunk, size_t overlap, vector<ps_chunk> &chunks)
+{
+  chunks.clear();
+  if (length <= chunk || chunk <= 2*overlap)
+    {
+      ps_chunk whole = {0, length, 0, length};
+      chunks.push_back(whole);
+      return;
+    }
+
+  size_t core = chunk - 2*overlap;
+  for (size_t first = 0; first < length; first += core)
+    {
+      ps_chunk piece;
+      piece.core_first = first;
+      piece.core_last = min(first + core, length);
+      piece.first = first > overlap ? first - overlap : 0;
+      piece.last = min(piece.core_last + overlap, length);
+      chunks.push_back(piece);
+    }
+}
+
+
+
+template <int step>
+static void ps_partition(const unsigned char *pairs, const double *stack, const ps_model &model, long n, double *z, short *scale, double &total, int &total_scale)
+{
+  //Partition functions Z(i) of the bases before i (step 1) or after i
+  //(step -1) with pair i closed, i running from the first base in the
+  //direction of step:
+  //  Z(i) = 1 + w(i-1,i) Z(i-1) + sigma * sum_m loop(m) Z(i-m-1)
+  //The loop sum is carried by one accumulator per exponential,
+  //A_k(i+1) = x_k (A_k(i) + Z(i-1)), and is added in four independent
+  //partial sums: it is on the critical path from one base to the next.
+  //pairs[i] is the stack index of bases i-1, i (16 if it cannot stack)
+  //and the "1" is 0 for a base that cannot close (pairs[i] == 17). total
+  //is the sum of the Z(i)
+
+  const ps_loop_factor &loop = model.loop;
+  const int terms = (loop.terms + 3) & ~3;  //a = x = 0 up to PS_TERMS_MAX
+  const double big = ldexp(1.0, PS_SCALE_BITS), small = ldexp(1.0, -PS_SCALE_BITS);
+  double acc[PS_TERMS_MAX] = {0};
+  double start = 1, prev = 0, sum = 0;
+  int n_scale = 0;
+
+  long i = step > 0 ? 0 : n-1;
+  for (long count=0; count<n; count++, i+=step)
+    {
+      double part[4] = {0, 0, 0, 0};
+      for (int k=0; k<terms; k+=4)
+	for (int j=0; j<4; j++)
+	  {
+	    part[j] += loop.a[k+j]*acc[k+j];
+	    acc[k+j] = loop.x[k+j]*(acc[k+j] + prev);
+	  }
+      double loops = (part[0] + part[1]) + (part[2] + part[3]);
+
+      int p = step > 0 ? pairs[i] : (i+1 < n ? pairs[i+1] : 16);
+      double zi = pairs[i] == 17 ? 0 : start + stack[p]*prev + model.sigma*loops;
+
+      prev = zi;
+      sum += zi;
+      z[i] = zi;
+      scale[i] = n_scale;
+
+      if (zi > big)
+	{
+	  for (int k=0; k<terms; k++) acc[k] *= small;
+	  prev *= small;
+	  sum *= small;
+	  start = n_scale < 3 ? start*small : 0;  //no denormals
+	  n_scale++;
+	}
+    }
+
+  total = sum;
+  total_scale = n_scale;
+}
+
+
+
+void ps_melt_chunk(const char *sequence, const ps_chunk &chunk, const ps_model &model, int temperatures, const double *t, ps_chunk_result &result, float *tm_map)
+{
+  //For each temperature, a forward and a backward pass give the closed
+  //probability of every pair, p(i) = Zf(i) Zb(i) / Z
+
+  double R=1.987; //cal/(K mol)
+  const double big = ldexp(1.0, PS_SCALE_BITS), small = ldexp(1.0, -PS_SCALE_BITS);
+  long n = chunk.last - chunk.first;
+  long core_first = chunk.core_first - chunk.first, core_last = chunk.core_last - chunk.first;
+
+  //pairs[i]: stack of bases i-1, i; 16 if either is not A, C, G, T (and
+  //for i = 0); 17 if base i itself is not
+  vector<unsigned char> pairs(n);
+  int prev_code = -1;
+  result.pairs = 0;
+  for (long i=0; i<n; i++)
+    {
+      int code = base_code[(unsigned char) sequence[chunk.first+i]];
+      pairs[i] = code < 0 ? 17 : (prev_code < 0 ? 16 : 4*prev_code+code);
+      if (code >= 0 && i >= core_first && i < core_last) result.pairs++;
+      prev_code = code;
+    }
+
+  vector<double> zf(n), zb(n), last_p(core_last-core_first, 1.0);
+  vector<short> sf(n), sb(n);
+  result.closed.assign(temperatures, 0);
+  result.log_z.assign(temperatures, 0);
+
+  if (tm_map)
+    for (long i=core_first; i<core_last; i++) tm_map[chunk.first+i] = pairs[i] == 17 ? 0 : t[temperatures-1];
+
+  for (int k=0; k<temperatures; k++)
+    {
+      double stack[18];
+      double tk = t[k] - model.t_shift;
+      for (int d=0; d<16; d++) stack[d] = exp(-(model.deltah[d] - tk*model.deltas[d])/(R*tk));
+      stack[16] = stack[17] = 0;
+
+      double total, unused;
+      int total_scale, unused_scale;
+      ps_partition<1>(&pairs[0], stack, model, n, &zf[0], &sf[0], total, total_scale);
+      ps_partition<-1>(&pairs[0], stack, model, n, &zb[0], &sb[0], unused, unused_scale);
+      result.log_z[k] = log(total) + total_scale*PS_SCALE_BITS*log(2.0);
+
+      //Zf(i) Zb(i) and Z differ by at most a few scale steps
+      double inverse = 1/total, closed = 0;
+      for (long i=core_first; i<core_last; i++)
+	{
+	  double p = zf[i]*zb[i]*inverse;
+	  int shift = sf[i] + sb[i] - total_scale;
+	  if (shift != 0) p = shift == 1 ? p*big : shift == -1 ? p*small : ldexp(p, shift*PS_SCALE_BITS);
+	  closed += p;
+
+	  double &before = last_p[i-core_first];
+	  if (tm_map && before >= 0.5 && p < 0.5 && pairs[i] != 17)
+	    tm_map[chunk.first+i] = k == 0 ? 0 : t[k-1] + (t[k]-t[k-1])*(before-0.5)/(before-p);
+	  before = p;
+	}
+      result.closed[k] = closed;
+    }
+}
+
+
+
+void ps_melting_curve(const vector<ps_chunk> &chunks, const vector<ps_chunk_result> &results, const nn_params &params, bool any_cg, double dna_conc, int temperatures, double *theta)
+{
+  //theta = fraction of strands associated * fraction of their pairs
+  //closed. For one chunk the association constant is beta*Z with beta
+  //the initiation entropy, and the fraction of associated strands is
+  //c/(1+c+sqrt(1+2c)), c = dna_conc*beta*Z, as in the two-state curves
+  //(written with q = 1/c so that it holds for Z out of range)
+
+  double R=1.987; //cal/(K mol)
+  long pairs = 0;
+  for (size_t c=0; c<results.size(); c++) pairs += results[c].pairs;
+
+  double log_beta = ((any_cg ? params.any_cg : params.only_at) + params.non_self_compl)/R;
+
+  for (int k=0; k<temperatures; k++)
+    {
+      double closed = 0;
+      for (size_t c=0; c<results.size(); c++) closed += results[c].closed[k];
+      theta[k] = pairs > 0 ? closed/pairs : 0;
+
+      if (chunks.size() == 1)
+	{
+	  double q = exp(-(log(dna_conc) + log_beta + results[0].log_z[k]));
+	  theta[k] *= 1/(1 + q + sqrt(q*q + 2*q));
+	}
+    }
+}
+
+
+
+void ps_melt_sequence(const char *sequence, size_t length, const nn_params &params, const ps_model &model, double dna_conc, size_t chunk, size_t overlap, int temperatures, const double *t, double *theta, float *tm_map)
+{
+  vector<ps_chunk> chunks;
+  plan_ps_chunks(length, chunk, overlap, chunks);
+
+  vector<ps_chunk_result> results(chunks.size());
+  for (size_t c=0; c<chunks.size(); c++) ps_melt_chunk(sequence, chunks[c], model, temperatures, t, results[c], tm_map);
+
+  bool any_cg = false;
+  for (size_t i=0; i<length && !any_cg; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      any_cg = (code == 1 || code == 2);
+    }
+  ps_melting_curve(chunks, results, params, any_cg, dna_conc, temperatures, theta);
+}
+
+
+
+
+
+
+/***************************************  
+         Per-sequence summary
+***************************************/
+
+static int count_sequence(const char *sequence, size_t sequence_length, long counts[4], long dinucleotides[16])
+{
+  //Bases and dinucleotides of the sequence, the pass shared by
+  //summarize_sequence() and melting_batch_float()
+
+  for (int k=0; k<4; k++) counts[k] = 0;
+  for (int k=0; k<16; k++) dinucleotides[k] = 0;
+
+  int prev = -1;
+  for (size_t i=0; i<sequence_length; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      if (code >= 0)
+	{
+	  counts[code]++;
+	  if (prev >= 0) dinucleotides[4*prev+code]++;
+	}
+      else if (sequence[i] == 'U')
+	return MELTING_URACIL;
+      prev = code;
+    }
+
+  return MELTING_OK;
+}
+
+
+
+int summarize_sequence(const char *sequence, size_t sequence_length, sequence_thermo &thermo)
+{
+  //One pass over the sequence counts the bases and the dinucleotides;
+  //the sums of every model and the Khandelwal strength are then taken
+  //from the 16-entry histogram. Characters other than A, C, G, T are
+  //ignored and break the dinucleotide chain.
+  //Returns MELTING_URACIL if the sequence contains Uracil (not supported)
+
+  long counts[4], dinucleotides[16];
+  if (count_sequence(sequence, sequence_length, counts, dinucleotides) == MELTING_URACIL) return MELTING_URACIL;
+
+  summarize_composition(sequence_length, counts, dinucleotides, is_self_complementary(sequence, sequence_length), thermo);
+
+  if (counts[0] + counts[1] + counts[2] + counts[3] == 0) return MELTING_EMPTY;
+  return MELTING_OK;
+}
+
+
+
+void summarize_composition(size_t sequence_length, const long counts[4], const long dinucleotides[16], bool self_compl, sequence_thermo &thermo)
+{
+  //Summary of a sequence known by its composition (e.g. counted on a
+  //packed reference)
+
+  thermo.length = sequence_length;
+  for (int k=0; k<4; k++) thermo.counts[k] = counts[k];
+  for (int k=0; k<16; k++) thermo.dinucleotides[k] = dinucleotides[k];
+  nn_sums_from_histogram(dinucleotides, thermo.sum);
+
+  thermo.strength = 0;
+  for (int k=0; k<16; k++) thermo.strength += dinucleotides[k]*khandelwal_strength[k];
+
+  thermo.self_complementary = self_compl;
+}
+
+
+
+double gc_content(const sequence_thermo &thermo)
+{
+  //%
+  const long *counts = thermo.counts;
+  return (double(counts[1] + counts[2])/double(counts[0] + counts[1] + counts[2] + counts[3]))*100.0;
+}
+
+
+
+double molecular_weight(const sequence_thermo &thermo)
+{
+  //Da
+  const long *counts = thermo.counts;
+  return counts[0]*313.2+counts[1]*298.2+counts[2]*392.2+counts[3]*304.2;
+}
+
+
+
+double wallace_rule(const sequence_thermo &thermo)
+{
+  const long *counts = thermo.counts;
+  return wallace_rule(thermo.length, counts[0], counts[1], counts[2], counts[3]);
+}
+
+
+
+double salt(const sequence_thermo &thermo, double salt_conc)
+{
+  const long *counts = thermo.counts;
+  return salt(salt_conc, counts[0], counts[1], counts[2], counts[3]);
+}
+
+
+
+/***************************************  
+             Batch interface
+***************************************/
+
+void melting_from_thermo(const sequence_thermo &thermo, double salt_conc, double dna_conc, int methods, melting_result &result)
+{
+  //Every requested method from the summary of a sequence
+
+  result.status = MELTING_OK;
+  result.thermo = thermo;
+  result.gc_content = gc_content(thermo);
+  result.molecular_weight = molecular_weight(thermo);
+
+  if (methods & METHOD_WALLACE) result.wallace_tm = wallace_rule(thermo);
+  if (methods & METHOD_SALT) result.salt_tm = salt(thermo, salt_conc);
+  if (methods & METHOD_KHANDELWAL) result.khandelwal_tm = khandelwal(thermo, salt_conc, dna_conc);
+
+  if (methods & (METHOD_BRE | METHOD_SAN | METHOD_SUG | METHOD_CONSENSUS))
+    {
+      //The consensus averages the Tm of the models computed here
+      double nn_tm[NN_MODELS];
+      for (int m=0; m<NN_MODELS; m++)
+	nn_tm[m] = nn_melting_temperature(thermo, m, salt_conc, dna_conc);
+
+      for (int m=0; m<NN_MODELS; m++)
+	if (methods & (METHOD_BRE << m)) result.nn_tm[m] = nn_tm[m]-273.15;
+
+      if (methods & METHOD_CONSENSUS)
+	result.consensus_tm = consensus_from_tm(thermo.length, result.gc_content, nn_tm[NN_BRE], nn_tm[NN_SAN], nn_tm[NN_SUG], result.consensus_class)-273.15;
+    }
+}
+
+
+
+int melting_temperatures(const char *sequence, size_t length, double salt_conc, double dna_conc, int methods, melting_result &result)
+{
+  //Every requested method for one sequence, from a single pass over it
+
+  result = melting_result();
+
+  result.status = summarize_sequence(sequence, length, result.thermo);
+  if (result.status != MELTING_OK) return result.status;
+
+  melting_from_thermo(result.thermo, salt_conc, dna_conc, methods, result);
+  return result.status;
+}
+
+
+
+size_t melting_batch(const melting_batch_input &input, const melting_batch_output &output, size_t first, size_t last)
+{
+  //One sequence at a time through melting_temperatures(), results
+  //scattered to the output arrays
+
+  size_t computed = 0;
+  melting_result result;
+
+  for (size_t i=first; i<last; i++)
+    {
+      const char *sequence = input.sequences[i];
+      size_t length = input.lengths ? input.lengths[i] : strlen(sequence);
+      double salt_conc = input.salt_conc ? input.salt_conc[i] : input.default_salt;
+      double dna_conc = input.dna_conc ? input.dna_conc[i] : input.default_dna;
+
+      if (melting_temperatures(sequence, length, salt_conc, dna_conc, input.methods, result) == MELTING_OK) computed++;
+
+      if (output.status) output.status[i] = result.status;
+      if (output.gc_content) output.gc_content[i] = result.gc_content;
+      if (output.molecular_weight) output.molecular_weight[i] = result.molecular_weight;
+      if (output.wallace_tm) output.wallace_tm[i] = result.wallace_tm;
+      if (output.salt_tm) output.salt_tm[i] = result.salt_tm;
+      if (output.khandelwal_tm) output.khandelwal_tm[i] = result.khandelwal_tm;
+      for (int m=0; m<NN_MODELS; m++)
+	{
+	  if (output.nn_tm[m]) output.nn_tm[m][i] = result.nn_tm[m];
+	  if (output.deltah[m]) output.deltah[m][i] = result.thermo.sum.deltah[m];
+	  if (output.deltas[m]) output.deltas[m][i] = result.thermo.sum.deltas[m];
+	}
+      if (output.consensus_tm) output.consensus_tm[i] = result.consensus_tm;
+      if (output.consensus_class) output.consensus_class[i] = result.consensus_class;
+    }
+
+  return computed;
+}
+
+
+
+size_t melting_batch(const melting_batch_input &input, const melting_batch_output &output)
+{
+  return melting_batch(input, output, 0, input.count);
+}
+
+
+
+size_t melting_batch_float(const melting_batch_input &input, const melting_batch_float_output &output, size_t first, size_t last)
+{
+  //The sequences of a block are counted one by one into a
+  //struct-of-arrays histogram, then every model runs over the block with
+  //the sequence as the vectorized index: the sums, the initiation and
+  //symmetry corrections, the condition terms and the Tm are float lanes.
+  //Sequences that are not MELTING_OK get 0 as in melting_batch()
+
+  const int block = FLOAT_BATCH_BLOCK;
+  const float R=1.987f; //cal/(K mol)
+
+  float histogram[16][FLOAT_BATCH_BLOCK];
+  float any_cg[FLOAT_BATCH_BLOCK], self_compl[FLOAT_BATCH_BLOCK], valid[FLOAT_BATCH_BLOCK];
+  float dna_term[FLOAT_BATCH_BLOCK], salt_term[FLOAT_BATCH_BLOCK];
+  float deltah[FLOAT_BATCH_BLOCK], deltas[FLOAT_BATCH_BLOCK], tm[FLOAT_BATCH_BLOCK];
+
+  //Condition terms shared by the whole batch when there are no per
+  //sequence arrays
+  float default_salt_term = 16.6f*log10f((float) input.default_salt);
+  float default_dna_log = logf((float) input.default_dna);
+  const float log4 = logf(4.0f);
+
+  size_t computed = 0;
+  long counts[4], dinucleotides[16];
+
+  for (size_t b=first; b<last; b+=block)
+    {
+      int n = last-b < (size_t) block ? int(last-b) : block;
+
+      for (int j=0; j<n; j++)
+	{
+	  size_t i = b+j;
+	  const char *sequence = input.sequences[i];
+	  size_t length = input.lengths ? input.lengths[i] : strlen(sequence);
+
+	  int status = count_sequence(sequence, length, counts, dinucleotides);
+	  if (status == MELTING_OK && counts[0] + counts[1] + counts[2] + counts[3] == 0) status = MELTING_EMPTY;
+	  if (output.status) output.status[i] = status;
+	  if (status == MELTING_OK) computed++;
+	  else for (int k=0; k<16; k++) dinucleotides[k] = 0;
+
+	  for (int k=0; k<16; k++) histogram[k][j] = (float) dinucleotides[k];
+	  bool self = status == MELTING_OK && is_self_complementary(sequence, length);
+	  any_cg[j] = counts[1] != 0 || counts[2] != 0 ? 1.0f : 0.0f;
+	  self_compl[j] = self ? 1.0f : 0.0f;
+	  valid[j] = status == MELTING_OK ? 1.0f : 0.0f;
+
+	  //R ln(dna_conc/b) and 16.6 log10(salt_conc)
+	  float dna_log = input.dna_conc ? logf((float) input.dna_conc[i]) : default_dna_log;
+	  dna_term[j] = R*(self ? dna_log : dna_log - log4);
+	  salt_term[j] = input.salt_conc ? 16.6f*log10f((float) input.salt_conc[i]) : default_salt_term;
+	}
+
+      for (int m=0; m<NN_MODELS; m++)
+	{
+	  if (!(input.methods & (METHOD_BRE << m))) continue;
+
+	  const nn_params &params = *nn_models[m];
+	  float h_table[16], s_table[16];
+	  for (int k=0; k<16; k++)
+	    {
+	      h_table[k] = (float) params.h[k];
+	      s_table[k] = (float) params.s[k];
+	    }
+	  float only_at = (float) params.only_at, cg_step = float(params.any_cg - params.only_at);
+	  float non_self = (float) params.non_self_compl, self_step = float(params.simm_corr - params.non_self_compl);
+
+	  for (int j=0; j<n; j++) deltah[j] = deltas[j] = 0;
+	  for (int k=0; k<16; k++)
+	    {
+	      float hk = h_table[k], sk = s_table[k];
+	      const float *count = histogram[k];
+	      for (int j=0; j<n; j++)
+		{
+		  deltah[j] += count[j]*hk;
+		  deltas[j] += count[j]*sk;
+		}
+	    }
+
+	  for (int j=0; j<n; j++)
+	    {
+	      float den = deltas[j] + only_at + any_cg[j]*cg_step + non_self + self_compl[j]*self_step + dna_term[j];
+	      float t = deltah[j]*1000.0f/den + salt_term[j] - 273.15f;
+	      tm[j] = valid[j]*t + 0.0f;  //+0, not -0, when not valid
+	    }
+
+	  if (output.nn_tm[m]) memcpy(output.nn_tm[m] + b, tm, n*sizeof(float));
+	  if (output.deltah[m]) memcpy(output.deltah[m] + b, deltah, n*sizeof(float));
+	  if (output.deltas[m]) memcpy(output.deltas[m] + b, deltas, n*sizeof(float));
+	}
+    }
+
+  return computed;
+}
+
+
+
+size_t melting_batch_float(const melting_batch_input &input, const melting_batch_float_output &output)
+{
+  return melting_batch_float(input, output, 0, input.count);
+}
+
+
+
+/***************************************  
+            Condition sweep
+***************************************/
+
+void prepare_sweep(const vector<double> &salt_conc, const vector<double> &dna_conc, sweep_conditions &conditions)
+{
+  conditions.salt_conc = salt_conc;
+  conditions.dna_conc = dna_conc;
+  conditions.salt_term.resize(salt_conc.size());
+  for (size_t i=0; i<salt_conc.size(); i++) conditions.salt_term[i] = nn_salt_term(salt_conc[i]);
+  for (int self_compl=0; self_compl<2; self_compl++)
+    {
+      conditions.dna_term[self_compl].resize(dna_conc.size());
+      for (size_t j=0; j<dna_conc.size(); j++) conditions.dna_term[self_compl][j] = nn_dna_term(dna_conc[j], self_compl);
+    }
+}
+
+
+
+int melting_sweep(const sequence_thermo &thermo, int methods, const sweep_conditions &conditions, double *tm)
+{
+  //The sequence terms come from the summary; each NN model then costs
+  //one division and one addition per condition. Values are the same as
+  //melting_from_thermo() at each condition
+
+  const size_t salts = conditions.salt_conc.size(), dnas = conditions.dna_conc.size();
+  const size_t n = salts*dnas;
+  bool any_cg = thermo.counts[1]!=0 || thermo.counts[2]!=0;
+  bool self_compl = thermo.self_complementary;
+  const double *salt_term = &conditions.salt_term[0];
+  const double *dna_term = &conditions.dna_term[self_compl][0];
+  int blocks = 0;
+
+  if (methods & METHOD_WALLACE)
+    {
+      double value = wallace_rule(thermo);
+      for (size_t k=0; k<n; k++) tm[k] = value;
+      tm += n;
+      blocks++;
+    }
+  if (methods & METHOD_SALT)
+    {
+      for (size_t i=0; i<salts; i++)
+	{
+	  double value = salt(thermo, conditions.salt_conc[i]);
+	  for (size_t j=0; j<dnas; j++) tm[i*dnas+j] = value;
+	}
+      tm += n;
+      blocks++;
+    }
+  if (methods & METHOD_KHANDELWAL)
+    {
+      for (size_t i=0; i<salts; i++)
+	for (size_t j=0; j<dnas; j++)
+	  tm[i*dnas+j] = khandelwal(thermo, conditions.salt_conc[i], conditions.dna_conc[j]);
+      tm += n;
+      blocks++;
+    }
+
+  if (!(methods & (METHOD_BRE | METHOD_SAN | METHOD_SUG | METHOD_CONSENSUS))) return blocks;
+
+  //Models not requested but needed by the consensus go to scratch space
+  vector<double> scratch;
+  if (methods & METHOD_CONSENSUS) scratch.resize(NN_MODELS*n);
+  double *nn_tm[NN_MODELS];
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      if (methods & (METHOD_BRE << m))
+	{
+	  nn_tm[m] = tm;
+	  tm += n;
+	  blocks++;
+	}
+      else if (methods & METHOD_CONSENSUS) nn_tm[m] = &scratch[m*n];
+      else nn_tm[m] = 0;
+    }
+
+  const nn_sum &sum = thermo.sum;
+  if (nn_tm[NN_BRE]) nn_kernel<bre_model>().melting_temperatures(sum.deltah[NN_BRE], sum.deltas[NN_BRE], self_compl, any_cg, salt_term, salts, dna_term, dnas, nn_tm[NN_BRE]);
+  if (nn_tm[NN_SAN]) nn_kernel<san_model>().melting_temperatures(sum.deltah[NN_SAN], sum.deltas[NN_SAN], self_compl, any_cg, salt_term, salts, dna_term, dnas, nn_tm[NN_SAN]);
+  if (nn_tm[NN_SUG]) nn_kernel<sug_model>().melting_temperatures(sum.deltah[NN_SUG], sum.deltas[NN_SUG], self_compl, any_cg, salt_term, salts, dna_term, dnas, nn_tm[NN_SUG]);
+
+  if (methods & METHOD_CONSENSUS)
+    {
+      double gc = gc_content(thermo);
+      int consensus_class;
+      for (size_t k=0; k<n; k++)
+	tm[k] = consensus_from_tm(thermo.length, gc, nn_tm[NN_BRE][k], nn_tm[NN_SAN][k], nn_tm[NN_SUG][k], consensus_class)-273.15;
+      blocks++;
+    }
+
+  for (int m=0; m<NN_MODELS; m++)
+    if (methods & (METHOD_BRE << m))
+      for (size_t k=0; k<n; k++) nn_tm[m][k] -= 273.15;
+
+  return blocks;
+}
+
+
+
+/***************************************  
+              Primer search
+***************************************/
+
+struct primer_template
+{
+  //Prefix sums over the template, so that every candidate window costs
+  //O(1) whatever its length. Index i covers the bases before i; the
+  //stacks of a window [s, e) are nn[e] - nn[s+1]
+
+  vector<double> deltah[NN_MODELS];
+  vector<double> deltas[NN_MODELS];
+  vector<int> gc;
+  vector<int> invalid;     //characters other than A, C, G, T
+  vector<int> long_runs;   //bases ending a run of one base longer than max_run
+};
+
+
+
+static void prepare_primer_template(const char *sequence, size_t length, int max_run, primer_template &prefix)
+{
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      prefix.deltah[m].assign(length+1, 0.0);
+      prefix.deltas[m].assign(length+1, 0.0);
+    }
+  prefix.gc.assign(length+1, 0);
+  prefix.invalid.assign(length+1, 0);
+  prefix.long_runs.assign(length+1, 0);
+
+  int prev = -1;
+  long run = 0;
+  for (size_t i=0; i<length; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      run = (code >= 0 && code == prev) ? run+1 : 1;
+
+      prefix.gc[i+1] = prefix.gc[i] + (code == 1 || code == 2);
+      prefix.invalid[i+1] = prefix.invalid[i] + (code < 0);
+      prefix.long_runs[i+1] = prefix.long_runs[i] + (max_run > 0 && code >= 0 && run > max_run);
+
+      if (i > 0)
+	for (int m=0; m<NN_MODELS; m++)
+	  {
+	    bool stack = (prev | code) >= 0;
+	    prefix.deltah[m][i+1] = prefix.deltah[m][i] + (stack ? nn_models[m]->h[4*prev+code] : 0);
+	    prefix.deltas[m][i+1] = prefix.deltas[m][i] + (stack ? nn_models[m]->s[4*prev+code] : 0);
+	  }
+      prev = code;
+    }
+}
+
+
+
+static bool better_primer(const primer_candidate &a, const primer_candidate &b)
+{
+  if (a.penalty != b.penalty) return a.penalty < b.penalty;
+  if (a.start != b.start) return a.start < b.start;
+  return a.length < b.length;
+}
+
+
+
+static bool better_pair(const primer_pair &a, const primer_pair &b)
+{
+  if (a.penalty != b.penalty) return a.penalty < b.penalty;
+  if (a.forward.start != b.forward.start) return a.forward.start < b.forward.start;
+  if (a.reverse.start != b.reverse.start) return a.reverse.start < b.reverse.start;
+  if (a.forward.length != b.forward.length) return a.forward.length < b.forward.length;
+  return a.reverse.length < b.reverse.length;
+}
+
+
+
+template <class T, class Better>
+static void keep_best(vector<T> &heap, size_t top, const T &item, Better better)
+{
+  //Bounded heap of the "top" best items, the worst one at the front
+
+  if (heap.size() < top)
+    {
+      heap.push_back(item);
+      push_heap(heap.begin(), heap.end(), better);
+    }
+  else if (top > 0 && better(item, heap.front()))
+    {
+      pop_heap(heap.begin(), heap.end(), better);
+      heap.back() = item;
+      push_heap(heap.begin(), heap.end(), better);
+    }
+}
+
+
+
+size_t find_primers(const char *sequence, size_t length, const primer_constraints &constraints, size_t top, vector<primer_candidate> &forward, vector<primer_candidate> &reverse)
+{
+  //Every window of min_length..max_length bases is checked from the
+  //cheapest constraint to the most expensive. A window containing an
+  //invalid character or a long run rules out all the longer windows at
+  //the same start. Self-complementarity is checked directly: it almost
+  //always stops at the first pair of bases
+
+  const primer_constraints &c = constraints;
+  primer_template prefix;
+  prepare_primer_template(sequence, length, c.max_run, prefix);
+
+  forward.clear();
+  reverse.clear();
+  size_t found = 0;
+
+  for (size_t s=0; s+c.min_length<=length; s++)
+    for (int l=c.min_length; l<=c.max_length && s+l<=length; l++)
+      {
+	size_t e = s+l;
+	if (prefix.invalid[e] != prefix.invalid[s]) break;
+	if (c.max_run > 0 && e > s+c.max_run && prefix.long_runs[e] != prefix.long_runs[s+c.max_run]) break;
+
+	int gc = prefix.gc[e] - prefix.gc[s];
+	double gc_content = 100.0*gc/l;
+	if (gc_content < c.gc_min || gc_content > c.gc_max) continue;
+
+	//3' end of the forward primer is the end of the window, of the
+	//reverse primer its start
+	size_t clamp = l < PRIMER_CLAMP_BASES ? l : PRIMER_CLAMP_BASES;
+	int forward_clamp = prefix.gc[e] - prefix.gc[e-clamp];
+	int reverse_clamp = prefix.gc[s+clamp] - prefix.gc[s];
+	bool forward_ok = (c.strands & PRIMER_FORWARD) && forward_clamp >= c.clamp_min && forward_clamp <= c.clamp_max;
+	bool reverse_ok = (c.strands & PRIMER_REVERSE) && reverse_clamp >= c.clamp_min && reverse_clamp <= c.clamp_max;
+	if (!forward_ok && !reverse_ok) continue;
+
+	//The NN tables are symmetric: the reverse complement has the same
+	//stacks, and the same Tm
+	primer_candidate candidate;
+	bool self_compl = is_self_complementary(sequence+s, l);
+	bool in_window = true;
+	candidate.penalty = 0;
+	for (int m=0; m<NN_MODELS && in_window; m++)
+	  {
+	    double deltah = prefix.deltah[m][e] - prefix.deltah[m][s+1];
+	    double deltas = prefix.deltas[m][e] - prefix.deltas[m][s+1];
+	    candidate.tm[m] = nn_melting_temperature(*nn_models[m], deltah, deltas, self_compl, gc > 0, c.salt_conc, c.dna_conc)-273.15;
+
+	    if (!(c.tm_models & (1 << m))) continue;
+	    if (candidate.tm[m] < c.tm_min[m] || candidate.tm[m] > c.tm_max[m]) in_window = false;
+	    candidate.penalty += fabs(candidate.tm[m] - 0.5*(c.tm_min[m]+c.tm_max[m]));
+	  }
+	if (!in_window) continue;
+
+	candidate.start = s;
+	candidate.length = l;
+	candidate.gc_content = gc_content;
+	if (forward_ok)
+	  {
+	    candidate.strand = PRIMER_FORWARD;
+	    keep_best(forward, top, candidate, better_primer);
+	    found++;
+	  }
+	if (reverse_ok)
+	  {
+	    candidate.strand = PRIMER_REVERSE;
+	    keep_best(reverse, top, candidate, better_primer);
+	    found++;
+	  }
+      }
+
+  sort_heap(forward.begin(), forward.end(), better_primer);
+  sort_heap(reverse.begin(), reverse.end(), better_primer);
+  return found;
+}
+
+
+
+static bool primer_before(const primer_candidate &a, const primer_candidate &b)
+{
+  return a.start < b.start;
+}
+
+
+
+void pair_primers(const vector<primer_candidate> &forward, const vector<primer_candidate> &reverse, const primer_constraints &constraints, size_t top, vector<primer_pair> &pairs)
+{
+  //Reverse primers are sorted by start, so each forward primer only
+  //looks at those starting after it and within product_max bases.
+  //The Tm difference is taken on the models with a Tm window (all of
+  //them if none has one)
+
+  const primer_constraints &c = constraints;
+  int models = c.tm_models ? c.tm_models : (1 << NN_MODELS) - 1;
+
+  vector<primer_candidate> by_start(reverse);
+  sort(by_start.begin(), by_start.end(), primer_before);
+
+  pairs.clear();
+  for (size_t i=0; i<forward.size(); i++)
+    {
+      const primer_candidate &f = forward[i];
+      primer_candidate first = f;
+      first.start = f.start + f.length;
+
+      for (vector<primer_candidate>::const_iterator r = lower_bound(by_start.begin(), by_start.end(), first, primer_before);
+	   r != by_start.end() && (long) (r->start - f.start) < c.product_max; ++r)
+	{
+	  long product = r->start + r->length - f.start;
+	  if (product < c.product_min || product > c.product_max) continue;
+
+	  double tm_diff = 0;
+	  for (int m=0; m<NN_MODELS; m++)
+	    if (models & (1 << m)) tm_diff = max(tm_diff, fabs(f.tm[m] - r->tm[m]));
+	  if (tm_diff > c.max_tm_diff) continue;
+
+	  primer_pair pair;
+	  pair.forward = f;
+	  pair.reverse = *r;
+	  pair.product = product;
+	  pair.penalty = f.penalty + r->penalty + tm_diff;
+	  keep_best(pairs, top, pair, better_pair);
+	}
+    }
+
+  sort_heap(pairs.begin(), pairs.end(), better_pair);
+}
+
+
+
+/***************************************  
+    Mismatched duplexes, off-targets
+***************************************/
+
+//Single internal mismatches, top 5'-XY-3' / bottom 3'-X'Y'-5', deltaH
+//(kcal/mol) and deltaS (cal/(K mol)). Allawi and SantaLucia, 1997-1998,
+//and Peyret, Seneviratne, Allawi and SantaLucia, 1999
+struct mismatch_stack
+{
+  const char *stack;
+  double h;
+  double s;
+};
+
+static const mismatch_stack mismatch_stacks[48] = {
+  //G.T
+  {"AG/TT", 1.0, 0.9}, {"AT/TG", -2.5, -8.3}, {"CG/GT", -4.1, -11.7}, {"CT/GG", -2.8, -8.0},
+  {"GG/CT", 3.3, 10.4}, {"GT/CG", -4.4, -12.3}, {"TG/AT", -0.1, -1.7}, {"TT/AG", -1.3, -5.3},
+  //G.A
+  {"AA/TG", -0.6, -2.3}, {"AG/TA", -0.7, -2.3}, {"CA/GG", -0.7, -2.3}, {"CG/GA", -4.0, -13.2},
+  {"GA/CG", -0.6, -1.0}, {"GG/CA", 0.5, 3.2}, {"TA/AG", 0.7, 0.7}, {"TG/AA", 3.0, 7.4},
+  //C.T
+  {"AC/TT", 0.7, 0.2}, {"AT/TC", -1.2, -6.2}, {"CC/GT", -0.8, -4.5}, {"CT/GC", -1.5, -6.1},
+  {"GC/CT", 2.3, 5.4}, {"GT/CC", 5.2, 13.5}, {"TC/AT", 1.2, 0.7}, {"TT/AC", 1.0, 0.7},
+  //A.C
+  {"AA/TC", 2.3, 4.6}, {"AC/TA", 5.3, 14.6}, {"CA/GC", 1.9, 3.7}, {"CC/GA", 0.6, -0.6},
+  {"GA/CC", 5.2, 14.2}, {"GC/CA", -0.7, -3.8}, {"TA/AC", 3.4, 8.0}, {"TC/AA", 7.6, 20.2},
+  //A.A, C.C, G.G, T.T
+  {"AA/TA", 1.2, 1.7}, {"CA/GA", -0.9, -4.2}, {"GA/CA", -2.9, -9.8}, {"TA/AA", 4.7, 12.9},
+  {"AC/TC", 0.0, -4.4}, {"CC/GC", -1.5, -7.2}, {"GC/CC", 3.6, 8.9}, {"TC/AC", 6.1, 16.4},
+  {"AG/TG", -3.1, -9.5}, {"CG/GG", -4.9, -15.3}, {"GG/CG", -6.0, -15.8}, {"TG/AG", 1.6, 3.6},
+  {"AT/TT", -2.7, -10.8}, {"CT/GT", -5.0, -15.8}, {"GT/CT", -2.2, -8.4}, {"TT/AT", 0.2, -1.5}
+};
+
+
+static inline int duplex_stack(int x, int y, int xb, int yb)
+{
+  return 64*x+16*y+4*xb+yb;
+}
+
+
+
+void mismatch_duplex_params(const nn_params &params, nn_duplex_params &duplex)
+{
+  //A stack read from the other strand is the same stack: XY/X'Y' is also
+  //Y'X'/YX
+
+  duplex.params = &params;
+  for (int k=0; k<256; k++)
+    {
+      duplex.h[k] = duplex.s[k] = 0;
+      duplex.known[k] = false;
+    }
+
+  for (int x=0; x<4; x++)
+    for (int y=0; y<4; y++)
+      {
+	int k = duplex_stack(x, y, 3-x, 3-y);
+	duplex.h[k] = params.h[4*x+y];
+	duplex.s[k] = params.s[4*x+y];
+	duplex.known[k] = true;
+      }
+
+  for (int m=0; m<48; m++)
+    {
+      const char *stack = mismatch_stacks[m].stack;
+      int x = base_code[(unsigned char) stack[0]], y = base_code[(unsigned char) stack[1]];
+      int xb = base_code[(unsigned char) stack[3]], yb = base_code[(unsigned char) stack[4]];
+      int keys[2] = {duplex_stack(x, y, xb, yb), duplex_stack(yb, xb, y, x)};
+      for (int r=0; r<2; r++)
+	{
+	  duplex.h[keys[r]] = mismatch_stacks[m].h;
+	  duplex.s[keys[r]] = mismatch_stacks[m].s;
+	  duplex.known[keys[r]] = true;
+	}
+    }
+}
+
+
+
+double duplex_melting_temperature(const nn_duplex_params &duplex, const unsigned char *probe, const unsigned char *site, int length, double salt_conc, double dna_conc, double &deltah, double &deltas)
+{
+  //Unknown stacks (tandem mismatches, N) add nothing: the duplex is only
+  //held by the stacks around them
+
+  int first = 0, last = length-1;
+  while (first <= last && probe[first] != site[first]) first++;
+  while (last >= first && probe[last] != site[last]) last--;
+
+  deltah = deltas = 0;
+  if (last - first < 1) return 0;
+
+  bool any_cg = false;
+  for (int i=first; i<=last; i++)
+    if (probe[i] == site[i] && (probe[i] == 1 || probe[i] == 2)) any_cg = true;
+
+  for (int i=first; i<last; i++)
+    {
+      if (site[i] >= REF_OTHER || site[i+1] >= REF_OTHER) continue;
+      int k = duplex_stack(probe[i], probe[i+1], 3-site[i], 3-site[i+1]);
+      deltah += duplex.h[k];
+      deltas += duplex.s[k];
+    }
+
+  //A probe and its target are two different strands
+  return nn_melting_temperature(*duplex.params, deltah, deltas, false, any_cg, salt_conc, dna_conc);
+}
+
+
+
+void add_reference_record(reference_genome &reference, const string &name, const char *sequence, size_t length)
+{
+  if (reference.starts.empty()) reference.starts.push_back(0);
+
+  reference.names.push_back(name);
+  size_t start = reference.codes.size();
+  reference.codes.resize(start + length);
+  for (size_t i=0; i<length; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      reference.codes[start+i] = code < 0 ? REF_OTHER : code;
+    }
+  reference.starts.push_back(reference.codes.size());
+}
+
+
+
+bool build_seed_index(const reference_genome &reference, int k, seed_index &index)
+{
+  //Counting pass, prefix sums, filling pass: two linear scans with a
+  //rolling k-mer code
+
+  const vector<unsigned char> &codes = reference.codes;
+  if (codes.size() >= 0xffffffffULL) return false;
+
+  size_t buckets = (size_t) 1 << (2*k);
+  unsigned int mask = buckets - 1;
+  index.k = k;
+  index.offsets.assign(buckets+1, 0);
+
+  for (int pass=0; pass<2; pass++)
+    {
+      if (pass == 1)
+	{
+	  for (size_t b=0; b<buckets; b++) index.offsets[b+1] += index.offsets[b];
+	  index.positions.resize(index.offsets[buckets]);
+	}
+      vector<unsigned int> fill(index.offsets.begin(), index.offsets.end()-1);
+
+      for (size_t r=0; r+1<reference.starts.size(); r++)
+	{
+	  unsigned int code = 0;
+	  int valid = 0;
+	  for (size_t i=reference.starts[r]; i<reference.starts[r+1]; i++)
+	    {
+	      if (codes[i] >= REF_OTHER)
+		{
+		  valid = 0;
+		  continue;
+		}
+	      code = ((code << 2) | codes[i]) & mask;
+	      if (++valid < k) continue;
+
+	      if (pass == 0) index.offsets[code+1]++;
+	      else index.positions[fill[code]++] = i+1-k;
+	    }
+	}
+    }
+
+  return true;
+}
+
+
+
+static bool offtarget_before(const offtarget_site &a, const offtarget_site &b)
+{
+  if (a.record != b.record) return a.record < b.record;
+  if (a.start != b.start) return a.start < b.start;
+  return a.strand < b.strand;
+}
+
+
+
+long find_offtargets(const reference_genome &reference, const seed_index &index, const nn_duplex_params &duplex, const char *probe, size_t length, int max_mismatches, double min_tm, double salt_conc, double dna_conc, vector<offtarget_site> &sites)
+{
+  //Pigeonhole: a site with at most N mismatches matches at least one of
+  //N+1 disjoint seeds of the probe exactly. Seeds are looked up on both
+  //strands; a site is only verified from its first exact seed, so each
+  //one is scored once
+
+  const int k = index.k;
+  const size_t segment = length/(max_mismatches+1);
+  sites.clear();
+  if (segment < (size_t) k || length < 2) return -1;
+
+  vector<unsigned char> codes(length), query(length), site(length);
+  for (size_t i=0; i<length; i++)
+    {
+      int code = base_code[(unsigned char) probe[i]];
+      if (code < 0) return -1;
+      codes[i] = code;
+    }
+
+  static const char letters[5] = {'A', 'C', 'G', 'T', 'N'};
+  const vector<unsigned char> &ref = reference.codes;
+
+  for (int strand=0; strand<2; strand++)
+    {
+      //The window of a '-' site reads as the reverse complement
+      for (size_t i=0; i<length; i++) query[i] = strand == 0 ? codes[i] : 3-codes[length-1-i];
+
+      for (int j=0; j<=max_mismatches; j++)
+	{
+	  size_t offset = j*segment;
+	  unsigned int seed = 0;
+	  for (int b=0; b<k; b++) seed = (seed << 2) | query[offset+b];
+
+	  for (unsigned int h=index.offsets[seed]; h<index.offsets[seed+1]; h++)
+	    {
+	      size_t position = index.positions[h];
+	      if (position < offset) continue;
+	      size_t start = position - offset;
+	      size_t record = upper_bound(reference.starts.begin(), reference.starts.end(), start) - reference.starts.begin() - 1;
+	      if (start + length > reference.starts[record+1]) continue;
+
+	      bool seen = false;
+	      for (int e=0; e<j && !seen; e++)
+		seen = memcmp(&ref[start + e*segment], &query[e*segment], k) == 0;
+	      if (seen) continue;
+
+	      int mismatches = 0;
+	      for (size_t i=0; i<length && mismatches<=max_mismatches; i++) mismatches += ref[start+i] != query[i];
+	      if (mismatches > max_mismatches) continue;
+
+	      for (size_t i=0; i<length; i++)
+		{
+		  unsigned char code = strand == 0 ? ref[start+i] : ref[start+length-1-i];
+		  site[i] = (strand == 0 || code >= REF_OTHER) ? code : 3-code;
+		}
+
+	      offtarget_site hit;
+	      hit.tm = duplex_melting_temperature(duplex, &codes[0], &site[0], length, salt_conc, dna_conc, hit.deltah, hit.deltas) - 273.15;
+	      if (hit.tm < min_tm) continue;
+
+	      hit.record = record;
+	      hit.start = start - reference.starts[record];
+	      hit.strand = strand == 0 ? '+' : '-';
+	      hit.mismatches = mismatches;
+	      hit.site.resize(length);
+	      for (size_t i=0; i<length; i++) hit.site[i] = letters[site[i]];
+	      sites.push_back(hit);
+	    }
+	}
+    }
+
+  sort(sites.begin(), sites.end(), offtarget_before);
+  return sites.size();
+}
+
+
+
+
+
+
+/***************************************  
+      Secondary structure (hairpins)
+***************************************/
+
+//Loop free energies at 37 C (kcal/mol) by number of unpaired bases,
+//SantaLucia and Hicks, 2004; 0 where the length is not tabulated.
+//Longer loops are extrapolated from the longest tabulated one below them
+//with the Jacobson-Stockmayer entropy, 2.44 R T ln(n/n0)
+static const double hairpin_loop_g37[HAIRPIN_MAX_LOOP+1] = {
+  0, 0, 0, 3.5, 3.5, 3.3, 4.0, 4.2, 4.3, 4.5, 4.6, 0, 5.0, 0, 5.1, 0, 5.3, 0, 5.5, 0, 5.7,
+  0, 0, 0, 0, 6.1, 0, 0, 0, 0, 6.3
+};
+static const double bulge_loop_g37[HAIRPIN_MAX_INTERNAL+1] = {0, 4.0, 2.9, 3.1, 3.2, 3.3, 3.5, 3.7, 3.9};
+static const double internal_loop_g37[HAIRPIN_MAX_INTERNAL+1] = {0, 0, 0, 3.2, 3.6, 4.0, 4.4, 4.6, 4.8};
+
+//Internal loop asymmetry, per unpaired base of difference, and terminal
+//A-T penalty (deltaH kcal/mol, deltaS cal/(K mol))
+#define LOOP_ASYMMETRY_G37 0.3
+#define TERMINAL_AT_H      2.2
+#define TERMINAL_AT_S      6.9
+
+//Cells that cannot pair
+#define HAIRPIN_INF 1e30
+
+
+static void loop_energies(const double *table, int longest, double temperature, double *g)
+{
+  //Loop terms are entropic: deltaG(T) = deltaG37*T/310.15
+  double R=1.987; //cal/(K mol)
+  int known = 0;
+  for (int n=1; n<=longest; n++)
+    {
+      if (table[n] > 0) known = n;
+      double g37 = known == 0 ? 0 : table[n] > 0 ? table[n] : table[known] + 2.44*R*310.15*log((double) n/known)/1000;
+      g[n] = g37*temperature/310.15;
+    }
+  g[0] = 0;
+}
+
+
+
+void prepare_hairpin_model(const nn_params &params, double temperature, int band, hairpin_model &model)
+{
+  mismatch_duplex_params(params, model.duplex);
+  model.temperature = temperature;
+  model.band = band;
+  loop_energies(hairpin_loop_g37, HAIRPIN_MAX_LOOP, temperature, model.hairpin_g);
+  loop_energies(bulge_loop_g37, HAIRPIN_MAX_INTERNAL, temperature, model.bulge_g);
+  loop_energies(internal_loop_g37, HAIRPIN_MAX_INTERNAL, temperature, model.internal_g);
+  model.asymmetry_g = LOOP_ASYMMETRY_G37*temperature/310.15;
+  model.terminal_at_h = TERMINAL_AT_H;
+  model.terminal_at_g = TERMINAL_AT_H - temperature*TERMINAL_AT_S/1000;
+}
+
+
+
+static inline void keep_lower(long cells, double *g, double *h, const double *inner_g, const double *inner_h, double loop_g, const double *outer_term_g, const double *outer_term_h, const double *inner_term_g, const double *inner_term_h)
+{
+  //g[i] = min(g[i], inner_g[i] + loop_g + outer_term_g[i] + inner_term_g[i]),
+  //h follows g. Written without branches so that it is vectorized
+  for (long i=0; i<cells; i++)
+    {
+      double cg = inner_g[i] + loop_g + outer_term_g[i] + inner_term_g[i];
+      double ch = inner_h[i] + outer_term_h[i] + inner_term_h[i];
+      bool lower = cg < g[i];
+      g[i] = lower ? cg : g[i];
+      h[i] = lower ? ch : h[i];
+    }
+}
+
+
+
+bool find_hairpin(const char *sequence, size_t length, const hairpin_model &model, double salt_conc, hairpin_workspace &work, hairpin_result &result)
+{
+  //g(i,j): lowest deltaG of a stem-loop whose outermost pair is (i,j),
+  //computed diagonal by diagonal (d = j-i) from the shorter ones:
+  //  hairpin loop of d-1 bases closed by (i,j)
+  //  stack on (i+1,j-1)
+  //  bulge or internal loop of a bases on the 5' side and b on the 3'
+  //  side, inner pair (i+1+a, j-1-b), 1 <= a+b <= HAIRPIN_MAX_INTERNAL;
+  //  a 1x1 loop is a single mismatch (two mismatch stacks), a 1-base
+  //  bulge keeps the stack of the pairs around it, longer loops take
+  //  their length term and the A-T penalty of the two helix ends
+  //Then cells whose bases do not pair are reset. Per-base terms are laid
+  //out so that every candidate is a contiguous loop over i
+
+  const double T = model.temperature;
+  const nn_params &params = *model.duplex.params;
+  long n = length;
+
+  result.deltag = result.deltah = result.deltas = result.tm = 0;
+  result.first = result.last = -1;
+  long band = min((long) model.band, n-1);
+  if (band < HAIRPIN_MIN_LOOP+1) return false;
+
+  //codes: A=0, C=1, G=2, T=3, anything else 8 (pairs with nothing)
+  work.codes.resize(n+2);
+  for (long i=0; i<n; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      work.codes[i] = code < 0 ? 8 : code;
+    }
+  work.codes[n] = work.codes[n+1] = 8;
+  const unsigned char *c = &work.codes[0];
+
+  //per base i: stack (i,i+1), 1-base bulge stack (i,i+2), A-T penalty
+  work.per_base.assign(6*n, 0);
+  double *stack_g = &work.per_base[0], *stack_h = stack_g+n;
+  double *skip_g = stack_h+n, *skip_h = skip_g+n;
+  double *at_g = skip_h+n, *at_h = at_g+n;
+  for (long i=0; i<n; i++)
+    {
+      if (c[i] < 4 && c[i+1] < 4)
+	{
+	  int k = 4*c[i]+c[i+1];
+	  stack_h[i] = params.h[k];
+	  stack_g[i] = params.h[k] - T*params.s[k]/1000;
+	}
+      if (c[i] < 4 && c[i+2] < 4)
+	{
+	  int k = 4*c[i]+c[i+2];
+	  skip_h[i] = params.h[k];
+	  skip_g[i] = params.h[k] - T*params.s[k]/1000;
+	}
+      if (c[i] == 0 || c[i] == 3)
+	{
+	  at_h[i] = model.terminal_at_h;
+	  at_g[i] = model.terminal_at_g;
+	}
+    }
+
+  work.g.assign((band+1)*n, HAIRPIN_INF);
+  work.h.assign((band+1)*n, 0);
+  const double *zero = &work.h[0];  //diagonal 0 is never used: all 0
+
+  double best = HAIRPIN_INF, best_h = 0;
+  for (long d=HAIRPIN_MIN_LOOP+1; d<=band; d++)
+    {
+      long cells = n-d;
+      double *g = &work.g[d*n], *h = &work.h[d*n];
+
+      //The A-T penalty of the stem is taken once, on its outermost pair
+      if (d-1 <= HAIRPIN_MAX_LOOP)
+	for (long i=0; i<cells; i++)
+	  {
+	    g[i] = model.hairpin_g[d-1];
+	    h[i] = 0;
+	  }
+
+      if (d-2 > HAIRPIN_MIN_LOOP)
+	keep_lower(cells, g, h, &work.g[(d-2)*n+1], &work.h[(d-2)*n+1], 0, stack_g, stack_h, zero, zero);
+
+      for (int loop=1; loop<=HAIRPIN_MAX_INTERNAL && d-2-loop > HAIRPIN_MIN_LOOP; loop++)
+	{
+	  long inner = d-2-loop;
+	  for (int a=0; a<=loop; a++)
+	    {
+	      int b = loop-a;
+	      const double *inner_g = &work.g[inner*n+1+a], *inner_h = &work.h[inner*n+1+a];
+	      if (loop == 1)
+		keep_lower(cells, g, h, inner_g, inner_h, model.bulge_g[1], a == 1 ? skip_g : stack_g, a == 1 ? skip_h : stack_h, zero, zero);
+	      else if (a == 1 && b == 1)
+		for (long i=0; i<cells; i++)
+		  {
+		    long j = i+d;
+		    if ((c[i] | c[i+1] | c[i+2] | c[j] | c[j-1] | c[j-2]) >= 4) continue;
+		    int k1 = 64*c[i]+16*c[i+1]+4*c[j]+c[j-1], k2 = 64*c[i+1]+16*c[i+2]+4*c[j-1]+c[j-2];
+		    double ch = inner_h[i] + model.duplex.h[k1] + model.duplex.h[k2];
+		    double cg = inner_g[i] + model.duplex.h[k1] + model.duplex.h[k2] - T*(model.duplex.s[k1] + model.duplex.s[k2])/1000;
+		    if (cg < g[i])
+		      {
+			g[i] = cg;
+			h[i] = ch;
+		      }
+		  }
+	      else
+		{
+		  double loop_g = a == 0 || b == 0 ? model.bulge_g[loop] : model.internal_g[loop] + model.asymmetry_g*abs(a-b);
+		  keep_lower(cells, g, h, inner_g, inner_h, loop_g, at_g, at_h, at_g+1+a, at_h+1+a);
+		}
+	    }
+	}
+
+      //Only Watson-Crick pairs; the outermost pair ends a helix
+      for (long i=0; i<cells; i++)
+	{
+	  if (c[i] + c[i+d] != 3) g[i] = HAIRPIN_INF;
+	  double outer = g[i] + at_g[i];
+	  if (outer < best)
+	    {
+	      best = outer;
+	      best_h = h[i] + at_h[i];
+	      result.first = i;
+	      result.last = i+d;
+	    }
+	}
+    }
+
+  if (result.first < 0) return false;
+
+  //deltaS from deltaG at the folding temperature; then the salt shift of
+  //the Tm, deltaS and deltaG follow from it
+  result.deltah = best_h;
+  result.deltas = (best_h - best)*1000/T;
+  if (result.deltah < 0 && result.deltas < 0)
+    {
+      result.tm = result.deltah*1000/result.deltas + nn_salt_term(salt_conc);
+      result.deltas = result.deltah*1000/result.tm;
+    }
+  result.deltag = result.deltah - T*result.deltas/1000;
+
+  //A stem-loop that costs free energy does not form
+  return result.deltag < 0;
+}
+
+
+
+
+
+
+/***************************************  
+             Primer dimers
+***************************************/
+
+bool encode_dimer_primer(const char *sequence, size_t length, dimer_primer &primer)
+{
+  if (length < 2 || length > DIMER_MAX_LENGTH) return false;
+
+  primer.forward = primer.reverse = 0;
+  primer.length = length;
+  for (size_t i=0; i<length; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      if (code < 0) return false;
+      primer.codes[i] = code;
+      primer.forward |= (unsigned long long) code << 2*i;
+      primer.reverse |= (unsigned long long) code << 2*(length-1-i);
+    }
+  return true;
+}
+
+
+
+void prepare_dimer_model(const nn_params &params, double salt_conc, double dna_conc, int min_run, double max_deltag, dimer_model &model)
+{
+  mismatch_duplex_params(params, model.duplex);
+  for (int k=0; k<256; k++) model.g[k] = model.duplex.h[k] - DIMER_T*model.duplex.s[k]/1000;
+  model.salt_conc = salt_conc;
+  model.dna_conc = dna_conc;
+  model.min_run = min_run < 1 ? 1 : min_run;
+  model.max_deltag = max_deltag;
+}
+
+
+
+static inline unsigned long long dimer_lanes(int n)
+{
+  //Both bits of the first n bases
+  return n >= 32 ? ~0ULL : (1ULL << 2*n) - 1;
+}
+
+
+
+//Best segment of one offset (stacks only, kcal/mol and cal/(K mol))
+struct dimer_segment
+{
+  double g, h, s;
+  bool any_cg;
+  int shift, start, pairs;
+};
+
+
+
+static void score_dimer_offset(const dimer_primer &a, const dimer_primer &b, const dimer_model &model, int shift, int first, int overlap, dimer_segment &best)
+{
+  //Minimum deltaG run of stacks (Kadane), starting and ending on
+  //Watson-Crick pairs; an unknown stack (tandem mismatch) ends the run.
+  //Base i of a pairs with base b.length-1-(i-shift) of b
+
+  const nn_params &params = *model.duplex.params;
+  const int mirror = b.length-1+shift;
+
+  double g = 0, h = 0, s = 0;
+  int start = -1;
+  bool any_cg = false;
+  for (int i=first; i+1<first+overlap; i++)
+    {
+      int x = a.codes[i], y = a.codes[i+1];
+      int xb = b.codes[mirror-i], yb = b.codes[mirror-i-1];
+      int k = duplex_stack(x, y, xb, yb);
+      if (!model.duplex.known[k])
+	{
+	  start = -1;
+	  continue;
+	}
+      if (x + xb == 3 && (start < 0 || g > 0))
+	{
+	  g = h = s = 0;
+	  start = i;
+	  any_cg = x == 1 || x == 2;
+	}
+      if (start < 0) continue;
+
+      g += model.g[k];
+      h += model.duplex.h[k];
+      s += model.duplex.s[k];
+      if (y + yb != 3) continue;
+
+      any_cg = any_cg || y == 1 || y == 2;
+      double initiation = (any_cg ? params.any_cg : params.only_at) + params.non_self_compl;
+      double total = g - DIMER_T*initiation/1000;
+      if (total < best.g)
+	{
+	  best.g = total;
+	  best.h = h;
+	  best.s = s;
+	  best.any_cg = any_cg;
+	  best.shift = shift;
+	  best.start = start;
+	  best.pairs = i+2-start;
+	}
+    }
+}
+
+
+
+bool score_dimer(const dimer_primer &a, const dimer_primer &b, const dimer_model &model, primer_dimer &dimer)
+{
+  //Offset shift puts base i-shift of reversed b under base i of a. Bit 2i
+  //of (x & x>>1) is set where lane i holds complementary bases (x XOR
+  //y == 3); min_run-1 shifted ANDs leave the starts of the runs
+
+  const unsigned long long low = 0x5555555555555555ULL;
+  dimer_segment best;
+  best.g = HUGE_VAL;
+  best.start = -1;
+
+  for (int shift=1-b.length; shift<a.length; shift++)
+    {
+      int first = shift > 0 ? shift : 0;
+      int overlap = min(a.length-first, b.length-(first-shift));
+      if (overlap < 2) continue;
+
+      unsigned long long x, lanes;
+      if (shift >= 0)
+	{
+	  x = a.forward ^ (b.reverse << 2*shift);
+	  lanes = dimer_lanes(first+overlap) & ~dimer_lanes(first);
+	}
+      else
+	{
+	  x = a.forward ^ (b.reverse >> -2*shift);
+	  lanes = dimer_lanes(overlap);
+	}
+      unsigned long long runs = x & (x >> 1) & low & lanes;
+      for (int r=1; r<model.min_run && runs; r++) runs &= runs >> 2;
+      if (!runs) continue;
+
+      score_dimer_offset(a, b, model, shift, first, overlap, best);
+    }
+
+  if (best.start < 0) return false;
+
+  //Initiation as for a duplex of two different strands, then the salt
+  //shift of the Tm carried over to deltaS and deltaG as for hairpins
+  const nn_params &params = *model.duplex.params;
+  dimer.deltah = best.h;
+  dimer.deltas = best.s + (best.any_cg ? params.any_cg : params.only_at) + params.non_self_compl;
+  if (dimer.deltah < 0 && dimer.deltas < 0)
+    dimer.deltas = dimer.deltah*1000/(dimer.deltah*1000/dimer.deltas + nn_salt_term(model.salt_conc));
+  dimer.deltag = dimer.deltah - DIMER_T*dimer.deltas/1000;
+  dimer.tm = nn_melting_temperature(params, best.h, best.s, false, best.any_cg, model.salt_conc, model.dna_conc) - 273.15;
+  dimer.start_first = best.start;
+  dimer.start_second = b.length-1-(best.start-best.shift);
+  dimer.pairs = best.pairs;
+  return true;
+}
+
+
+
+void screen_dimers(const vector<dimer_primer> &primers, size_t first, const dimer_model &model, vector<primer_dimer> &conflicts)
+{
+  conflicts.clear();
+  primer_dimer dimer;
+  for (size_t second=first; second<primers.size(); second++)
+    {
+      if (!score_dimer(primers[first], primers[second], model, dimer) || dimer.deltag > model.max_deltag) continue;
+      dimer.first = first;
+      dimer.second = second;
+      conflicts.push_back(dimer);
+    }
+}
+
+
+
+
+
+
+/***************************************  
+      Degenerate (IUPAC) sequences
+***************************************/
+
+unsigned char iupac_mask[256];
+
+static bool init_iupac_mask()
+{
+  static const char codes[] = "ACMGRSVTWYHKDBN";
+  for (int c=0; c<256; c++) iupac_mask[c] = 0;
+  for (int k=0; codes[k]; k++) iupac_mask[(unsigned char) codes[k]] = k+1;
+  return true;
+}
+
+static bool iupac_mask_ready = init_iupac_mask();
+
+
+
+//Best expansion for a given lambda: stacking sums, whether it has a C or
+//G and whether it is self-complementary
+struct chain_path
+{
+  double value;
+  double h, s;
+  bool any_cg;
+  bool self_compl;
+};
+
+
+
+static chain_path extreme_chain(const vector<unsigned char> &masks, const nn_params &params, double lambda, const double den_const[2], double sign)
+{
+  //Minimize sign*(A - lambda*B) over the expansions, with A = -1000*deltaH
+  //and B = -(deltaS + den_const[any_cg]) the numerator and denominator of
+  //the Tm (both positive). Viterbi over states (base, C or G seen so far);
+  //a position that is not a base ends the chain, carry[] holds the best
+  //paths up to it
+
+  const double inf = HUGE_VAL;
+  chain_path cur[4][2], next[4][2], carry[2];
+  carry[0].value = 0;
+  carry[0].h = carry[0].s = 0;
+  carry[0].any_cg = false;
+  carry[1].value = inf;
+  unsigned char previous = 0;
+
+  for (size_t i=0; i<=masks.size(); i++)
+    {
+      unsigned char mask = i < masks.size() ? masks[i] : 0;
+      if (mask == 0)
+	{
+	  if (previous)
+	    for (int f=0; f<2; f++)
+	      {
+		carry[f].value = inf;
+		for (int y=0; y<4; y++)
+		  if ((previous >> y & 1) && cur[y][f].value < carry[f].value) carry[f] = cur[y][f];
+	      }
+	  previous = 0;
+	  continue;
+	}
+
+      for (int x=0; x<4; x++)
+	for (int f=0; f<2; f++) next[x][f].value = inf;
+
+      for (int x=0; x<4; x++)
+	{
+	  if (!(mask >> x & 1)) continue;
+	  int cg = x == 1 || x == 2;
+	  for (int f=0; f<2; f++)
+	    {
+	      chain_path &to = next[x][f | cg];
+	      if (!previous)
+		{
+		  if (carry[f].value < to.value) to = carry[f];
+		  continue;
+		}
+	      for (int y=0; y<4; y++)
+		{
+		  if (!(previous >> y & 1) || cur[y][f].value == inf) continue;
+		  int k = 4*y+x;
+		  double value = cur[y][f].value + sign*(-1000*params.h[k] + lambda*params.s[k]);
+		  if (value < to.value)
+		    {
+		      to.value = value;
+		      to.h = cur[y][f].h + params.h[k];
+		      to.s = cur[y][f].s + params.s[k];
+		    }
+		}
+	    }
+	}
+
+      for (int x=0; x<4; x++)
+	for (int f=0; f<2; f++)
+	  {
+	    cur[x][f] = next[x][f];
+	    cur[x][f].any_cg = f;
+	  }
+      previous = mask;
+    }
+
+  chain_path best;
+  best.value = inf;
+  best.self_compl = false;
+  for (int f=0; f<2; f++)
+    {
+      if (carry[f].value == inf) continue;
+      double value = carry[f].value + sign*lambda*den_const[f];
+      if (value < best.value)
+	{
+	  best = carry[f];
+	  best.value = value;
+	  best.self_compl = false;
+	}
+    }
+  return best;
+}
+
+
+
+static bool may_be_self_complementary(const vector<unsigned char> &masks)
+{
+  //True if some expansion is equal to its reverse complement: even
+  //length, only IUPAC codes, and every position shares a base with the
+  //complement of its mirror (the complement of a set reverses its bits)
+
+  size_t length = masks.size();
+  if (length == 0 || length % 2) return false;
+  for (size_t i=0; i<length/2; i++)
+    {
+      unsigned char mirror = masks[length-1-i];
+      unsigned char complement = (mirror & 1) << 3 | (mirror & 2) << 1 | (mirror & 4) >> 1 | (mirror & 8) >> 3;
+      if (!(masks[i] & complement)) return false;
+    }
+  return true;
+}
+
+
+
+static chain_path folded_chain(const vector<unsigned char> &masks, const nn_params &params, double lambda, const double den_const[2][2], double sign)
+{
+  //extreme_chain() over the positions taken in mirror pairs (i, L-1-i),
+  //from the ends inwards, for a sequence that may have self-complementary
+  //expansions (may_be_self_complementary()). States are (base at i, base
+  //at L-1-i, C or G seen, some pair not complementary), so the
+  //self-complementary expansions get their own corrections
+  //(den_const[self_compl][any_cg]) and the others theirs. Pair p adds the
+  //stacks (p-1, p) and (L-1-p, L-p); the last pair adds the middle stack
+
+  const double inf = HUGE_VAL;
+  size_t length = masks.size(), pairs = length/2;
+  chain_path cur[16][2][2], next[16][2][2];
+
+  for (int b=0; b<16; b++)
+    for (int f=0; f<2; f++)
+      for (int d=0; d<2; d++) cur[b][f][d].value = inf;
+
+  for (size_t p=0; p<pairs; p++)
+    {
+      unsigned char left = masks[p], right = masks[length-1-p];
+      for (int b=0; b<16; b++)
+	for (int f=0; f<2; f++)
+	  for (int d=0; d<2; d++) next[b][f][d].value = inf;
+
+      for (int x=0; x<4; x++)
+	for (int y=0; y<4; y++)
+	  {
+	    if (!(left >> x & 1) || !(right >> y & 1)) continue;
+	    int cg = x == 1 || x == 2 || y == 1 || y == 2;
+	    int differs = y != 3-x;
+
+	    if (p == 0)
+	      {
+		chain_path &to = next[4*x+y][cg][differs];
+		to.value = 0;
+		to.h = to.s = 0;
+		continue;
+	      }
+
+	    for (int b=0; b<16; b++)
+	      {
+		int x0 = b/4, y0 = b%4;
+		int outer = 4*x0+x, inner = 4*y+y0;
+		double step = sign*(-1000*(params.h[outer]+params.h[inner]) + lambda*(params.s[outer]+params.s[inner]));
+		for (int f=0; f<2; f++)
+		  for (int d=0; d<2; d++)
+		    {
+		      const chain_path &from = cur[b][f][d];
+		      if (from.value == inf) continue;
+		      chain_path &to = next[4*x+y][f | cg][d | differs];
+		      if (from.value + step < to.value)
+			{
+			  to.value = from.value + step;
+			  to.h = from.h + params.h[outer] + params.h[inner];
+			  to.s = from.s + params.s[outer] + params.s[inner];
+			}
+		    }
+	      }
+	  }
+
+      for (int b=0; b<16; b++)
+	for (int f=0; f<2; f++)
+	  for (int d=0; d<2; d++) cur[b][f][d] = next[b][f][d];
+    }
+
+  chain_path best;
+  best.value = inf;
+  for (int b=0; b<16; b++)
+    for (int f=0; f<2; f++)
+      for (int d=0; d<2; d++)
+	{
+	  const chain_path &path = cur[b][f][d];
+	  if (path.value == inf) continue;
+	  int middle = b;  //stack (L/2-1, L/2)
+	  double value = path.value + sign*(-1000*params.h[middle] + lambda*(params.s[middle] + den_const[!d][f]));
+	  if (value < best.value)
+	    {
+	      best.value = value;
+	      best.h = path.h + params.h[middle];
+	      best.s = path.s + params.s[middle];
+	      best.any_cg = f;
+	      best.self_compl = !d;
+	    }
+	}
+  return best;
+}
+
+
+
+static double extreme_melting_temperature(const vector<unsigned char> &masks, const nn_params &params, double salt_conc, double dna_conc, double sign)
+{
+  //Dinkelbach iterations: lambda = A/B of the current expansion, then the
+  //expansion minimizing sign*(A - lambda*B); stops when none improves the
+  //ratio, which is then the lowest (sign 1) or highest (sign -1) A/B.
+  //Few iterations are needed, each one is linear in the length
+
+  double den_const[2][2];   //[self_compl][any_cg]
+  for (int c=0; c<2; c++)
+    for (int f=0; f<2; f++)
+      den_const[c][f] = (f ? params.any_cg : params.only_at) + (c ? params.simm_corr : params.non_self_compl) + nn_dna_term(dna_conc, c);
+
+  bool folded = may_be_self_complementary(masks);
+  chain_path path = folded ? folded_chain(masks, params, 0, den_const, sign) : extreme_chain(masks, params, 0, den_const[0], sign);
+  for (int iteration=0; iteration<64; iteration++)
+    {
+      double lambda = -1000*path.h/-(path.s + den_const[path.self_compl][path.any_cg]);
+      chain_path better = folded ? folded_chain(masks, params, lambda, den_const, sign) : extreme_chain(masks, params, lambda, den_const[0], sign);
+      if (better.value >= -1e-9*fabs(1000*path.h)) break;
+      path = better;
+    }
+
+  return nn_melting_temperature(params, path.h, path.s, path.self_compl, path.any_cg, salt_conc, dna_conc);
+}
+
+
+
+static double mean_melting_temperature(const vector<unsigned char> &masks, const nn_params &params, bool self_compl, double only_at, double salt_conc, double dna_conc)
+{
+  //Mean Tm (K) over the expansions to second order in the spread of the
+  //sums: E[N/D] ~ mN/mD - cov(N,D)/mD^2 + mN var(D)/mD^3, with N the
+  //numerator 1000*deltaH and D the denominator deltaS + initiation + ...
+  //of the Tm. The moments are exact: positions are independent, so only
+  //stacks sharing a base are correlated. The initiation is only_at with
+  //probability only_at (expansions with only A and T), any_cg otherwise
+
+  double mean_h = 0, mean_s = 0, var_h = 0, var_s = 0, cov_hs = 0;
+  double cov_hi = 0, cov_si = 0;   //with the any_cg indicator
+  double given_h[4], given_s[4];   //previous stack, mean given its second base
+  double previous_h = 0, previous_s = 0;
+  bool previous = false;
+
+  for (size_t i=0; i+1<masks.size(); i++)
+    {
+      unsigned char a = masks[i], b = masks[i+1];
+      if (a == 0 || b == 0)
+	{
+	  previous = false;
+	  continue;
+	}
+
+      double na = __builtin_popcount(a), nb = __builtin_popcount(b);
+      double eh = 0, es = 0, ehh = 0, ess = 0, ehs = 0, at_h = 0, at_s = 0;
+      double row_h[4] = {0, 0, 0, 0}, row_s[4] = {0, 0, 0, 0};
+      double next_h[4] = {0, 0, 0, 0}, next_s[4] = {0, 0, 0, 0};
+      for (int x=0; x<4; x++)
+	for (int y=0; y<4; y++)
+	  {
+	    if (!(a >> x & 1) || !(b >> y & 1)) continue;
+	    double h = params.h[4*x+y], s = params.s[4*x+y];
+	    eh += h; es += s;
+	    ehh += h*h; ess += s*s; ehs += h*s;
+	    row_h[x] += h/nb; row_s[x] += s/nb;
+	    next_h[y] += h/na; next_s[y] += s/na;
+	    if ((x == 0 || x == 3) && (y == 0 || y == 3))
+	      {
+		at_h += h;
+		at_s += s;
+	      }
+	  }
+      eh /= na*nb; es /= na*nb;
+      mean_h += eh;
+      mean_s += es;
+      var_h += ehh/(na*nb) - eh*eh;
+      var_s += ess/(na*nb) - es*es;
+      cov_hs += ehs/(na*nb) - eh*es;
+
+      //cov(stack, [any C or G]) = -only_at*(E[stack | only A and T] - E[stack])
+      int at_pairs = __builtin_popcount(a & 9)*__builtin_popcount(b & 9);
+      if (at_pairs)
+	{
+	  cov_hi -= only_at*(at_h/at_pairs - eh);
+	  cov_si -= only_at*(at_s/at_pairs - es);
+	}
+
+      //Stacks i-1 and i share base i
+      if (previous)
+	{
+	  double hh = 0, ss = 0, hs = 0;
+	  for (int x=0; x<4; x++)
+	    {
+	      if (!(a >> x & 1)) continue;
+	      hh += given_h[x]*row_h[x];
+	      ss += given_s[x]*row_s[x];
+	      hs += given_h[x]*row_s[x] + given_s[x]*row_h[x];
+	    }
+	  var_h += 2*(hh/na - previous_h*eh);
+	  var_s += 2*(ss/na - previous_s*es);
+	  cov_hs += hs/na - previous_h*es - previous_s*eh;
+	}
+
+      for (int y=0; y<4; y++)
+	{
+	  given_h[y] = next_h[y];
+	  given_s[y] = next_s[y];
+	}
+      previous_h = eh;
+      previous_s = es;
+      previous = true;
+    }
+
+  double deltas_self = self_compl ? params.simm_corr : params.non_self_compl;
+  double step = params.any_cg - params.only_at;
+  double mean_n = 1000*mean_h;
+  double mean_d = mean_s + params.only_at + step*(1-only_at) + deltas_self + nn_dna_term(dna_conc, self_compl);
+  double var_d = var_s + step*step*only_at*(1-only_at) + 2*step*cov_si;
+  double cov_nd = 1000*(cov_hs + step*cov_hi);
+
+  return mean_n/mean_d - cov_nd/(mean_d*mean_d) + mean_n*var_d/(mean_d*mean_d*mean_d) + nn_salt_term(salt_conc);
+}
+
+
+
+int degenerate_melting(const char *sequence, size_t length, double salt_conc, double dna_conc, degenerate_result &result)
+{
+  //Every base of a position is equally likely
+
+  vector<unsigned char> masks(length);
+  result.expansions = 1;
+  result.ambiguous = 0;
+  bool any_base = false;
+  double only_at = 1;
+  for (size_t i=0; i<length; i++)
+    {
+      if (sequence[i] == 'U') return MELTING_URACIL;
+      unsigned char mask = iupac_mask[(unsigned char) sequence[i]];
+      masks[i] = mask;
+      if (mask == 0) continue;
+
+      int bases = __builtin_popcount(mask);
+      any_base = true;
+      result.expansions *= bases;
+      if (bases > 1) result.ambiguous++;
+      only_at *= double(__builtin_popcount(mask & 9))/bases;
+    }
+  if (!any_base) return MELTING_EMPTY;
+
+  bool self_compl = result.ambiguous == 0 && is_self_complementary(sequence, length);
+
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      const nn_params &params = *nn_models[m];
+      result.tm_min[m] = extreme_melting_temperature(masks, params, salt_conc, dna_conc, 1) - 273.15;
+      result.tm_max[m] = extreme_melting_temperature(masks, params, salt_conc, dna_conc, -1) - 273.15;
+
+      result.tm_mean[m] = mean_melting_temperature(masks, params, self_compl, only_at, salt_conc, dna_conc) - 273.15;
+    }
+
+  return MELTING_OK;
+}
+
+
+
+
+
+
+/***************************************  
+         Single-base variants
+***************************************/
+
+//Polynomial hashes (mod 2^64) of the prefixes of a sequence, to compare
+//pieces of it and of its reverse complement in constant time
+struct prefix_hash
+{
+  vector<unsigned long long> prefix, power;
+
+  void build(const unsigned char *codes, size_t length)
+  {
+    const unsigned long long base = 1000003;
+    prefix.assign(length+1, 0);
+    power.assign(length+1, 1);
+    for (size_t i=0; i<length; i++)
+      {
+	prefix[i+1] = prefix[i]*base + codes[i] + 1;
+	power[i+1] = power[i]*base;
+      }
+  }
+
+  unsigned long long piece(size_t first, size_t last) const
+  {
+    return prefix[last] - prefix[first]*power[last-first];
+  }
+
+  unsigned long long join(unsigned long long left, unsigned long long right, size_t right_length) const
+  {
+    return left*power[right_length] + right;
+  }
+};
+
+
+
+static bool variant_self_complementary(const vector<unsigned char> &codes, const prefix_hash &forward, const prefix_hash &reverse, size_t first, size_t last, int middle)
+{
+  //The variant is codes[0, first) + middle (-1: none) + codes[last, n),
+  //its reverse complement reverse[0, n-last) + complement of middle +
+  //reverse[n-first, n). Equal hashes are confirmed base by base
+
+  size_t n = codes.size();
+  size_t length = n - (last-first) + (middle >= 0);
+  if (length == 0 || length % 2) return false;
+
+  unsigned long long v = forward.piece(0, first), r = reverse.piece(0, n-last);
+  if (middle >= 0)
+    {
+      v = forward.join(v, middle+1, 1);
+      r = forward.join(r, 3-middle+1, 1);
+    }
+  v = forward.join(v, forward.piece(last, n), n-last);
+  r = forward.join(r, reverse.piece(n-first, n), first);
+  if (v != r) return false;
+
+  string variant;
+  for (size_t i=0; i<first; i++) variant += "ACGT"[codes[i]];
+  if (middle >= 0) variant += "ACGT"[middle];
+  for (size_t i=last; i<n; i++) variant += "ACGT"[codes[i]];
+  return is_self_complementary(variant.data(), variant.length());
+}
+
+
+
+long scan_variants(const char *sequence, size_t length, double salt_conc, double dna_conc, bool indels, double baseline_tm[NN_MODELS], vector<sequence_variant> &variants)
+{
+  //A variant replaces codes[first, last) (one base or none) by middle
+  //(one base or none): the dinucleotides of the local chain
+  //codes[first-1], codes[first, last), codes[last] are replaced by those
+  //of codes[first-1], middle, codes[last]. The sums are taken again from
+  //the 16-entry histogram, as for the sequence itself
+
+  variants.clear();
+  if (length == 0) return -1;
+
+  vector<unsigned char> codes(length), complement(length);
+  for (size_t i=0; i<length; i++)
+    {
+      int code = base_code[(unsigned char) sequence[i]];
+      if (code < 0) return -1;
+      codes[i] = code;
+    }
+  for (size_t i=0; i<length; i++) complement[i] = 3-codes[length-1-i];
+
+  prefix_hash forward, reverse;
+  forward.build(&codes[0], length);
+  reverse.build(&complement[0], length);
+
+  sequence_thermo thermo;
+  summarize_sequence(sequence, length, thermo);
+  for (int m=0; m<NN_MODELS; m++) baseline_tm[m] = nn_melting_temperature(thermo, m, salt_conc, dna_conc) - 273.15;
+
+  static const char letters[4] = {'A', 'C', 'G', 'T'};
+  sequence_thermo changed;
+  for (size_t position=0; position<=length; position++)
+    for (int type=VARIANT_SUBSTITUTION; type<=VARIANT_DELETION; type++)
+      for (int base=0; base<4; base++)
+	{
+	  //One of each distinct variant
+	  if (type == VARIANT_SUBSTITUTION && (position == length || base == codes[position])) continue;
+	  if (type != VARIANT_SUBSTITUTION && !indels) continue;
+	  if (type == VARIANT_INSERTION && position > 0 && codes[position-1] == base) continue;
+	  if (type == VARIANT_DELETION && (base > 0 || position == length || length == 1 || (position > 0 && codes[position-1] == codes[position]))) continue;
+
+	  size_t first = position, last = type == VARIANT_INSERTION ? position : position+1;
+	  int middle = type == VARIANT_DELETION ? -1 : base;
+
+	  long counts[4], dinucleotides[16];
+	  for (int k=0; k<4; k++) counts[k] = thermo.counts[k];
+	  for (int k=0; k<16; k++) dinucleotides[k] = thermo.dinucleotides[k];
+
+	  int before[3], after[3], nb = 0, na = 0;
+	  if (first > 0) before[nb++] = after[na++] = codes[first-1];
+	  if (last > first)
+	    {
+	      before[nb++] = codes[first];
+	      counts[codes[first]]--;
+	    }
+	  if (middle >= 0)
+	    {
+	      after[na++] = middle;
+	      counts[middle]++;
+	    }
+	  if (last < length) before[nb++] = after[na++] = codes[last];
+	  for (int k=0; k+1<nb; k++) dinucleotides[4*before[k]+before[k+1]]--;
+	  for (int k=0; k+1<na; k++) dinucleotides[4*after[k]+after[k+1]]++;
+
+	  bool self_compl = variant_self_complementary(codes, forward, reverse, first, last, middle);
+	  summarize_composition(length - (last-first) + (middle >= 0), counts, dinucleotides, self_compl, changed);
+
+	  sequence_variant variant;
+	  variant.position = position;
+	  variant.type = type;
+	  variant.ref = last > first ? letters[codes[first]] : '-';
+	  variant.alt = middle >= 0 ? letters[middle] : '-';
+	  for (int m=0; m<NN_MODELS; m++)
+	    variant.delta_tm[m] = nn_melting_temperature(changed, m, salt_conc, dna_conc) - 273.15 - baseline_tm[m];
+	  variants.push_back(variant);
+	}
+
+  return variants.size();
+}
+
+
+
+
+
+
+/***************************************  
+            Inverse design
+***************************************/
+
+//splitmix64: small, fast and the same on every platform
+struct design_random
+{
+  unsigned long long state;
+
+  unsigned long long next()
+  {
+    unsigned long long z = (state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+  }
+
+  double uniform()
+  {
+    return (next() >> 11) * (1.0/9007199254740992.0);
+  }
+};
+
+
+
+static int run_excess(const vector<unsigned char> &codes, size_t first, size_t last, int max_run)
+{
+  //Bases beyond max_run in the runs of [first, last), which must start
+  //and end on run boundaries
+
+  int excess = 0;
+  size_t start = first;
+  for (size_t i=first+1; i<=last; i++)
+    if (i == last || codes[i] != codes[start])
+      {
+	if ((int) (i-start) > max_run) excess += i-start-max_run;
+	start = i;
+      }
+  return excess;
+}
+
+
+
+//State of a chain: the sums and counts the penalty needs
+struct design_state
+{
+  vector<unsigned char> codes;
+  double deltah[NN_MODELS], deltas[NN_MODELS];
+  int gc, clamp, excess;
+};
+
+
+
+static double design_penalty(const primer_constraints &c, const design_state &state)
+{
+  size_t length = state.codes.size();
+  double penalty = 0;
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      if (!(c.tm_models & (1 << m))) continue;
+      double tm = nn_melting_temperature(*nn_models[m], state.deltah[m], state.deltas[m], false, state.gc > 0, c.salt_conc, c.dna_conc)-273.15;
+      if (tm < c.tm_min[m]) penalty += c.tm_min[m] - tm;
+      if (tm > c.tm_max[m]) penalty += tm - c.tm_max[m];
+    }
+
+  double gc = 100.0*state.gc/length;
+  if (gc < c.gc_min) penalty += (c.gc_min - gc)*length/100;
+  if (gc > c.gc_max) penalty += (gc - c.gc_max)*length/100;
+  if (state.clamp < c.clamp_min) penalty += c.clamp_min - state.clamp;
+  if (state.clamp > c.clamp_max) penalty += state.clamp - c.clamp_max;
+  return penalty + state.excess;
+}
+
+
+
+static void design_mutate(design_state &state, size_t position, int code, int max_run)
+{
+  //Only the two stacks, the GC and clamp counts and the runs around the
+  //base change
+
+  vector<unsigned char> &codes = state.codes;
+  size_t length = codes.size();
+  int old = codes[position];
+  size_t clamp_start = length > PRIMER_CLAMP_BASES ? length-PRIMER_CLAMP_BASES : 0;
+
+  //Runs touching position-1..position+1 are in [first, last)
+  size_t first = position, last = position+1;
+  if (position > 0)
+    for (first = position-1; first > 0 && codes[first-1] == codes[position-1]; first--);
+  if (position+1 < length)
+    for (last = position+2; last < length && codes[last] == codes[position+1]; last++);
+  if (max_run > 0) state.excess -= run_excess(codes, first, last, max_run);
+
+  for (int m=0; m<NN_MODELS; m++)
+    {
+      const nn_params &params = *nn_models[m];
+      if (position > 0)
+	{
+	  state.deltah[m] += params.h[4*codes[position-1]+code] - params.h[4*codes[position-1]+old];
+	  state.deltas[m] += params.s[4*codes[position-1]+code] - params.s[4*codes[position-1]+old];
+	}
+      if (position+1 < length)
+	{
+	  state.deltah[m] += params.h[4*code+codes[position+1]] - params.h[4*old+codes[position+1]];
+	  state.deltas[m] += params.s[4*code+codes[position+1]] - params.s[4*old+codes[position+1]];
+	}
+    }
+
+  int gc_change = (code == 1 || code == 2) - (old == 1 || old == 2);
+  state.gc += gc_change;
+  if (position >= clamp_start) state.clamp += gc_change;
+
+  codes[position] = code;
+  if (max_run > 0) state.excess += run_excess(codes, first, last, max_run);
+}
+
+
+
+bool anneal_design(const primer_constraints &constraints, size_t length, long steps, unsigned long long seed, string &sequence)
+{
+  //Metropolis moves of one base to another one. The sums are updated in
+  //place (a rejected move is undone by the opposite move) and taken
+  //again from the sequence every refresh moves against drift.
+  //Stops as soon as the penalty is 0
+
+  static const char letters[4] = {'A', 'C', 'G', 'T'};
+  const int max_run = constraints.max_run;
+  const long refresh = 4096;
+
+  sequence.clear();
+  if (length < 2) return false;
+
+  design_random random = {seed};
+  design_state state;
+  state.codes.resize(length);
+  for (size_t i=0; i<length; i++) state.codes[i] = random.next() >> 62;
+
+  double temperature = DESIGN_T_START;
+  double cooling = steps > 1 ? pow(DESIGN_T_END/DESIGN_T_START, 1.0/(steps-1)) : 1;
+  double penalty = 0;
+
+  for (long step=0; step<=steps; step++)
+    {
+      if (step % refresh == 0)
+	{
+	  long counts[4] = {0, 0, 0, 0}, dinucleotides[16];
+	  for (int k=0; k<16; k++) dinucleotides[k] = 0;
+	  for (size_t i=0; i<length; i++)
+	    {
+	      counts[state.codes[i]]++;
+	      if (i > 0) dinucleotides[4*state.codes[i-1]+state.codes[i]]++;
+	    }
+	  nn_sum sum;
+	  nn_sums_from_histogram(dinucleotides, sum);
+	  for (int m=0; m<NN_MODELS; m++)
+	    {
+	      state.deltah[m] = sum.deltah[m];
+	      state.deltas[m] = sum.deltas[m];
+	    }
+	  state.gc = counts[1] + counts[2];
+	  state.clamp = 0;
+	  for (size_t i=length > PRIMER_CLAMP_BASES ? length-PRIMER_CLAMP_BASES : 0; i<length; i++)
+	    state.clamp += state.codes[i] == 1 || state.codes[i] == 2;
+	  state.excess = max_run > 0 ? run_excess(state.codes, 0, length, max_run) : 0;
+	  penalty = design_penalty(constraints, state);
+	}
+      if (penalty == 0 || step == steps) break;
+
+      size_t position = random.next() % length;
+      int old = state.codes[position];
+      int code = (old + 1 + random.next() % 3) & 3;
+      design_mutate(state, position, code, max_run);
+
+      double proposed = design_penalty(constraints, state);
+      if (proposed <= penalty || random.uniform() < exp((penalty - proposed)/temperature)) penalty = proposed;
+      else design_mutate(state, position, old, max_run);
+      temperature *= cooling;
+    }
+
+  for (size_t i=0; i<length; i++) sequence += letters[state.codes[i]];
+
+  //From scratch, with the checks of the primer search
+  primer_constraints check = constraints;
+  check.min_length = check.max_length = length;
+  check.strands = PRIMER_FORWARD;
+  vector<primer_candidate> forward, reverse;
+  return find_primers(sequence.data(), length, check, 1, forward, reverse) > 0;
+}